@@ -86,6 +86,12 @@ struct etekcity_data {
 	uint8_t profiles[(ETEKCITY_PROFILE_MAX + 1)][ETEKCITY_REPORT_SIZE_PROFILE];
 	struct etekcity_settings_report settings[(ETEKCITY_PROFILE_MAX + 1)];
 	struct etekcity_macro macros[(ETEKCITY_PROFILE_MAX + 1)][(ETEKCITY_BUTTON_MAX + 1)];
+
+	/* the reports as last read from or written to the device. A report
+	 * that still matches its copy is not written again. */
+	uint8_t profiles_shadow[(ETEKCITY_PROFILE_MAX + 1)][ETEKCITY_REPORT_SIZE_PROFILE];
+	struct etekcity_settings_report settings_shadow[(ETEKCITY_PROFILE_MAX + 1)];
+	struct etekcity_macro macros_shadow[(ETEKCITY_PROFILE_MAX + 1)][(ETEKCITY_BUTTON_MAX + 1)];
 };
 
 static char *
@@ -277,6 +283,17 @@ etekcity_current_profile(struct ratbag_device *device)
 	return buf[2];
 }
 
+static int
+etekcity_is_ready(struct ratbag_device *device)
+{
+	int rc;
+
+	/* the mouse stalls requests while it stores a write */
+	rc = etekcity_current_profile(device);
+
+	return rc < 0 ? rc : 0;
+}
+
 static int
 etekcity_set_current_profile(struct ratbag_device *device, unsigned int index)
 {
@@ -286,12 +303,16 @@ etekcity_set_current_profile(struct ratbag_device *device, unsigned int index)
 	if (index > ETEKCITY_PROFILE_MAX)
 		return -EINVAL;
 
+	/* a read is much cheaper than a write and the delay after it */
+	if (etekcity_current_profile(device) == (int)index)
+		return 0;
+
 	ret = ratbag_hidraw_raw_request(device, buf[0], buf, sizeof(buf),
 			HID_FEATURE_REPORT, HID_REQ_SET_REPORT);
+	if (ret != sizeof(buf))
+		return ret < 0 ? ret : -EIO;
 
-	msleep(100);
-
-	return ret == sizeof(buf) ? 0 : ret;
+	return ratbag_device_wait_ready(device);
 }
 
 static int
@@ -305,10 +326,10 @@ etekcity_set_config_profile(struct ratbag_device *device, uint8_t profile, uint8
 
 	ret = ratbag_hidraw_raw_request(device, buf[0], buf, sizeof(buf),
 				 HID_FEATURE_REPORT, HID_REQ_SET_REPORT);
+	if (ret != sizeof(buf))
+		return ret < 0 ? ret : -EIO;
 
-	msleep(100);
-
-	return ret == sizeof(buf) ? 0 : ret;
+	return ratbag_device_wait_ready(device);
 }
 
 static inline unsigned
@@ -471,6 +492,8 @@ etekcity_read_profile(struct ratbag_profile *profile, unsigned int index)
 	if (rc < ETEKCITY_REPORT_SIZE_SETTINGS)
 		return;
 
+	drv_data->settings_shadow[index] = *setting_report;
+
 	/* first retrieve the report rate, it is set per profile */
 	switch (setting_report->report_rate) {
 	case 0x00: report_rate = 125; break;
@@ -518,8 +541,11 @@ etekcity_read_profile(struct ratbag_profile *profile, unsigned int index)
 	rc = ratbag_hidraw_raw_request(device, ETEKCITY_REPORT_ID_KEY_MAPPING,
 			buf, ETEKCITY_REPORT_SIZE_PROFILE,
 			HID_FEATURE_REPORT, HID_REQ_GET_REPORT);
+	if (rc == ETEKCITY_REPORT_SIZE_PROFILE)
+		memcpy(drv_data->profiles_shadow[index], buf,
+		       ETEKCITY_REPORT_SIZE_PROFILE);
 
-	msleep(10);
+	ratbag_device_wait_ready(device);
 
 	for (i = 0; i < ETEKCITY_BUTTON_MAX; i++) {
 		const struct ratbag_button_action *action;
@@ -535,6 +561,8 @@ etekcity_read_profile(struct ratbag_profile *profile, unsigned int index)
 		rc = ratbag_hidraw_raw_request(device, ETEKCITY_REPORT_ID_MACRO,
 				buf, ETEKCITY_REPORT_SIZE_MACRO,
 				HID_FEATURE_REPORT, HID_REQ_GET_REPORT);
+		if (rc == ETEKCITY_REPORT_SIZE_MACRO)
+			drv_data->macros_shadow[index][i] = *macro;
 		log_info(device->ratbag,
 			 "macro on button %d of profile %d is named '%s', and contains %d events:\n",
 			 i, profile->index,
@@ -548,7 +576,7 @@ etekcity_read_profile(struct ratbag_profile *profile, unsigned int index)
 
 	}
 
-	msleep(10);
+	ratbag_device_wait_ready(device);
 
 	if (rc < ETEKCITY_REPORT_SIZE_PROFILE)
 		return;
@@ -558,30 +586,116 @@ etekcity_read_profile(struct ratbag_profile *profile, unsigned int index)
 		__FILE__, __LINE__);
 }
 
+static int
+etekcity_write_settings(struct ratbag_device *device, unsigned int index)
+{
+	struct etekcity_data *drv_data = ratbag_get_drv_data(device);
+	uint8_t *buf;
+	int rc;
+
+	buf = (uint8_t*)&drv_data->settings[index];
+	etekcity_set_config_profile(device, index, ETEKCITY_CONFIG_SETTINGS);
+	rc = ratbag_hidraw_raw_request(device, ETEKCITY_REPORT_ID_SETTINGS,
+				       buf, ETEKCITY_REPORT_SIZE_SETTINGS,
+				       HID_FEATURE_REPORT, HID_REQ_SET_REPORT);
+
+	if (rc < 0)
+		return rc;
+
+	if (rc != ETEKCITY_REPORT_SIZE_SETTINGS)
+		return -EIO;
+
+	drv_data->settings_shadow[index] = drv_data->settings[index];
+
+	return ratbag_device_wait_ready(device);
+}
+
+static inline bool
+etekcity_settings_dirty(struct etekcity_data *drv_data, unsigned int index)
+{
+	return memcmp(&drv_data->settings[index],
+		      &drv_data->settings_shadow[index],
+		      sizeof(drv_data->settings[index])) != 0;
+}
+
+static int
+etekcity_write_macro(struct ratbag_device *device,
+		     unsigned int index,
+		     unsigned int button)
+{
+	struct etekcity_data *drv_data = ratbag_get_drv_data(device);
+	struct etekcity_macro *macro = &drv_data->macros[index][button];
+	int rc;
+
+	etekcity_set_config_profile(device, index, button);
+	rc = ratbag_hidraw_raw_request(device, ETEKCITY_REPORT_ID_MACRO,
+				       (uint8_t*)macro, ETEKCITY_REPORT_SIZE_MACRO,
+				       HID_FEATURE_REPORT, HID_REQ_SET_REPORT);
+
+	if (rc < 0)
+		return rc;
+
+	if (rc != ETEKCITY_REPORT_SIZE_MACRO)
+		return -EIO;
+
+	drv_data->macros_shadow[index][button] = *macro;
+
+	return ratbag_device_wait_ready(device);
+}
+
 static int
 etekcity_write_profile(struct ratbag_profile *profile)
 {
 	struct ratbag_device *device = profile->device;
 	unsigned int index = profile->index;
 	struct etekcity_data *drv_data;
+	unsigned int i;
 	int rc;
 	uint8_t *buf;
 
 	assert(index <= ETEKCITY_PROFILE_MAX);
 
 	drv_data = ratbag_get_drv_data(device);
+
+	/* only the reports that differ from the device are written */
+	if (etekcity_settings_dirty(drv_data, index)) {
+		rc = etekcity_write_settings(device, index);
+		if (rc)
+			return rc;
+	}
+
+	/* the macros first, the key mapping may refer to them */
+	for (i = 0; i < ETEKCITY_BUTTON_MAX; i++) {
+		if (memcmp(&drv_data->macros[index][i],
+			   &drv_data->macros_shadow[index][i],
+			   sizeof(struct etekcity_macro)) == 0)
+			continue;
+
+		rc = etekcity_write_macro(device, index, i);
+		if (rc)
+			return rc;
+	}
+
 	buf = drv_data->profiles[index];
+	if (memcmp(buf, drv_data->profiles_shadow[index],
+		   ETEKCITY_REPORT_SIZE_PROFILE) == 0)
+		return 0;
 
 	etekcity_set_config_profile(device, index, ETEKCITY_CONFIG_KEY_MAPPING);
 	rc = ratbag_hidraw_raw_request(device, ETEKCITY_REPORT_ID_KEY_MAPPING,
 			buf, ETEKCITY_REPORT_SIZE_PROFILE,
 			HID_FEATURE_REPORT, HID_REQ_SET_REPORT);
 
-	msleep(100);
-
 	if (rc < 50)
 		return -EIO;
 
+	rc = ratbag_device_wait_ready(device);
+	if (rc)
+		return rc;
+
+	memcpy(drv_data->profiles_shadow[index], buf,
+	       ETEKCITY_REPORT_SIZE_PROFILE);
+
 	log_raw(device->ratbag, "profile: %d written %s:%d\n",
 		buf[2],
 		__FILE__, __LINE__);
@@ -628,8 +742,6 @@ etekcity_write_resolution_dpi(struct ratbag_resolution *resolution, int dpi)
 	struct etekcity_data *drv_data = ratbag_get_drv_data(device);
 	struct etekcity_settings_report *settings_report;
 	unsigned int index;
-	uint8_t *buf;
-	int rc;
 
 	if (dpi < 50 || dpi > 8200 || dpi % 50)
 		return -EINVAL;
@@ -645,26 +757,18 @@ etekcity_write_resolution_dpi(struct ratbag_resolution *resolution, int dpi)
 	settings_report->xres[index] = dpi / 50;
 	settings_report->yres[index] = dpi / 50;
 
-	buf = (uint8_t*)settings_report;
-	etekcity_set_config_profile(device, profile->index, ETEKCITY_CONFIG_SETTINGS);
-	rc = ratbag_hidraw_raw_request(device, ETEKCITY_REPORT_ID_SETTINGS,
-				       buf, ETEKCITY_REPORT_SIZE_SETTINGS,
-				       HID_FEATURE_REPORT, HID_REQ_SET_REPORT);
-
-	if (rc < 0)
-		return rc;
-
-	if (rc != ETEKCITY_REPORT_SIZE_SETTINGS)
-		return -EIO;
+	/* written by .write_profile() on commit */
+	if (ratbag_device_in_transaction(device) ||
+	    !etekcity_settings_dirty(drv_data, profile->index))
+		return 0;
 
-	return 0;
+	return etekcity_write_settings(device, profile->index);
 }
 
 static int
 etekcity_probe(struct ratbag_device *device, const struct ratbag_id id)
 {
 	int rc;
-	struct ratbag_profile *profile;
 	struct etekcity_data *drv_data;
 	int active_idx;
 
@@ -698,19 +802,15 @@ etekcity_probe(struct ratbag_device *device, const struct ratbag_id id)
 		goto err;
 	}
 
-	list_for_each(profile, &device->profiles, link) {
-		if (profile->index == (unsigned int)active_idx) {
-			profile->is_active = true;
-			break;
-		}
-	}
+	/* the profiles are not read yet, but the active one can be
+	 * marked already */
+	if ((unsigned int)active_idx < device->num_profiles)
+		device->profiles[active_idx].is_active = true;
 
 	log_raw(device->ratbag,
 		"'%s' is in profile %d\n",
 		ratbag_device_get_name(device),
-		profile->index);
-
-	profile = ratbag_profile_unref(profile);
+		active_idx);
 
 	return 0;
 
@@ -751,4 +851,5 @@ struct ratbag_driver etekcity_driver = {
 	.read_button = etekcity_read_button,
 	.write_button = etekcity_write_button,
 	.write_resolution_dpi = etekcity_write_resolution_dpi,
+	.is_ready = etekcity_is_ready,
 };
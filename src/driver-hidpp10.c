@@ -200,8 +200,13 @@ hidpp10drv_probe(struct ratbag_device *device, const struct ratbag_id id)
 	 * correct hidraw device the kernel adjusts the device index for us,
 	 * so even for unifying receiver devices we can just 0x00 as device
 	 * index.
+	 * Only if we talk to the receiver's own node, the device has to be
+	 * found among the paired ones. Its product id is the wireless PID.
 	 */
-	dev = hidpp10_device_new_from_idx(device, WIRED_DEVICE_IDX);
+	if (hidpp10_receiver_get(device))
+		dev = hidpp10_device_new_from_wpid(device, device->ids.product);
+	else
+		dev = hidpp10_device_new_from_idx(device, WIRED_DEVICE_IDX);
 
 	if (!dev) {
 		log_error(device->ratbag,
@@ -213,6 +218,10 @@ hidpp10drv_probe(struct ratbag_device *device, const struct ratbag_id id)
 	drv_data->dev = dev;
 	ratbag_set_drv_data(device, drv_data);
 
+	/* the device state is only logged, don't read it otherwise */
+	if (ratbag_log_get_priority(device->ratbag) <= RATBAG_LOG_PRIORITY_DEBUG)
+		hidpp10_device_populate(dev);
+
 	if (hidpp10drv_fill_from_profile(device, dev)) {
 		/* Fall back to something that every mouse has */
 		ratbag_device_init_profiles(device, 1, 3);
@@ -241,6 +250,34 @@ hidpp10drv_remove(struct ratbag_device *device)
 	free(drv_data);
 }
 
+static void
+hidpp10drv_raw_event(struct ratbag_device *device, uint8_t *buf, size_t len)
+{
+	struct hidpp10drv_data *drv_data = ratbag_get_drv_data(device);
+	struct hidpp10_device *dev;
+	union hidpp10_message *msg = (union hidpp10_message *)buf;
+
+	if (!drv_data || len < SHORT_MESSAGE_LENGTH)
+		return;
+
+	if (msg->msg.report_id != REPORT_ID_SHORT &&
+	    msg->msg.report_id != REPORT_ID_LONG)
+		return;
+
+	/* the answers to requests have the top bit of the sub id set,
+	 * everything below is a notification */
+	if (msg->msg.sub_id & 0x80)
+		return;
+
+	/* the paired devices share the node of the receiver */
+	dev = drv_data->dev;
+	if (dev->index != WIRED_DEVICE_IDX &&
+	    msg->msg.device_idx != dev->index)
+		return;
+
+	hidpp10_memory_invalidate(dev);
+}
+
 #define LOGITECH_DEVICE(_bus, _pid)		\
 	{ .bustype = (_bus),			\
 	  .vendor = USB_VENDOR_ID_LOGITECH,	\
@@ -271,4 +308,5 @@ struct ratbag_driver hidpp10_driver = {
 	.has_capability = hidpp10drv_has_capability,
 	.read_button = hidpp10drv_read_button,
 	.write_button = hidpp10drv_write_button,
+	.raw_event = hidpp10drv_raw_event,
 };
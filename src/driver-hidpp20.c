@@ -53,13 +53,34 @@
 #define HIDPP_CAP_KBD_REPROGRAMMABLE_KEYS_1b00		(1 << 4)
 
 struct hidpp20drv_data {
-	unsigned proto_major;
-	unsigned proto_minor;
+	struct hidpp20_device *dev;
 	unsigned long capabilities;
 	unsigned num_sensors;
 	struct hidpp20_sensor *sensors;
 	unsigned num_controls;
 	struct hidpp20_control_id *controls;
+	/* empty until needed for the probe cache */
+	char firmware[RATBAG_CACHE_FIRMWARE_LEN];
+	/* set inside a transaction, 0 if unchanged */
+	uint16_t pending_dpi;
+};
+
+#define HIDPP20DRV_CACHE_MAX_FEATURES			64
+#define HIDPP20DRV_CACHE_MAX_CONTROLS			32
+
+/* what the probe learns about a device that only changes with its
+ * firmware, see ratbag_device_cache_load() */
+struct hidpp20drv_cache {
+	unsigned proto_major;
+	unsigned proto_minor;
+	unsigned long capabilities;
+	unsigned num_buttons;
+	unsigned num_features;
+	struct hidpp20_feature features[HIDPP20DRV_CACHE_MAX_FEATURES];
+	unsigned num_controls;
+	struct hidpp20_control_id controls[HIDPP20DRV_CACHE_MAX_CONTROLS];
+	unsigned num_sensors;
+	struct hidpp20_sensor sensors[MAX_RESOLUTIONS];
 };
 
 static void
@@ -113,7 +134,11 @@ hidpp20drv_write_button(struct ratbag_button *button,
 	control->reporting.remapped = mapping;
 	control->reporting.updated = 1;
 
-	rc = hidpp20_special_key_mouse_set_control(device, control);
+	/* written together with the other controls on commit */
+	if (ratbag_device_in_transaction(device))
+		return 0;
+
+	rc = hidpp20_special_key_mouse_set_control(drv_data->dev, control);
 	if (rc == ERR_INVALID_ADDRESS)
 		return -EINVAL;
 
@@ -122,6 +147,8 @@ hidpp20drv_write_button(struct ratbag_button *button,
 			  "Error while writing profile: '%s' (%d)\n",
 			  strerror(-rc),
 			  rc);
+	else
+		control->reporting.updated = 0;
 
 	return rc;
 }
@@ -158,6 +185,169 @@ hidpp20drv_set_current_profile(struct ratbag_device *device, unsigned int index)
 	return -ENOTSUP;
 }
 
+static int
+hidpp20drv_get_firmware(struct hidpp20drv_data *drv_data)
+{
+	struct hidpp20_fw_info info;
+	int rc;
+
+	rc = hidpp20_device_info_get_fw_info(drv_data->dev, 0, &info);
+	if (rc)
+		return rc;
+
+	snprintf(drv_data->firmware, sizeof(drv_data->firmware),
+		 "%s %02x.%02x B%04x",
+		 info.name, info.major, info.minor, info.build);
+
+	return 0;
+}
+
+static int
+hidpp20drv_load_cache(struct ratbag_device *device)
+{
+	struct hidpp20drv_data *drv_data = ratbag_get_drv_data(device);
+	struct hidpp20drv_cache cache;
+	struct hidpp20_feature *feature_list = NULL;
+	struct hidpp20_control_id *controls = NULL;
+	struct hidpp20_sensor *sensors = NULL;
+	char cached_firmware[RATBAG_CACHE_FIRMWARE_LEN];
+	unsigned int i;
+	int rc;
+
+	rc = ratbag_device_cache_load(device, cached_firmware,
+				      &cache, sizeof(cache));
+	if (rc < 0)
+		return rc;
+	if ((size_t)rc != sizeof(cache))
+		return -EINVAL;
+
+	/* a damaged entry may have the right size but not the content */
+	if (cache.num_features == 0 ||
+	    cache.num_features > HIDPP20DRV_CACHE_MAX_FEATURES ||
+	    cache.num_controls > HIDPP20DRV_CACHE_MAX_CONTROLS ||
+	    cache.num_sensors > MAX_RESOLUTIONS)
+		return -EINVAL;
+
+	for (i = 0; i < cache.num_sensors; i++) {
+		struct hidpp20_sensor *sensor = &cache.sensors[i];
+
+		sensor->dpi_list[ARRAY_LENGTH(sensor->dpi_list) - 1] = 0;
+	}
+
+	feature_list = zalloc(cache.num_features * sizeof(*feature_list));
+	if (cache.num_controls)
+		controls = zalloc(cache.num_controls * sizeof(*controls));
+	if (cache.num_sensors)
+		sensors = zalloc(cache.num_sensors * sizeof(*sensors));
+	if (!feature_list ||
+	    (cache.num_controls && !controls) ||
+	    (cache.num_sensors && !sensors)) {
+		rc = -ENOMEM;
+		goto err;
+	}
+
+	memcpy(feature_list, cache.features,
+	       cache.num_features * sizeof(*feature_list));
+	hidpp20_device_set_feature_list(drv_data->dev, feature_list,
+					cache.num_features);
+	feature_list = NULL;
+
+	/* the cached feature table has the index of the device information
+	 * feature, so checking the firmware takes a single request */
+	rc = hidpp20drv_get_firmware(drv_data);
+	if (rc || !streq(drv_data->firmware, cached_firmware)) {
+		log_debug(device->ratbag,
+			  "'%s': cache entry for firmware '%s' is stale\n",
+			  ratbag_device_get_name(device),
+			  cached_firmware);
+		hidpp20_device_set_feature_list(drv_data->dev, NULL, 0);
+		drv_data->firmware[0] = '\0';
+		rc = -ESTALE;
+		goto err;
+	}
+
+	drv_data->dev->proto_major = cache.proto_major;
+	drv_data->dev->proto_minor = cache.proto_minor;
+	drv_data->capabilities = cache.capabilities;
+	device->num_buttons = cache.num_buttons;
+
+	if (cache.num_controls)
+		memcpy(controls, cache.controls,
+		       cache.num_controls * sizeof(*controls));
+	drv_data->controls = controls;
+	drv_data->num_controls = cache.num_controls;
+
+	if (cache.num_sensors)
+		memcpy(sensors, cache.sensors,
+		       cache.num_sensors * sizeof(*sensors));
+	drv_data->sensors = sensors;
+	drv_data->num_sensors = cache.num_sensors;
+
+	log_debug(device->ratbag, "'%s': using the cached probe results\n",
+		  ratbag_device_get_name(device));
+
+	return 0;
+err:
+	free(feature_list);
+	free(controls);
+	free(sensors);
+	return rc;
+}
+
+static void
+hidpp20drv_store_cache(struct ratbag_device *device)
+{
+	struct hidpp20drv_data *drv_data = ratbag_get_drv_data(device);
+	struct hidpp20_device *dev = drv_data->dev;
+	struct hidpp20drv_cache cache;
+	unsigned int i;
+	int rc;
+
+	if (!ratbag_get_cache_dir(device->ratbag) || dev->proto_major < 2)
+		return;
+
+	/* without firmware revision, we cannot tell when the entry
+	 * goes stale */
+	if (!drv_data->firmware[0] && hidpp20drv_get_firmware(drv_data))
+		return;
+
+	if (dev->feature_count > HIDPP20DRV_CACHE_MAX_FEATURES ||
+	    drv_data->num_controls > HIDPP20DRV_CACHE_MAX_CONTROLS ||
+	    drv_data->num_sensors > MAX_RESOLUTIONS)
+		return;
+
+	memset(&cache, 0, sizeof(cache));
+	cache.proto_major = dev->proto_major;
+	cache.proto_minor = dev->proto_minor;
+	cache.capabilities = drv_data->capabilities;
+	cache.num_buttons = device->num_buttons;
+	cache.num_features = dev->feature_count;
+	memcpy(cache.features, dev->feature_list,
+	       dev->feature_count * sizeof(*dev->feature_list));
+	cache.num_controls = drv_data->num_controls;
+	if (drv_data->num_controls)
+		memcpy(cache.controls, drv_data->controls,
+		       drv_data->num_controls * sizeof(*drv_data->controls));
+	/* the reporting is the current state of the control, it is read
+	 * from the device again after loading the cache */
+	for (i = 0; i < cache.num_controls; i++)
+		memset(&cache.controls[i].reporting, 0,
+		       sizeof(cache.controls[i].reporting));
+	/* the sensors are only known once the first profile is read */
+	cache.num_sensors = drv_data->num_sensors;
+	if (drv_data->num_sensors)
+		memcpy(cache.sensors, drv_data->sensors,
+		       drv_data->num_sensors * sizeof(*drv_data->sensors));
+
+	rc = ratbag_device_cache_store(device, drv_data->firmware,
+				       &cache, sizeof(cache));
+	if (rc)
+		log_debug(device->ratbag,
+			  "'%s': failed to store the probe results: %s (%d)\n",
+			  ratbag_device_get_name(device),
+			  strerror(-rc), rc);
+}
+
 static int
 hidpp20drv_read_resolution_dpi(struct ratbag_profile *profile)
 {
@@ -172,7 +362,7 @@ hidpp20drv_read_resolution_dpi(struct ratbag_profile *profile)
 		uint8_t flags;
 
 		profile->resolution.num_modes = 1;
-		rc = hidpp20_mousepointer_get_mousepointer_info(device, &resolution, &flags);
+		rc = hidpp20_mousepointer_get_mousepointer_info(drv_data->dev, &resolution, &flags);
 		if (rc) {
 			log_error(ratbag,
 				  "Error while requesting resolution: %s (%d)\n",
@@ -184,27 +374,44 @@ hidpp20drv_read_resolution_dpi(struct ratbag_profile *profile)
 	}
 
 	if (drv_data->capabilities & HIDPP_CAP_SWITCHABLE_RESOLUTION_2201) {
-		free(drv_data->sensors);
-		drv_data->sensors = NULL;
-		drv_data->num_sensors = 0;
-		rc = hidpp20_adjustable_dpi_get_sensors(device, &drv_data->sensors);
-		if (rc < 0) {
-			log_error(ratbag,
-				  "Error while requesting resolution: %s (%d)\n",
-				  strerror(-rc), rc);
-			return rc;
-		} else if (rc == 0) {
-			log_error(ratbag, "Error, no compatible sensors found.\n");
-			return -ENODEV;
+		if (drv_data->num_sensors) {
+			/* the dpi lists are static, only the current dpi
+			 * needs to be refreshed */
+			rc = hidpp20_adjustable_dpi_update_sensors(drv_data->dev,
+								   drv_data->sensors,
+								   drv_data->num_sensors);
+			if (rc) {
+				log_error(ratbag,
+					  "Error while refreshing resolution: %d\n",
+					  rc);
+				return rc;
+			}
+		} else {
+			free(drv_data->sensors);
+			drv_data->sensors = NULL;
+			rc = hidpp20_adjustable_dpi_get_sensors(drv_data->dev, &drv_data->sensors);
+			if (rc < 0) {
+				log_error(ratbag,
+					  "Error while requesting resolution: %s (%d)\n",
+					  strerror(-rc), rc);
+				return rc;
+			} else if (rc == 0) {
+				log_error(ratbag, "Error, no compatible sensors found.\n");
+				return -ENODEV;
+			}
+			drv_data->num_sensors = rc;
+			if (drv_data->num_sensors > MAX_RESOLUTIONS)
+				drv_data->num_sensors = MAX_RESOLUTIONS;
+
+			/* the profiles are read lazily, so the sensors are
+			 * only known now */
+			hidpp20drv_store_cache(device);
 		}
 		log_info(ratbag,
 			 "device is at %d dpi (variable between %d and %d).\n",
 			 drv_data->sensors[0].dpi,
 			 drv_data->sensors[0].dpi_min,
 			 drv_data->sensors[0].dpi_max);
-		drv_data->num_sensors = rc;
-		if (drv_data->num_sensors > MAX_RESOLUTIONS)
-			drv_data->num_sensors = MAX_RESOLUTIONS;
 		profile->resolution.num_modes = drv_data->num_sensors;
 		for (i = 0; i < profile->resolution.num_modes; i++) {
 			/* FIXME: retrieve the refresh rate */
@@ -258,7 +465,12 @@ hidpp20drv_write_resolution_dpi(struct ratbag_resolution *resolution, int dpi)
 			goto out;
 	}
 
-	rc = hidpp20_adjustable_dpi_set_sensor_dpi(device, sensor, dpi);
+	if (ratbag_device_in_transaction(device)) {
+		drv_data->pending_dpi = dpi;
+		return 0;
+	}
+
+	rc = hidpp20_adjustable_dpi_set_sensor_dpi(drv_data->dev, sensor, dpi);
 
 out:
 	return rc;
@@ -273,10 +485,16 @@ hidpp20drv_read_special_key_mouse(struct ratbag_device *device)
 	if (!(drv_data->capabilities & HIDPP_CAP_BUTTON_KEY_1b04))
 		return 0;
 
+	/* only the reporting can change once the controls are known */
+	if (drv_data->num_controls)
+		return hidpp20_special_key_mouse_update_controls(drv_data->dev,
+								 drv_data->controls,
+								 drv_data->num_controls);
+
 	free(drv_data->controls);
 	drv_data->controls = NULL;
 	drv_data->num_controls = 0;
-	rc = hidpp20_special_key_mouse_get_controls(device, &drv_data->controls);
+	rc = hidpp20_special_key_mouse_get_controls(drv_data->dev, &drv_data->controls);
 	if (rc > 0) {
 		drv_data->num_controls = rc;
 		rc = 0;
@@ -297,7 +515,7 @@ hidpp20drv_read_kbd_reprogrammable_key(struct ratbag_device *device)
 	free(drv_data->controls);
 	drv_data->controls = NULL;
 	drv_data->num_controls = 0;
-	rc = hidpp20_kbd_reprogrammable_keys_get_controls(device, &drv_data->controls);
+	rc = hidpp20_kbd_reprogrammable_keys_get_controls(drv_data->dev, &drv_data->controls);
 	if (rc > 0) {
 		drv_data->num_controls = rc;
 		rc = 0;
@@ -322,15 +540,42 @@ hidpp20drv_read_profile(struct ratbag_profile *profile, unsigned int index)
 static int
 hidpp20drv_write_profile(struct ratbag_profile *profile)
 {
+	struct ratbag_device *device = profile->device;
+	struct hidpp20drv_data *drv_data = ratbag_get_drv_data(device);
+	int rc;
+
+	/* only changes deferred by a transaction are left to write */
+	if (drv_data->capabilities & HIDPP_CAP_BUTTON_KEY_1b04) {
+		rc = hidpp20_special_key_mouse_set_controls(drv_data->dev,
+							    drv_data->controls,
+							    drv_data->num_controls);
+		if (rc) {
+			log_error(device->ratbag,
+				  "Error while writing the buttons: %d\n", rc);
+			return rc < 0 ? rc : -EIO;
+		}
+	}
+
+	if (drv_data->pending_dpi) {
+		rc = hidpp20_adjustable_dpi_set_sensor_dpi(drv_data->dev,
+							   &drv_data->sensors[0],
+							   drv_data->pending_dpi);
+		if (rc) {
+			log_error(device->ratbag,
+				  "Error while writing the resolution: %d\n", rc);
+			return rc < 0 ? rc : -EIO;
+		}
+		drv_data->pending_dpi = 0;
+	}
+
 	return 0;
 }
 
-static int
+static void
 hidpp20drv_init_feature(struct ratbag_device *device, uint16_t feature)
 {
 	struct hidpp20drv_data *drv_data = ratbag_get_drv_data(device);
 	struct ratbag *ratbag = device->ratbag;
-	int rc;
 
 	switch (feature) {
 	case HIDPP_PAGE_ROOT:
@@ -349,53 +594,75 @@ hidpp20drv_init_feature(struct ratbag_device *device, uint16_t feature)
 	case HIDPP_PAGE_SPECIAL_KEYS_BUTTONS: {
 		log_debug(ratbag, "device has programmable keys/buttons\n");
 		drv_data->capabilities |= HIDPP_CAP_BUTTON_KEY_1b04;
-		/* we read the profile once to get the correct number of
-		 * supported buttons. */
-		if (!hidpp20drv_read_special_key_mouse(device))
-			device->num_buttons = drv_data->num_controls;
 		break;
 	}
 	case HIDPP_PAGE_BATTERY_LEVEL_STATUS: {
+		drv_data->capabilities |= HIDPP_CAP_BATTERY_LEVEL_1000;
+		break;
+	}
+	case HIDPP_PAGE_KBD_REPROGRAMMABLE_KEYS: {
+		log_debug(ratbag, "device has programmable keys/buttons\n");
+		drv_data->capabilities |= HIDPP_CAP_KBD_REPROGRAMMABLE_KEYS_1b00;
+		break;
+	}
+	default:
+		log_raw(device->ratbag, "unknown feature 0x%04x\n", feature);
+	}
+}
+
+/* The features that need to ask the device, once the capabilities of all
+ * features are known. Each step may use what the previous ones read. */
+static int
+hidpp20drv_init_features(struct ratbag_device *device)
+{
+	struct hidpp20drv_data *drv_data = ratbag_get_drv_data(device);
+	struct ratbag *ratbag = device->ratbag;
+	int rc;
+
+	/* we read the controls once to get the correct number of
+	 * supported buttons. 0x1b04 supersedes 0x1b00, the buttons are
+	 * only mapped through 0x1b04. */
+	if (drv_data->capabilities & HIDPP_CAP_BUTTON_KEY_1b04) {
+		if (!hidpp20drv_read_special_key_mouse(device))
+			device->num_buttons = drv_data->num_controls;
+	} else if (drv_data->capabilities & HIDPP_CAP_KBD_REPROGRAMMABLE_KEYS_1b00) {
+		if (!hidpp20drv_read_kbd_reprogrammable_key(device))
+			device->num_buttons = drv_data->num_controls;
+	}
+
+	/* the battery level is only logged, don't ask for it otherwise */
+	if ((drv_data->capabilities & HIDPP_CAP_BATTERY_LEVEL_1000) &&
+	    ratbag_log_get_priority(ratbag) <= RATBAG_LOG_PRIORITY_DEBUG) {
 		uint16_t level, next_level;
 		enum hidpp20_battery_status status;
 
-		rc = hidpp20_batterylevel_get_battery_level(device, &level, &next_level);
+		rc = hidpp20_batterylevel_get_battery_level(drv_data->dev, &level, &next_level);
 		if (rc < 0)
 			return rc;
 		status = rc;
 
 		log_debug(ratbag, "device battery level is %d%% (next %d%%), status %d \n",
 			  level, next_level, status);
-
-		drv_data->capabilities |= HIDPP_CAP_BATTERY_LEVEL_1000;
-		break;
 	}
-	case HIDPP_PAGE_KBD_REPROGRAMMABLE_KEYS: {
-		 log_debug(ratbag, "device has programmable keys/buttons\n");
-		 drv_data->capabilities |= HIDPP_CAP_KBD_REPROGRAMMABLE_KEYS_1b00;
 
-		/* we read the profile once to get the correct number of
-		 * supported buttons. */
-		if (!hidpp20drv_read_kbd_reprogrammable_key(device))
-			device->num_buttons = drv_data->num_controls;
-		 break;
-	}
-	default:
-		log_raw(device->ratbag, "unknown feature 0x%04x\n", feature);
-	}
 	return 0;
 }
 
 static int
 hidpp20drv_20_probe(struct ratbag_device *device, const struct ratbag_id id)
 {
+	struct hidpp20drv_data *drv_data = ratbag_get_drv_data(device);
+	struct hidpp20_device *dev = drv_data->dev;
 	struct hidpp20_feature *feature_list;
 	int rc, i;
 
-	rc = hidpp20_feature_set_get(device, &feature_list);
+	rc = hidpp20_feature_set_get(dev, &feature_list);
 	if (rc < 0)
 		return rc;
 
+	/* from now on, the feature indices are looked up locally */
+	hidpp20_device_set_feature_list(dev, feature_list, rc);
+
 	if (rc > 0) {
 		log_raw(device->ratbag, "'%s' has %d features\n", ratbag_device_get_name(device), rc);
 		for (i = 0; i < rc; i++) {
@@ -406,7 +673,7 @@ hidpp20drv_20_probe(struct ratbag_device *device, const struct ratbag_id id)
 		}
 	}
 
-	free(feature_list);
+	hidpp20drv_init_features(device);
 
 	return 0;
 
@@ -433,19 +700,32 @@ hidpp20drv_probe(struct ratbag_device *device, const struct ratbag_id id)
 
 	ratbag_set_drv_data(device, drv_data);
 
-	drv_data->proto_major = 1;
-	drv_data->proto_minor = 0;
+	drv_data->dev = hidpp20_device_new(device);
+	if (!drv_data->dev) {
+		rc = -ENODEV;
+		goto err;
+	}
+
+	if (hidpp20drv_load_cache(device) == 0) {
+		ratbag_device_init_profiles(device, 1, 8);
+		return 0;
+	}
 
-	rc = hidpp20_root_get_protocol_version(device, &drv_data->proto_major, &drv_data->proto_minor);
+	rc = hidpp20_root_get_protocol_version(drv_data->dev,
+					       &drv_data->dev->proto_major,
+					       &drv_data->dev->proto_minor);
 	if (rc) {
 		/* communication error, best to ignore the device */
 		rc = -EINVAL;
 		goto err;
 	}
 
-	log_debug(device->ratbag, "'%s' is using protocol v%d.%d\n", ratbag_device_get_name(device), drv_data->proto_major, drv_data->proto_minor);
+	log_debug(device->ratbag, "'%s' is using protocol v%d.%d\n",
+		  ratbag_device_get_name(device),
+		  drv_data->dev->proto_major,
+		  drv_data->dev->proto_minor);
 
-	if (drv_data->proto_major >= 2) {
+	if (drv_data->dev->proto_major >= 2) {
 		rc = hidpp20drv_20_probe(device, id);
 		if (rc)
 			goto err;
@@ -453,8 +733,11 @@ hidpp20drv_probe(struct ratbag_device *device, const struct ratbag_id id)
 
 	ratbag_device_init_profiles(device, 1, 8);
 
+	hidpp20drv_store_cache(device);
+
 	return rc;
 err:
+	hidpp20_device_destroy(drv_data->dev);
 	free(drv_data);
 	ratbag_set_drv_data(device, NULL);
 	return rc;
@@ -465,6 +748,7 @@ hidpp20drv_remove(struct ratbag_device *device)
 {
 	struct hidpp20drv_data *drv_data = ratbag_get_drv_data(device);
 
+	hidpp20_device_destroy(drv_data->dev);
 	free(drv_data->controls);
 	free(drv_data->sensors);
 	free(drv_data);
@@ -32,6 +32,9 @@
 
 #include <stddef.h>
 
+#include "libratbag-hidraw.h"
+#include "libratbag-util.h"
+
 const char *hidpp_errors[0xFF] = {
 	[0x00] = "ERR_SUCCESS",
 	[0x01] = "ERR_INVALID_SUBID",
@@ -48,3 +51,20 @@ const char *hidpp_errors[0xFF] = {
 	[0x0C] = "ERR_WRONG_PIN_CODE",
 	[0x0D ... 0xFE] = NULL,
 };
+
+int
+hidpp_read_report(struct ratbag_device *device, uint8_t *buf,
+		  size_t len, uint64_t deadline)
+{
+	/* Everything else on the node is input: the pointer motion of a
+	 * mouse, or on a receiver the DJ reports (0x20, 0x21) wrapping the
+	 * input of the paired devices. At 1000Hz these outnumber the
+	 * answers to our requests. */
+	static const unsigned long report_ids[NLONGS(256)] = {
+		AS_MASK(REPORT_ID_SHORT) | AS_MASK(REPORT_ID_LONG),
+	};
+
+	return ratbag_hidraw_read_input_report_filtered(device, buf, len,
+							deadline,
+							report_ids);
+}
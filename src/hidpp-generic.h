@@ -29,6 +29,9 @@
 #ifndef HIDPP_GENERIC_H
 #define HIDPP_GENERIC_H
 
+#include <stddef.h>
+#include <stdint.h>
+
 #define RECEIVER_IDX				0xFF
 #define WIRED_DEVICE_IDX			0x00
 
@@ -64,4 +67,17 @@
 
 extern const char *hidpp_errors[0xFF];
 
+struct ratbag_device;
+
+/**
+ * Read the next HID++ report from the device, waiting until the given
+ * deadline at most. The regular input reports sharing the hidraw node
+ * are dropped, see ratbag_hidraw_read_input_report_filtered().
+ *
+ * @return count of data transfered, -ETIMEDOUT if no HID++ report arrived
+ * before the deadline, or a negative errno on error
+ */
+int hidpp_read_report(struct ratbag_device *device, uint8_t *buf,
+		      size_t len, uint64_t deadline);
+
 #endif /* HIDPP_GENERIC_H */
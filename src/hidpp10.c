@@ -32,6 +32,7 @@
 #include "config.h"
 
 #include <linux/types.h>
+#include <assert.h>
 #include <errno.h>
 #include <stdio.h>
 #include <string.h>
@@ -94,66 +95,217 @@ hidpp10_write_command(struct hidpp10_device *dev, uint8_t *cmd, int size)
 	return res;
 }
 
-int
-hidpp10_request_command(struct hidpp10_device *dev, union hidpp10_message *msg)
-{
-	struct ratbag_device *device = dev->ratbag_device;
-	struct ratbag *ratbag = device->ratbag;
-	union hidpp10_message read_buffer;
+struct hidpp10_pending {
+	unsigned index;		/* index in the caller's array */
 	union hidpp10_message expected_header;
+	union hidpp10_message expected_error_dev;
+	uint64_t deadline;	/* the answer must arrive by then */
+	uint64_t sent_us;	/* for the latency statistics */
+};
+
+static void
+hidpp10_pending_init(struct hidpp10_pending *pending,
+		     union hidpp10_message *msg,
+		     unsigned index)
+{
 	union hidpp10_message expected_error_dev = ERROR_MSG(msg, msg->msg.device_idx);
-	int ret;
-	uint8_t hidpp_err = 0;
+
+	pending->index = index;
 
 	/* create the expected header */
-	expected_header = *msg;
+	pending->expected_header = *msg;
 	switch (msg->msg.sub_id) {
 	case SET_REGISTER_REQ:
-		expected_header.msg.report_id = REPORT_ID_SHORT;
+		pending->expected_header.msg.report_id = REPORT_ID_SHORT;
 		break;
 	case GET_REGISTER_REQ:
-		expected_header.msg.report_id = REPORT_ID_SHORT;
+		pending->expected_header.msg.report_id = REPORT_ID_SHORT;
 		break;
 	case SET_LONG_REGISTER_REQ:
-		expected_header.msg.report_id = REPORT_ID_LONG;
+		pending->expected_header.msg.report_id = REPORT_ID_LONG;
 		break;
 	case GET_LONG_REGISTER_REQ:
-		expected_header.msg.report_id = REPORT_ID_LONG;
+		pending->expected_header.msg.report_id = REPORT_ID_LONG;
 		break;
 	}
 
-	log_buf_raw(ratbag, "sending: ", msg->data, SHORT_MESSAGE_LENGTH);
-	log_buf_raw(ratbag, "  expected_header:	", expected_header.data, SHORT_MESSAGE_LENGTH);
-	log_buf_raw(ratbag, "  expected_error_dev:	", expected_error_dev.data, SHORT_MESSAGE_LENGTH);
+	pending->expected_error_dev = expected_error_dev;
+}
 
-	/* Send the message to the Device */
-	ret = hidpp10_write_command(dev, msg->data, SHORT_MESSAGE_LENGTH);
-	if (ret)
-		goto out_err;
+/* HID++ 1.0 answers carry no sequence number, and several requests in
+ * flight may share the same header (e.g. memory reads). The device
+ * answers in order, so the oldest matching request is the one being
+ * answered. Returns num_pending if none matches. */
+static unsigned
+hidpp10_pending_find(struct hidpp10_pending *pending, unsigned num_pending,
+		     union hidpp10_message *msg, bool *is_error)
+{
+	unsigned i;
 
-	/*
-	 * Now read the answers from the device:
-	 * loop until we get the actual answer or an error code.
-	 */
-	do {
-		ret = ratbag_hidraw_read_input_report(device, read_buffer.data, LONG_MESSAGE_LENGTH);
+	for (i = 0; i < num_pending; i++) {
+		if (!memcmp(msg->data, pending[i].expected_header.data, 4)) {
+			*is_error = false;
+			break;
+		}
+
+		if (!memcmp(msg->data, pending[i].expected_error_dev.data, 5)) {
+			*is_error = true;
+			break;
+		}
+	}
 
-		/* Overwrite the return device index with ours. The kernel
-		 * sets our device index on write, but gives us the real
-		 * device index on reply. Overwrite it with our index so the
-		 * messages are easier to check and compare.
-		 */
-		read_buffer.msg.device_idx = msg->msg.device_idx;
+	return i;
+}
 
-		log_buf_raw(ratbag, " *** received: ", read_buffer.data, ret);
+/* The kernel sets our device index on write, but gives us the real
+ * device index on reply. Overwrite it with our index so the messages are
+ * easier to check and compare. On a receiver's node, the paired devices
+ * are addressed by their real index, which tells their answers apart.
+ */
+static void
+hidpp10_fixup_device_idx(union hidpp10_message *msg,
+			 struct hidpp10_pending *oldest)
+{
+	if (oldest->expected_header.msg.device_idx == WIRED_DEVICE_IDX ||
+	    oldest->expected_header.msg.device_idx == RECEIVER_IDX)
+		msg->msg.device_idx = oldest->expected_header.msg.device_idx;
+}
+
+/* After a timeout, give the answers still in flight one more timeout to
+ * arrive. Left in the queue, they would be taken for the answers to the
+ * next requests. */
+static void
+hidpp10_drain_pending(struct hidpp10_device *dev,
+		      struct hidpp10_pending *pending,
+		      unsigned num_pending)
+{
+	struct ratbag_device *device = dev->ratbag_device;
+	union hidpp10_message read_buffer;
+	uint64_t deadline = now_in_ms() +
+			    ratbag_device_get_request_timeout(device);
+	uint8_t device_idx;
+	unsigned i, j;
+	bool is_error;
+	int ret;
+
+	while (num_pending > 0) {
+		ret = hidpp_read_report(device, read_buffer.data,
+					LONG_MESSAGE_LENGTH, deadline);
+		if (ret <= 0)
+			break;
+
+		device_idx = read_buffer.msg.device_idx;
+		hidpp10_fixup_device_idx(&read_buffer, &pending[0]);
+		log_buf_raw(device->ratbag, " *** drained: ", read_buffer.data, ret);
+
+		i = hidpp10_pending_find(pending, num_pending, &read_buffer,
+					 &is_error);
+		if (i == num_pending) {
+			read_buffer.msg.device_idx = device_idx;
+			ratbag_hidraw_raw_event(device, read_buffer.data, ret);
+			continue;
+		}
+
+		for (j = i; j < num_pending - 1; j++)
+			pending[j] = pending[j + 1];
+		num_pending--;
+	}
+}
 
+int
+hidpp10_request_commands(struct hidpp10_device *dev,
+			 union hidpp10_message *msgs,
+			 unsigned count)
+{
+	struct ratbag_device *device = dev->ratbag_device;
+	struct ratbag *ratbag = device->ratbag;
+	struct hidpp10_pending pending[HIDPP10_MAX_INFLIGHT];
+	union hidpp10_message read_buffer;
+	union hidpp10_message *msg;
+	unsigned num_pending = 0, next = 0, completed = 0;
+	unsigned i, j;
+	int ret, rc = 0;
+	uint8_t hidpp_err, device_idx;
+	bool is_error;
+	unsigned int timeout = ratbag_device_get_request_timeout(device);
+
+	/* whatever the device stores may change */
+	for (i = 0; i < count; i++) {
+		if (msgs[i].msg.sub_id == SET_REGISTER_REQ ||
+		    msgs[i].msg.sub_id == SET_LONG_REGISTER_REQ) {
+			hidpp10_memory_invalidate(dev);
+			break;
+		}
+	}
 
-		/* actual answer */
-		if (!memcmp(read_buffer.data, expected_header.data, 4))
+	while (completed < count) {
+		/* fill the pipeline, unless a request failed already */
+		while (rc == 0 && num_pending < HIDPP10_MAX_INFLIGHT && next < count) {
+			struct hidpp10_pending *p = &pending[num_pending];
+
+			msg = &msgs[next];
+			hidpp10_pending_init(p, msg, next);
+
+			log_buf_raw(ratbag, "sending: ", msg->data, SHORT_MESSAGE_LENGTH);
+			log_buf_raw(ratbag, "  expected_header:	", p->expected_header.data, SHORT_MESSAGE_LENGTH);
+			log_buf_raw(ratbag, "  expected_error_dev:	", p->expected_error_dev.data, SHORT_MESSAGE_LENGTH);
+
+			/* Send the message to the Device */
+			ret = hidpp10_write_command(dev, msg->data, SHORT_MESSAGE_LENGTH);
+			if (ret)
+				goto out_err;
+
+			p->deadline = now_in_ms() + timeout;
+			p->sent_us = now_in_us();
+			num_pending++;
+			next++;
+		}
+
+		/* a request failed and all in-flight answers are drained */
+		if (num_pending == 0)
 			break;
 
-		/* error */
-		if (!memcmp(read_buffer.data, expected_error_dev.data, 5)) {
+		/* the oldest request expires first, unrelated reports do not
+		 * extend its deadline */
+		ret = hidpp_read_report(device,
+					read_buffer.data,
+					LONG_MESSAGE_LENGTH,
+					pending[0].deadline);
+		if (ret == -ETIMEDOUT) {
+			ratbag_stats_request_timeout(device,
+						     RATBAG_STATS_CLASS_HIDPP10);
+			log_error(ratbag, "    request timed out after %ums\n", timeout);
+			/* a late answer to a memory read would be cached as
+			 * the page of the next read */
+			hidpp10_memory_invalidate(dev);
+			hidpp10_drain_pending(dev, pending, num_pending);
+			goto out_err;
+		}
+		if (ret < 0) {
+			log_error(ratbag, "    USB error: %s (%d)\n", strerror(-ret), -ret);
+			goto out_err;
+		}
+		if (ret == 0) {
+			ret = -EIO;
+			goto out_err;
+		}
+
+		device_idx = read_buffer.msg.device_idx;
+		hidpp10_fixup_device_idx(&read_buffer, &pending[0]);
+
+		log_buf_raw(ratbag, " *** received: ", read_buffer.data, ret);
+
+		hidpp_err = 0;
+		i = hidpp10_pending_find(pending, num_pending, &read_buffer,
+					 &is_error);
+		if (i == num_pending) {
+			/* a notification, e.g. of a profile change */
+			read_buffer.msg.device_idx = device_idx;
+			ratbag_hidraw_raw_event(device, read_buffer.data, ret);
+			continue;
+		}
+
+		if (is_error) {
 			hidpp_err = read_buffer.msg.parameters[1];
 			log_raw(ratbag,
 				"    HID++ error from the %s (%d): %s (%02x)\n",
@@ -161,34 +313,44 @@ hidpp10_request_command(struct hidpp10_device *dev, union hidpp10_message *msg)
 				read_buffer.msg.device_idx,
 				hidpp_errors[hidpp_err] ? hidpp_errors[hidpp_err] : "Undocumented error code",
 				hidpp_err);
-			break;
+			if (rc == 0)
+				rc = hidpp_err;
+		} else {
+			log_buf_raw(ratbag, "    received: ", read_buffer.data, ret);
+			/* copy the answer for the caller */
+			msgs[pending[i].index] = read_buffer;
 		}
-	} while (ret > 0);
 
-	if (ret < 0) {
-		log_error(ratbag, "    USB error: %s (%d)\n", strerror(-ret), -ret);
-		perror("write");
-		goto out_err;
-	}
+		ratbag_stats_request_done(device, RATBAG_STATS_CLASS_HIDPP10,
+					  now_in_us() - pending[i].sent_us,
+					  hidpp_err);
 
-	if (!hidpp_err) {
-		log_buf_raw(ratbag, "    received: ", read_buffer.data, ret);
-		/* copy the answer for the caller */
-		*msg = read_buffer;
+		/* the request is done, keep the others in sending order */
+		for (j = i; j < num_pending - 1; j++)
+			pending[j] = pending[j + 1];
+		num_pending--;
+		completed++;
 	}
 
-	ret = hidpp_err;
+	return rc;
 
 out_err:
 	return ret;
 }
+
+int
+hidpp10_request_command(struct hidpp10_device *dev, union hidpp10_message *msg)
+{
+	return hidpp10_request_commands(dev, msg, 1);
+}
+
 /* -------------------------------------------------------------------------- */
 /* HID++ 1.0 commands 10                                                      */
 /* -------------------------------------------------------------------------- */
 
 static int
-hidpp10_read_memory(struct hidpp10_device *dev, uint8_t page, uint16_t offset,
-		    uint8_t bytes[16]);
+hidpp10_read_memory_pages(struct hidpp10_device *dev, uint8_t page,
+			  uint16_t offset, uint8_t *bytes, size_t size);
 
 /* -------------------------------------------------------------------------- */
 /* 0x00: Enable HID++ Notifications                                           */
@@ -420,11 +582,9 @@ hidpp10_get_profile(struct hidpp10_device *dev, int8_t number, struct hidpp10_pr
 
 	log_raw(dev->ratbag_device->ratbag, "Fetching profile %d\n", number);
 
-	for (i = 0; i < sizeof(data); i += 16) {
-		res = hidpp10_read_memory(dev, number, i,  &data.data[i]);
-		if (res)
-			return res;
-	}
+	res = hidpp10_read_memory_pages(dev, number, 0, data.data, sizeof(data));
+	if (res)
+		return res;
 
 	profile.angle_correction = p->angle_correction;
 	profile.default_dpi_mode = p->default_dpi_mode;
@@ -719,23 +879,84 @@ hidpp10_get_usb_refresh_rate(struct hidpp10_device *dev,
 	} \
 }
 
+void
+hidpp10_memory_invalidate(struct hidpp10_device *dev)
+{
+	unsigned int i;
+
+	for (i = 0; i < HIDPP10_NUM_CACHED_PAGES; i++) {
+		if (dev->pages[i])
+			dev->pages[i]->valid = 0;
+	}
+}
+
+/**
+ * Read size bytes starting at offset, in chunks of 16 bytes. The chunks
+ * not in the cache yet are all requested through the same pipeline, size
+ * must be a multiple of 16. Pages past HIDPP10_NUM_CACHED_PAGES are read
+ * from the device every time.
+ */
 static int
-hidpp10_read_memory(struct hidpp10_device *dev, uint8_t page, uint16_t offset,
-		    uint8_t bytes[16])
+hidpp10_read_memory_pages(struct hidpp10_device *dev, uint8_t page,
+			  uint16_t offset, uint8_t *bytes, size_t size)
 {
 	unsigned idx = dev->index;
-	union hidpp10_message readmem = CMD_READ_MEMORY(idx, page, offset/2);
+	struct hidpp10_memory_page uncached = { .valid = 0 };
+	struct hidpp10_memory_page *cache = &uncached;
+	union hidpp10_message *readmem;
+	unsigned chunks[HIDPP10_PAGE_SIZE / 16];
+	unsigned num_chunks = size / 16;
+	unsigned first = offset / 16;
+	unsigned num_reads = 0;
+	unsigned i;
 	int res;
 
-	log_raw(dev->ratbag_device->ratbag,
-		"Reading memory page %d, offset %#x\n",
-		page, offset);
+	assert(size % 16 == 0);
+	assert(offset % 16 == 0);
+	assert(offset + size <= HIDPP10_PAGE_SIZE);
 
-	res = hidpp10_request_command(dev, &readmem);
-	if (res)
-		return res;
+	if (page < HIDPP10_NUM_CACHED_PAGES) {
+		if (!dev->pages[page])
+			dev->pages[page] = zalloc(sizeof(*dev->pages[page]));
+		if (dev->pages[page])
+			cache = dev->pages[page];
+	}
+
+	for (i = 0; i < num_chunks; i++) {
+		if (!(cache->valid & (1U << (first + i))))
+			chunks[num_reads++] = first + i;
+	}
+
+	if (num_reads > 0) {
+		log_raw(dev->ratbag_device->ratbag,
+			"Reading memory page %d, offset %#x, %u of %zu bytes\n",
+			page, offset, num_reads * 16, size);
+
+		readmem = zalloc(num_reads * sizeof(*readmem));
+		if (!readmem)
+			return -ENOMEM;
+
+		for (i = 0; i < num_reads; i++) {
+			union hidpp10_message msg = CMD_READ_MEMORY(idx, page, chunks[i] * 8);
+
+			readmem[i] = msg;
+		}
+
+		res = hidpp10_request_commands(dev, readmem, num_reads);
+		if (res == 0) {
+			for (i = 0; i < num_reads; i++) {
+				memcpy(&cache->data[chunks[i] * 16],
+				       readmem[i].msg.string, 16);
+				cache->valid |= 1U << chunks[i];
+			}
+		}
+
+		free(readmem);
+		if (res)
+			return res;
+	}
 
-	memcpy(bytes, readmem.msg.string, sizeof(readmem.msg.string));
+	memcpy(bytes, &cache->data[offset], size);
 
 	return 0;
 }
@@ -806,7 +1027,7 @@ hidpp10_get_pairing_information(struct hidpp10_device *dev,
 
 	res = hidpp10_request_command(dev, &pairing_information);
 	if (res)
-		return -1;
+		return res;
 
 	*report_interval = pairing_information.msg.string[2];
 	*wpid = hidpp10_get_unaligned_u16(&pairing_information.msg.string[3]);
@@ -892,19 +1113,23 @@ hidpp10_get_firmare_information(struct hidpp10_device *dev,
 }
 
 void hidpp10_list_devices(struct ratbag_device *device) {
-	struct hidpp10_device *dev;
+	struct hidpp10_receiver *receiver;
+	uint8_t type;
 	int i;
 
-	for (i = 0; i < 6; ++i) {
-		dev = hidpp10_device_new_from_idx(device, i);
-		if (!dev)
+	receiver = hidpp10_receiver_get(device);
+	if (!receiver)
+		return;
+
+	for (i = 0; i < HIDPP10_RECEIVER_MAX_DEVICES; ++i) {
+		if (!receiver->pairing[i].wpid)
 			continue;
 
-		log_info(device->ratbag, "[%d] %s	%s (Wireless PID: %04x)\n",
-			 i,
-			 device_types[dev->device_type] ? device_types[dev->device_type] : "",
-			 dev->name, dev->wpid);
-		hidpp10_device_destroy(dev);
+		type = receiver->pairing[i].device_type;
+		log_info(device->ratbag, "[%d] %s	(Wireless PID: %04x)\n",
+			 i + 1,
+			 device_types[type] ? device_types[type] : "",
+			 receiver->pairing[i].wpid);
 	}
 
 }
@@ -912,13 +1137,18 @@ void hidpp10_list_devices(struct ratbag_device *device) {
 /* -------------------------------------------------------------------------- */
 /* general device handling                                                    */
 /* -------------------------------------------------------------------------- */
-static int
-hidpp10_get_device_info(struct hidpp10_device *dev)
+int
+hidpp10_device_populate(struct hidpp10_device *dev)
 {
 	uint8_t f1, f2;
 	uint8_t reflect;
 	int i;
 
+	if (dev->populated)
+		return 0;
+
+	dev->populated = true;
+
 	hidpp10_get_individual_features(dev, &f1, &f2);
 	hidpp10_get_hidpp_notifications(dev, &f1, &f2);
 
@@ -954,18 +1184,26 @@ hidpp10_device_new(struct ratbag_device *device, int index)
 struct hidpp10_device*
 hidpp10_device_new_from_wpid(struct ratbag_device* device, uint16_t wpid)
 {
+	struct hidpp10_receiver *receiver;
 	struct hidpp10_device *dev;
 	int i;
 
-	for (i = 1; i < 7; i++) {
-		dev = hidpp10_device_new_from_idx(device, i);
-		if (!dev)
+	receiver = hidpp10_receiver_get(device);
+	if (!receiver)
+		return NULL;
+
+	for (i = 0; i < HIDPP10_RECEIVER_MAX_DEVICES; i++) {
+		if (receiver->pairing[i].wpid != wpid)
 			continue;
 
-		if (dev->wpid == wpid)
-			return dev;
+		dev = hidpp10_device_new_from_idx(device, i + 1);
+		if (!dev)
+			return NULL;
 
-		hidpp10_device_destroy(dev);
+		dev->wpid = wpid;
+		dev->report_interval = receiver->pairing[i].report_interval;
+		dev->device_type = receiver->pairing[i].device_type;
+		return dev;
 	}
 
 	return NULL;
@@ -981,10 +1219,6 @@ hidpp10_device_new_from_idx(struct ratbag_device *device, int idx)
 		return NULL;
 
 	dev->index = idx;
-	if (hidpp10_get_device_info(dev) != 0) {
-		hidpp10_device_destroy(dev);
-		dev = NULL;
-	}
 
 	return dev;
 }
@@ -992,6 +1226,81 @@ hidpp10_device_new_from_idx(struct ratbag_device *device, int idx)
 void
 hidpp10_device_destroy(struct hidpp10_device *dev)
 {
+	unsigned int i;
+
+	for (i = 0; i < HIDPP10_NUM_CACHED_PAGES; i++)
+		free(dev->pages[i]);
+
 	ratbag_device_unref(dev->ratbag_device);
 	free(dev);
 }
+
+/* -------------------------------------------------------------------------- */
+/* receiver handling                                                          */
+/* -------------------------------------------------------------------------- */
+
+static void
+hidpp10_receiver_destroy(void *data)
+{
+	free(data);
+}
+
+static int
+hidpp10_receiver_read_pairing(struct ratbag_device *device,
+			      struct hidpp10_receiver *receiver)
+{
+	struct hidpp10_device *dev;
+	uint8_t report_interval, device_type;
+	uint16_t wpid;
+	unsigned int i;
+	int rc;
+
+	for (i = 0; i < HIDPP10_RECEIVER_MAX_DEVICES; i++) {
+		dev = hidpp10_device_new(device, i + 1);
+		if (!dev)
+			return -ENOMEM;
+
+		rc = hidpp10_get_pairing_information(dev, &report_interval,
+						     &wpid, &device_type);
+		hidpp10_device_destroy(dev);
+
+		/* a device does not know the register, while a receiver
+		 * fails for the empty slots */
+		if (i == 0 && (rc < 0 ||
+			       rc == ERR_INVALID_SUBID ||
+			       rc == ERR_INVALID_ADDRESS))
+			return -ENODEV;
+		if (rc)
+			continue;
+
+		receiver->pairing[i].wpid = wpid;
+		receiver->pairing[i].report_interval = report_interval;
+		receiver->pairing[i].device_type = device_type;
+	}
+
+	return 0;
+}
+
+struct hidpp10_receiver *
+hidpp10_receiver_get(struct ratbag_device *device)
+{
+	struct hidpp10_receiver *receiver;
+
+	receiver = ratbag_hidraw_get_shared_data(device);
+	if (receiver)
+		return receiver;
+
+	receiver = zalloc(sizeof(*receiver));
+	if (!receiver)
+		return NULL;
+
+	if (hidpp10_receiver_read_pairing(device, receiver)) {
+		free(receiver);
+		return NULL;
+	}
+
+	ratbag_hidraw_set_shared_data(device, receiver,
+				      hidpp10_receiver_destroy);
+
+	return receiver;
+}
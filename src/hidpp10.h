@@ -38,6 +38,9 @@
 
 struct hidpp10_device;
 
+/* the maximum number of requests in flight at the same time */
+#define HIDPP10_MAX_INFLIGHT			4
+
 struct _hidpp10_message {
 	uint8_t report_id;
 	uint8_t device_idx;
@@ -57,9 +60,23 @@ union hidpp10_message {
 void hidpp10_device_destroy(struct hidpp10_device *dev);
 
 int hidpp10_request_command(struct hidpp10_device *device, union hidpp10_message *msg);
+/**
+ * Send count requests and wait for all answers, with up to
+ * HIDPP10_MAX_INFLIGHT requests in flight at the same time. The answers
+ * are written back into msgs. If a request fails, no further requests are
+ * sent and the HID++ error code of the first failing request is returned.
+ */
+int hidpp10_request_commands(struct hidpp10_device *device,
+			     union hidpp10_message *msgs,
+			     unsigned count);
 int hidpp10_open_lock(struct hidpp10_device *device);
 int hidpp10_disconnect(struct hidpp10_device *device, int idx);
 void hidpp10_list_devices(struct ratbag_device *device);
+/**
+ * Create the device with the given wireless PID among the devices paired
+ * with the receiver behind the hidraw node, see hidpp10_receiver_get().
+ * The other paired devices are not asked.
+ */
 struct hidpp10_device *hidpp10_device_new_from_wpid(struct ratbag_device *device, uint16_t wpid);
 struct hidpp10_device *hidpp10_device_new_from_idx(struct ratbag_device *device, int idx);
 
@@ -219,6 +236,48 @@ hidpp10_get_pairing_information_device_name(struct hidpp10_device *dev,
 					    char *name,
 					    size_t *name_sz);
 
+/* the number of devices a receiver can pair with */
+#define HIDPP10_RECEIVER_MAX_DEVICES	6
+
+/**
+ * What is known about a receiver, shared by all devices talking through
+ * its hidraw node. The device at index i is paired in slot i - 1.
+ */
+struct hidpp10_receiver {
+	struct {
+		uint16_t wpid;		/* 0 if nothing is paired */
+		uint8_t report_interval;
+		uint8_t device_type;
+	} pairing[HIDPP10_RECEIVER_MAX_DEVICES];
+};
+
+/**
+ * Get the receiver behind the hidraw node of the device. Its pairing
+ * information is read by the first device on the node only.
+ *
+ * @return the receiver, or NULL if the node does not belong to a receiver
+ */
+struct hidpp10_receiver *
+hidpp10_receiver_get(struct ratbag_device *device);
+
+/* the onboard memory is read in chunks of 16 bytes, a page holds 32 of
+ * them. The profiles are in the pages 3 to 5. */
+#define HIDPP10_PAGE_SIZE			512
+#define HIDPP10_NUM_CACHED_PAGES		8
+
+struct hidpp10_memory_page {
+	uint32_t valid;		/* one bit per 16 byte chunk */
+	uint8_t data[HIDPP10_PAGE_SIZE];
+};
+
+/**
+ * Forget the onboard memory read so far, it has changed on the device.
+ * The requests writing to the device do this, and so do the
+ * notifications sent by the device.
+ */
+void
+hidpp10_memory_invalidate(struct hidpp10_device *dev);
+
 /* FIXME: that's what my G500s supports, but only pages 3-5 are valid.
  * 0 is zeroed, 1 and 2 are garbage, all above 6 is garbage */
 #define HIDPP10_NUM_PROFILES 3
@@ -237,5 +296,16 @@ struct hidpp10_device  {
 	bool led[4];
 	int8_t current_profile;
 	struct hidpp10_profile profiles[HIDPP10_NUM_PROFILES];
+	bool populated;
+	/* allocated when the page is first read */
+	struct hidpp10_memory_page *pages[HIDPP10_NUM_CACHED_PAGES];
 };
+
+/**
+ * Read the settings of the device and all its profiles into the struct.
+ * hidpp10_device_new_from_idx() and hidpp10_device_new_from_wpid() only
+ * identify the device, this is the expensive part and is done once.
+ */
+int
+hidpp10_device_populate(struct hidpp10_device *dev);
 #endif /* HIDPP_10_H */
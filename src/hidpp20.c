@@ -68,110 +68,223 @@ hidpp20_feature_get_name(uint16_t feature)
 }
 
 static int
-hidpp20_write_command(struct ratbag_device *device, uint8_t *cmd, int size)
+hidpp20_write_command(struct hidpp20_device *device, uint8_t *cmd, int size)
 {
-	int res = ratbag_hidraw_output_report(device, cmd, size);
+	int res = ratbag_hidraw_output_report(device->ratbag_device, cmd, size);
 
 	if (res == 0)
 		return 0;
 
 	if (res < 0)
-		log_error(device->ratbag, "Error: %s (%d)\n", strerror(-res), -res);
+		log_error(device->ratbag_device->ratbag, "Error: %s (%d)\n", strerror(-res), -res);
 
 	return res;
 }
 
+/* msg->address is 4 MSB: subcommand, 4 LSB: 4-bit SW identifier so
+ * the device knows who to respond to. The kernel uses 0x1, so we rotate
+ * through the remaining identifiers to tell our in-flight requests apart.
+ */
+#define HIDPP20_SW_ID_MIN			0x2
+#define HIDPP20_SW_ID_MAX			0xf
+
+struct hidpp20_pending {
+	unsigned index;		/* index in the caller's array */
+	uint8_t sub_id;
+	uint8_t address;	/* function | sw id */
+	uint64_t deadline;	/* the answer must arrive by then */
+	uint64_t sent_us;	/* for the latency statistics */
+};
+
+static uint8_t
+hidpp20_next_sw_id(struct hidpp20_device *device,
+		   const struct hidpp20_pending *pending,
+		   unsigned num_pending)
+{
+	uint8_t sw_id;
+	unsigned i;
+	bool in_use;
+
+	do {
+		sw_id = device->sw_id;
+		if (sw_id < HIDPP20_SW_ID_MIN || sw_id > HIDPP20_SW_ID_MAX)
+			sw_id = HIDPP20_SW_ID_MIN;
+		device->sw_id = sw_id + 1;
+
+		in_use = false;
+		for (i = 0; i < num_pending; i++) {
+			if ((pending[i].address & 0xf) == sw_id) {
+				in_use = true;
+				break;
+			}
+		}
+	} while (in_use);
+
+	return sw_id;
+}
+
+static void
+hidpp20_log_error(struct ratbag *ratbag, union hidpp20_message *reply,
+		  uint8_t hidpp_err, bool allow_error)
+{
+	enum ratbag_log_priority priority;
+
+	priority = allow_error ? RATBAG_LOG_PRIORITY_DEBUG : RATBAG_LOG_PRIORITY_ERROR;
+	log_msg(ratbag, priority,
+		"    HID++ error from the device (%d): %s (%02x)\n",
+		reply->msg.device_idx,
+		hidpp_errors[hidpp_err] ? hidpp_errors[hidpp_err] : "Undocumented error code",
+		hidpp_err);
+}
+
 static int
-hidpp20_request_command_allow_error(struct ratbag_device *device, union hidpp20_message *msg,
-				    bool allow_error)
+hidpp20_request_commands_allow_error(struct hidpp20_device *device,
+				     union hidpp20_message *msgs,
+				     unsigned count,
+				     bool allow_error)
 {
-	struct ratbag *ratbag = device->ratbag;
+	struct ratbag *ratbag = device->ratbag_device->ratbag;
+	struct hidpp20_pending pending[HIDPP20_MAX_INFLIGHT];
 	union hidpp20_message read_buffer;
-	int ret;
-	uint8_t hidpp_err = 0;
+	unsigned num_pending = 0, next = 0, completed = 0;
+	unsigned i, j;
+	int ret, rc = 0;
+	int first_error_index = -1;
+	uint8_t hidpp_err;
 	size_t msg_len;
+	unsigned int timeout = ratbag_device_get_request_timeout(device->ratbag_device);
 
-	/* msg->address is 4 MSB: subcommand, 4 LSB: 4-bit SW identifier so
-	 * the device knows who to respond to. kernel uses 0x1 */
-	const int DEVICE_SW_ID = 0x8;
-
-	if (msg->msg.address & 0xf) {
-		log_bug_libratbag(ratbag, "hidpp20 error: sw address is already set\n");
-		return -EINVAL;
+	for (i = 0; i < count; i++) {
+		if (msgs[i].msg.address & 0xf) {
+			log_bug_libratbag(ratbag, "hidpp20 error: sw address is already set\n");
+			return -EINVAL;
+		}
 	}
-	msg->msg.address |= DEVICE_SW_ID;
-
-	msg_len = msg->msg.report_id == REPORT_ID_SHORT ? SHORT_MESSAGE_LENGTH : LONG_MESSAGE_LENGTH;
 
-	log_buf_raw(ratbag, "sending: ", msg->data, msg_len);
+	while (completed < count) {
+		/* fill the pipeline */
+		while (num_pending < HIDPP20_MAX_INFLIGHT && next < count) {
+			union hidpp20_message *msg = &msgs[next];
+
+			msg->msg.address |= hidpp20_next_sw_id(device,
+							       pending,
+							       num_pending);
+			msg_len = msg->msg.report_id == REPORT_ID_SHORT ?
+					SHORT_MESSAGE_LENGTH : LONG_MESSAGE_LENGTH;
+
+			log_buf_raw(ratbag, "sending: ", msg->data, msg_len);
+
+			/* Send the message to the Device */
+			ret = hidpp20_write_command(device, msg->data, msg_len);
+			if (ret)
+				goto out_err;
+
+			pending[num_pending].index = next;
+			pending[num_pending].sub_id = msg->msg.sub_id;
+			pending[num_pending].address = msg->msg.address;
+			pending[num_pending].deadline = now_in_ms() + timeout;
+			pending[num_pending].sent_us = now_in_us();
+			num_pending++;
+			next++;
+		}
 
-	/* Send the message to the Device */
-	ret = hidpp20_write_command(device, msg->data, msg_len);
-	if (ret)
-		goto out_err;
+		/* the oldest request expires first, unrelated reports do not
+		 * extend its deadline */
+		ret = hidpp_read_report(device->ratbag_device,
+					read_buffer.data,
+					LONG_MESSAGE_LENGTH,
+					pending[0].deadline);
+		if (ret == -ETIMEDOUT) {
+			ratbag_stats_request_timeout(device->ratbag_device,
+						     RATBAG_STATS_CLASS_HIDPP20);
+			log_error(ratbag, "    request timed out after %ums\n", timeout);
+			goto out_err;
+		}
+		if (ret < 0) {
+			log_error(ratbag, "    USB error: %s (%d)\n", strerror(-ret), -ret);
+			goto out_err;
+		}
+		if (ret == 0) {
+			ret = -EIO;
+			goto out_err;
+		}
 
-	/*
-	 * Now read the answers from the device:
-	 * loop until we get the actual answer or an error code.
-	 */
-	do {
-		ret = ratbag_hidraw_read_input_report(device, read_buffer.data, LONG_MESSAGE_LENGTH);
 		log_buf_raw(ratbag, " *** received: ", read_buffer.data, ret);
 
-		if (read_buffer.msg.report_id != REPORT_ID_SHORT &&
-		    read_buffer.msg.report_id != REPORT_ID_LONG)
-			continue;
+		hidpp_err = 0;
+		for (i = 0; i < num_pending; i++) {
+			struct hidpp20_pending *p = &pending[i];
+
+			/* actual answer */
+			if (read_buffer.msg.sub_id == p->sub_id &&
+			    read_buffer.msg.address == p->address) {
+				/* copy the answer for the caller */
+				msgs[p->index] = read_buffer;
+				break;
+			}
+
+			/* error */
+			if ((read_buffer.msg.sub_id == __ERROR_MSG ||
+			     read_buffer.msg.sub_id == 0xff) &&
+			    read_buffer.msg.address == p->sub_id &&
+			    read_buffer.msg.parameters[0] == p->address) {
+				hidpp_err = read_buffer.msg.parameters[1];
+				hidpp20_log_error(ratbag, &read_buffer,
+						  hidpp_err, allow_error);
+				if (first_error_index < 0 ||
+				    (int)p->index < first_error_index) {
+					first_error_index = p->index;
+					rc = hidpp_err;
+				}
+				break;
+			}
+		}
 
-		/* actual answer */
-		if (read_buffer.msg.sub_id == msg->msg.sub_id &&
-		    read_buffer.msg.address == msg->msg.address)
-			break;
-
-		/* error */
-		if ((read_buffer.msg.sub_id == __ERROR_MSG ||
-		     read_buffer.msg.sub_id == 0xff) &&
-		    read_buffer.msg.address == msg->msg.sub_id &&
-		    read_buffer.msg.parameters[0] == msg->msg.address) {
-			hidpp_err = read_buffer.msg.parameters[1];
-			if (allow_error)
-				log_debug(ratbag,
-					"    HID++ error from the device (%d): %s (%02x)\n",
-					read_buffer.msg.device_idx,
-					hidpp_errors[hidpp_err] ? hidpp_errors[hidpp_err] : "Undocumented error code",
-					hidpp_err);
-			else
-				log_error(ratbag,
-					"    HID++ error from the device (%d): %s (%02x)\n",
-					read_buffer.msg.device_idx,
-					hidpp_errors[hidpp_err] ? hidpp_errors[hidpp_err] : "Undocumented error code",
-					hidpp_err);
-			break;
+		if (i == num_pending) {
+			/* a notification, the driver may need to know */
+			ratbag_hidraw_raw_event(device->ratbag_device,
+						read_buffer.data, ret);
+			continue;
 		}
-	} while (ret > 0);
 
-	if (ret < 0) {
-		log_error(ratbag, "    USB error: %s (%d)\n", strerror(-ret), -ret);
-		perror("write");
-		goto out_err;
-	}
+		ratbag_stats_request_done(device->ratbag_device, RATBAG_STATS_CLASS_HIDPP20,
+					  now_in_us() - pending[i].sent_us,
+					  hidpp_err);
 
-	if (!hidpp_err) {
-		/* copy the answer for the caller */
-		*msg = read_buffer;
+		/* the request is done, keep the others in sending order */
+		for (j = i; j < num_pending - 1; j++)
+			pending[j] = pending[j + 1];
+		num_pending--;
+		completed++;
 	}
 
-	ret = hidpp_err;
+	return rc;
 
 out_err:
 	return ret;
 }
 
+static int
+hidpp20_request_command_allow_error(struct hidpp20_device *device, union hidpp20_message *msg,
+				    bool allow_error)
+{
+	return hidpp20_request_commands_allow_error(device, msg, 1, allow_error);
+}
+
 int
-hidpp20_request_command(struct ratbag_device *device, union hidpp20_message *msg)
+hidpp20_request_command(struct hidpp20_device *device, union hidpp20_message *msg)
 {
 	return hidpp20_request_command_allow_error(device, msg, false);
 }
 
+int
+hidpp20_request_commands(struct hidpp20_device *device,
+			 union hidpp20_message *msgs,
+			 unsigned count)
+{
+	return hidpp20_request_commands_allow_error(device, msgs, count, false);
+}
+
 static inline uint16_t
 hidpp20_get_unaligned_u16(uint8_t *buf)
 {
@@ -188,7 +301,7 @@ hidpp20_get_unaligned_u16(uint8_t *buf)
 #define CMD_ROOT_GET_PROTOCOL_VERSION			0x10
 
 int
-hidpp_root_get_feature(struct ratbag_device *device,
+hidpp_root_get_feature(struct hidpp20_device *device,
 		       uint16_t feature,
 		       uint8_t *feature_index,
 		       uint8_t *feature_type,
@@ -212,12 +325,43 @@ hidpp_root_get_feature(struct ratbag_device *device,
 	*feature_type = msg.msg.parameters[1];
 	*feature_version = msg.msg.parameters[2];
 
-	log_raw(device->ratbag, "feature 0x%04x is at 0x%02x\n", feature, *feature_index);
+	log_raw(device->ratbag_device->ratbag, "feature 0x%04x is at 0x%02x\n", feature, *feature_index);
 	return 0;
 }
 
 int
-hidpp20_root_get_protocol_version(struct ratbag_device *device,
+hidpp_root_get_feature_idx(struct hidpp20_device *device,
+			   uint16_t feature,
+			   uint8_t *feature_index)
+{
+	uint8_t feature_type, feature_version;
+	unsigned i;
+
+	if (feature == HIDPP_PAGE_ROOT) {
+		*feature_index = HIDPP_PAGE_ROOT_IDX;
+		return 0;
+	}
+
+	for (i = 0; i < device->feature_count; i++) {
+		if (device->feature_list[i].feature == feature) {
+			*feature_index = i;
+			return 0;
+		}
+	}
+
+	/* the feature list is complete, no need to ask the device */
+	if (device->feature_count)
+		return -ENOTSUP;
+
+	return hidpp_root_get_feature(device,
+				      feature,
+				      feature_index,
+				      &feature_type,
+				      &feature_version);
+}
+
+int
+hidpp20_root_get_protocol_version(struct hidpp20_device *device,
 				  unsigned *major,
 				  unsigned *minor)
 {
@@ -253,7 +397,7 @@ hidpp20_root_get_protocol_version(struct ratbag_device *device,
 #define CMD_FEATURE_SET_GET_FEATURE_ID			0x10
 
 static int
-hidpp20_feature_set_get_count(struct ratbag_device *device, uint8_t reg)
+hidpp20_feature_set_get_count(struct hidpp20_device *device, uint8_t reg)
 {
 	int rc;
 	union hidpp20_message msg = {
@@ -271,39 +415,50 @@ hidpp20_feature_set_get_count(struct ratbag_device *device, uint8_t reg)
 }
 
 static int
-hidpp20_feature_set_get_feature_id(struct ratbag_device *device,
-				   uint8_t reg,
-				   uint8_t feature_index,
-				   uint16_t *feature,
-				   uint8_t *type)
+hidpp20_feature_set_get_feature_ids(struct hidpp20_device *device,
+				    uint8_t reg,
+				    struct hidpp20_feature *flist,
+				    unsigned int feature_count)
 {
+	union hidpp20_message *msgs;
+	unsigned int i;
 	int rc;
-	union hidpp20_message msg = {
-		.msg.report_id = REPORT_ID_LONG,
-		.msg.device_idx = 0xff,
-		.msg.sub_id = reg,
-		.msg.address = CMD_FEATURE_SET_GET_FEATURE_ID,
-		.msg.parameters[0] = feature_index,
-	};
 
-	rc = hidpp20_request_command(device, &msg);
+	msgs = zalloc(feature_count * sizeof(*msgs));
+	if (!msgs)
+		return -ENOMEM;
+
+	for (i = 0; i < feature_count; i++) {
+		msgs[i].msg.report_id = REPORT_ID_LONG;
+		msgs[i].msg.device_idx = 0xff;
+		msgs[i].msg.sub_id = reg;
+		msgs[i].msg.address = CMD_FEATURE_SET_GET_FEATURE_ID;
+		msgs[i].msg.parameters[0] = i;
+	}
+
+	/* the queries don't depend on each other, so they all go out
+	 * back-to-back and the answers are collected as they arrive */
+	rc = hidpp20_request_commands(device, msgs, feature_count);
 	if (rc)
-		return rc;
+		goto out;
 
-	*feature = hidpp20_get_unaligned_u16(msg.msg.parameters);
-	*type = msg.msg.parameters[2];
+	for (i = 0; i < feature_count; i++) {
+		flist[i].feature = hidpp20_get_unaligned_u16(msgs[i].msg.parameters);
+		flist[i].type = msgs[i].msg.parameters[2];
+	}
 
-	return 0;
+out:
+	free(msgs);
+	return rc;
 }
 
-int hidpp20_feature_set_get(struct ratbag_device *device,
+int hidpp20_feature_set_get(struct hidpp20_device *device,
 			    struct hidpp20_feature **feature_list)
 {
 	uint8_t feature_index, feature_type, feature_version;
 	struct hidpp20_feature *flist;
 	int rc;
-	uint8_t feature_count;
-	unsigned int i;
+	unsigned int feature_count;
 
 	rc = hidpp_root_get_feature(device,
 				    HIDPP_PAGE_FEATURE_SET,
@@ -317,32 +472,75 @@ int hidpp20_feature_set_get(struct ratbag_device *device,
 	if (rc < 0)
 		return rc;
 
-	feature_count = (uint8_t)rc;
-
-	if (!feature_count) {
-		*feature_list = NULL;
-		return 0;
-	}
+	/* the count does not include the root feature at index 0 */
+	feature_count = (uint8_t)rc + 1;
 
 	flist = zalloc(feature_count * sizeof(struct hidpp20_feature));
 	if (!flist)
 		return -ENOMEM;
 
-	for (i = 0; i < feature_count; i++) {
-		rc = hidpp20_feature_set_get_feature_id(device,
-							feature_index,
-							i,
-							&flist[i].feature,
-							&flist[i].type);
-		if (rc)
-			goto err;
+	rc = hidpp20_feature_set_get_feature_ids(device, feature_index,
+						 flist, feature_count);
+	if (rc) {
+		free(flist);
+		return rc;
 	}
 
 	*feature_list = flist;
 	return feature_count;
-err:
-	free(flist);
-	return rc;
+}
+
+void
+hidpp20_device_set_feature_list(struct hidpp20_device *device,
+				struct hidpp20_feature *feature_list,
+				unsigned feature_count)
+{
+	free(device->feature_list);
+	device->feature_list = feature_list;
+	device->feature_count = feature_list ? feature_count : 0;
+}
+
+/* -------------------------------------------------------------------------- */
+/* 0x0003: Device Information                                                 */
+/* -------------------------------------------------------------------------- */
+
+#define CMD_DEVICE_INFO_GET_DEVICE_INFO			0x00
+#define CMD_DEVICE_INFO_GET_FW_INFO			0x10
+
+int
+hidpp20_device_info_get_fw_info(struct hidpp20_device *device,
+				uint8_t entity,
+				struct hidpp20_fw_info *info)
+{
+	uint8_t feature_index;
+	union hidpp20_message msg = {
+		.msg.report_id = REPORT_ID_LONG,
+		.msg.device_idx = 0xff,
+		.msg.address = CMD_DEVICE_INFO_GET_FW_INFO,
+		.msg.parameters[0] = entity,
+	};
+	int rc;
+
+	rc = hidpp_root_get_feature_idx(device,
+					HIDPP_PAGE_DEVICE_INFO,
+					&feature_index);
+	if (rc)
+		return rc;
+
+	msg.msg.sub_id = feature_index;
+
+	rc = hidpp20_request_command_allow_error(device, &msg, true);
+	if (rc)
+		return rc;
+
+	info->type = msg.msg.parameters[0] & 0x0f;
+	memcpy(info->name, &msg.msg.parameters[1], 3);
+	info->name[3] = '\0';
+	info->major = msg.msg.parameters[4];
+	info->minor = msg.msg.parameters[5];
+	info->build = hidpp20_get_unaligned_u16(&msg.msg.parameters[6]);
+
+	return 0;
 }
 
 /* -------------------------------------------------------------------------- */
@@ -353,11 +551,11 @@ err:
 #define CMD_BATTERY_LEVEL_STATUS_GET_BATTERY_CAPABILITY		0x10
 
 int
-hidpp20_batterylevel_get_battery_level(struct ratbag_device *device,
+hidpp20_batterylevel_get_battery_level(struct hidpp20_device *device,
 				       uint16_t *level,
 				       uint16_t *next_level)
 {
-	uint8_t feature_index, feature_type, feature_version;
+	uint8_t feature_index;
 	union hidpp20_message msg = {
 		.msg.report_id = REPORT_ID_LONG,
 		.msg.device_idx = 0xff,
@@ -365,11 +563,9 @@ hidpp20_batterylevel_get_battery_level(struct ratbag_device *device,
 	};
 	int rc;
 
-	rc = hidpp_root_get_feature(device,
-				    HIDPP_PAGE_BATTERY_LEVEL_STATUS,
-				    &feature_index,
-				    &feature_type,
-				    &feature_version);
+	rc = hidpp_root_get_feature_idx(device,
+					HIDPP_PAGE_BATTERY_LEVEL_STATUS,
+					&feature_index);
 	if (rc)
 		return rc;
 
@@ -393,7 +589,7 @@ hidpp20_batterylevel_get_battery_level(struct ratbag_device *device,
 #define CMD_KBD_REPROGRAMMABLE_KEYS_GET_CTRL_ID_INFO	0x10
 
 static int
-hidpp20_kbd_reprogrammable_keys_get_count(struct ratbag_device *device, uint8_t reg)
+hidpp20_kbd_reprogrammable_keys_get_count(struct hidpp20_device *device, uint8_t reg)
 {
 	union hidpp20_message msg = {
 		.msg.report_id = REPORT_ID_LONG,
@@ -411,45 +607,57 @@ hidpp20_kbd_reprogrammable_keys_get_count(struct ratbag_device *device, uint8_t
 }
 
 static int
-hidpp20_kbd_reprogrammable_keys_get_info(struct ratbag_device *device,
+hidpp20_kbd_reprogrammable_keys_get_info(struct hidpp20_device *device,
 					 uint8_t reg,
-					 struct hidpp20_control_id *control)
+					 struct hidpp20_control_id *controls,
+					 unsigned num_controls)
 {
+	struct hidpp20_control_id *control;
+	union hidpp20_message *msgs;
+	unsigned i;
 	int rc;
-	union hidpp20_message msg = {
-		.msg.report_id = REPORT_ID_LONG,
-		.msg.device_idx = 0xff,
-		.msg.sub_id = reg,
-		.msg.address = CMD_KBD_REPROGRAMMABLE_KEYS_GET_CTRL_ID_INFO,
-		.msg.parameters[0] = control->index,
-	};
 
-	rc = hidpp20_request_command(device, &msg);
+	msgs = zalloc(num_controls * sizeof(*msgs));
+	if (!msgs)
+		return -ENOMEM;
+
+	for (i = 0; i < num_controls; i++) {
+		msgs[i].msg.report_id = REPORT_ID_LONG;
+		msgs[i].msg.device_idx = 0xff;
+		msgs[i].msg.sub_id = reg;
+		msgs[i].msg.address = CMD_KBD_REPROGRAMMABLE_KEYS_GET_CTRL_ID_INFO;
+		msgs[i].msg.parameters[0] = controls[i].index;
+	}
+
+	rc = hidpp20_request_commands(device, msgs, num_controls);
 	if (rc)
-		return rc;
+		goto out;
 
-	control->control_id = hidpp20_get_unaligned_u16(&msg.msg.parameters[0]);
-	control->task_id = hidpp20_get_unaligned_u16(&msg.msg.parameters[2]);
-	control->flags = msg.msg.parameters[4];
+	for (i = 0; i < num_controls; i++) {
+		control = &controls[i];
+		control->control_id = hidpp20_get_unaligned_u16(&msgs[i].msg.parameters[0]);
+		control->task_id = hidpp20_get_unaligned_u16(&msgs[i].msg.parameters[2]);
+		control->flags = msgs[i].msg.parameters[4];
+	}
 
-	return 0;
+out:
+	free(msgs);
+	return rc;
 }
 
 int
-hidpp20_kbd_reprogrammable_keys_get_controls(struct ratbag_device *device,
+hidpp20_kbd_reprogrammable_keys_get_controls(struct hidpp20_device *device,
 					     struct hidpp20_control_id **controls_list)
 {
-	uint8_t feature_index, feature_type, feature_version;
+	uint8_t feature_index;
 	struct hidpp20_control_id *c_list, *control;
 	uint8_t num_controls;
 	unsigned i;
 	int rc;
 
-	rc = hidpp_root_get_feature(device,
-				    HIDPP_PAGE_KBD_REPROGRAMMABLE_KEYS,
-				    &feature_index,
-				    &feature_type,
-				    &feature_version);
+	rc = hidpp_root_get_feature_idx(device,
+					HIDPP_PAGE_KBD_REPROGRAMMABLE_KEYS,
+					&feature_index);
 	if (rc)
 		return rc;
 
@@ -467,18 +675,22 @@ hidpp20_kbd_reprogrammable_keys_get_controls(struct ratbag_device *device,
 	if (!c_list)
 		return -ENOMEM;
 
+	for (i = 0; i < num_controls; i++)
+		c_list[i].index = i;
+
+	rc = hidpp20_kbd_reprogrammable_keys_get_info(device,
+						      feature_index,
+						      c_list,
+						      num_controls);
+	if (rc)
+		goto err;
+
 	for (i = 0; i < num_controls; i++) {
 		control = &c_list[i];
-		control->index = i;
-		rc = hidpp20_kbd_reprogrammable_keys_get_info(device,
-							      feature_index,
-							      control);
-		if (rc)
-			goto err;
 
 		/* 0x1b00 and 0x1b04 have the same control/task id mappings.
 		 * I hope */
-		log_raw(device->ratbag,
+		log_raw(device->ratbag_device->ratbag,
 			"control %d: cid: '%s' (%d) tid: '%s' (%d) flags: 0x%02x\n",
 			control->index,
 			hidpp20_1b04_get_logical_mapping_name(control->control_id),
@@ -624,7 +836,7 @@ hidpp20_1b04_get_physical_mapping_name(uint16_t value)
 }
 
 static int
-hidpp20_special_keys_buttons_get_count(struct ratbag_device *device, uint8_t reg)
+hidpp20_special_keys_buttons_get_count(struct hidpp20_device *device, uint8_t reg)
 {
 	int rc;
 	union hidpp20_message msg = {
@@ -642,77 +854,105 @@ hidpp20_special_keys_buttons_get_count(struct ratbag_device *device, uint8_t reg
 }
 
 static int
-hidpp20_special_keys_buttons_get_info(struct ratbag_device *device,
-				    uint8_t reg,
-				    struct hidpp20_control_id *control)
+hidpp20_special_keys_buttons_get_info(struct hidpp20_device *device,
+				      uint8_t reg,
+				      struct hidpp20_control_id *controls,
+				      unsigned num_controls)
 {
+	struct hidpp20_control_id *control;
+	union hidpp20_message *msgs, *msg;
+	unsigned i;
 	int rc;
-	union hidpp20_message msg = {
-		.msg.report_id = REPORT_ID_LONG,
-		.msg.device_idx = 0xff,
-		.msg.sub_id = reg,
-		.msg.address = CMD_SPECIAL_KEYS_BUTTONS_GET_INFO,
-		.msg.parameters[0] = control->index,
-	};
 
-	rc = hidpp20_request_command(device, &msg);
+	msgs = zalloc(num_controls * sizeof(*msgs));
+	if (!msgs)
+		return -ENOMEM;
+
+	for (i = 0; i < num_controls; i++) {
+		msgs[i].msg.report_id = REPORT_ID_LONG;
+		msgs[i].msg.device_idx = 0xff;
+		msgs[i].msg.sub_id = reg;
+		msgs[i].msg.address = CMD_SPECIAL_KEYS_BUTTONS_GET_INFO;
+		msgs[i].msg.parameters[0] = controls[i].index;
+	}
+
+	rc = hidpp20_request_commands(device, msgs, num_controls);
 	if (rc)
-		return rc;
+		goto out;
 
-	control->control_id = hidpp20_get_unaligned_u16(&msg.msg.parameters[0]);
-	control->task_id = hidpp20_get_unaligned_u16(&msg.msg.parameters[2]);
-	control->flags = msg.msg.parameters[4];
-	control->position = msg.msg.parameters[5];
-	control->group = msg.msg.parameters[6];
-	control->group_mask = msg.msg.parameters[7];
-	control->raw_XY = msg.msg.parameters[8] & 0x01;
+	for (i = 0; i < num_controls; i++) {
+		control = &controls[i];
+		msg = &msgs[i];
+		control->control_id = hidpp20_get_unaligned_u16(&msg->msg.parameters[0]);
+		control->task_id = hidpp20_get_unaligned_u16(&msg->msg.parameters[2]);
+		control->flags = msg->msg.parameters[4];
+		control->position = msg->msg.parameters[5];
+		control->group = msg->msg.parameters[6];
+		control->group_mask = msg->msg.parameters[7];
+		control->raw_XY = msg->msg.parameters[8] & 0x01;
+	}
 
-	return 0;
+out:
+	free(msgs);
+	return rc;
 }
 
 
 static int
-hidpp20_special_keys_buttons_get_reporting(struct ratbag_device *device,
+hidpp20_special_keys_buttons_get_reporting(struct hidpp20_device *device,
 					   uint8_t reg,
-					   struct hidpp20_control_id *control)
+					   struct hidpp20_control_id *controls,
+					   unsigned num_controls)
 {
+	struct hidpp20_control_id *control;
+	union hidpp20_message *msgs, *msg;
+	unsigned i;
 	int rc;
-	union hidpp20_message msg = {
-		.msg.report_id = REPORT_ID_LONG,
-		.msg.device_idx = 0xff,
-		.msg.sub_id = reg,
-		.msg.address = CMD_SPECIAL_KEYS_BUTTONS_GET_REPORTING,
-		.msg.parameters[0] = control->control_id >> 8,
-		.msg.parameters[1] = control->control_id & 0xff,
-	};
 
-	rc = hidpp20_request_command(device, &msg);
+	msgs = zalloc(num_controls * sizeof(*msgs));
+	if (!msgs)
+		return -ENOMEM;
+
+	for (i = 0; i < num_controls; i++) {
+		msgs[i].msg.report_id = REPORT_ID_LONG;
+		msgs[i].msg.device_idx = 0xff;
+		msgs[i].msg.sub_id = reg;
+		msgs[i].msg.address = CMD_SPECIAL_KEYS_BUTTONS_GET_REPORTING;
+		msgs[i].msg.parameters[0] = controls[i].control_id >> 8;
+		msgs[i].msg.parameters[1] = controls[i].control_id & 0xff;
+	}
+
+	rc = hidpp20_request_commands(device, msgs, num_controls);
 	if (rc)
-		return rc;
+		goto out;
 
-	control->reporting.remapped = hidpp20_get_unaligned_u16(&msg.msg.parameters[3]);
-	control->reporting.raw_XY = !!(msg.msg.parameters[2] & 0x10);
-	control->reporting.persist = !!(msg.msg.parameters[2] & 0x04);
-	control->reporting.divert = !!(msg.msg.parameters[2] & 0x01);
+	for (i = 0; i < num_controls; i++) {
+		control = &controls[i];
+		msg = &msgs[i];
+		control->reporting.remapped = hidpp20_get_unaligned_u16(&msg->msg.parameters[3]);
+		control->reporting.raw_XY = !!(msg->msg.parameters[2] & 0x10);
+		control->reporting.persist = !!(msg->msg.parameters[2] & 0x04);
+		control->reporting.divert = !!(msg->msg.parameters[2] & 0x01);
+	}
 
-	return 0;
+out:
+	free(msgs);
+	return rc;
 }
 
-int hidpp20_special_key_mouse_get_controls(struct ratbag_device *device,
+int hidpp20_special_key_mouse_get_controls(struct hidpp20_device *device,
 					   struct hidpp20_control_id **controls_list)
 {
-	uint8_t feature_index, feature_type, feature_version;
+	uint8_t feature_index;
 	struct hidpp20_control_id *c_list, *control;
 	uint8_t num_controls;
 	unsigned i;
 	int rc;
 
 
-	rc = hidpp_root_get_feature(device,
-				    HIDPP_PAGE_SPECIAL_KEYS_BUTTONS,
-				    &feature_index,
-				    &feature_type,
-				    &feature_version);
+	rc = hidpp_root_get_feature_idx(device,
+					HIDPP_PAGE_SPECIAL_KEYS_BUTTONS,
+					&feature_index);
 	if (rc)
 		return rc;
 
@@ -730,22 +970,27 @@ int hidpp20_special_key_mouse_get_controls(struct ratbag_device *device,
 	if (!c_list)
 		return -ENOMEM;
 
+	for (i = 0; i < num_controls; i++)
+		c_list[i].index = i;
+
+	/* the reporting requests need the control ids from the info */
+	rc = hidpp20_special_keys_buttons_get_info(device,
+						   feature_index,
+						   c_list,
+						   num_controls);
+	if (rc)
+		goto err;
+
+	rc = hidpp20_special_keys_buttons_get_reporting(device,
+							feature_index,
+							c_list,
+							num_controls);
+	if (rc)
+		goto err;
+
 	for (i = 0; i < num_controls; i++) {
 		control = &c_list[i];
-		control->index = i;
-		rc = hidpp20_special_keys_buttons_get_info(device,
-							   feature_index,
-							   control);
-		if (rc)
-			goto err;
-
-		rc = hidpp20_special_keys_buttons_get_reporting(device,
-								feature_index,
-								control);
-		if (rc)
-			goto err;
-
-		log_raw(device->ratbag,
+		log_raw(device->ratbag_device->ratbag,
 			"control %d: cid: '%s' (%d) tid: '%s' (%d) flags: 0x%02x pos: %d group: %d gmask: 0x%02x raw_XY: %s\n"
 			"      reporting: raw_xy: %s persist: %s divert: %s remapped: '%s' (%d)\n",
 			control->index,
@@ -773,42 +1018,120 @@ err:
 }
 
 int
-hidpp20_special_key_mouse_set_control(struct ratbag_device *device,
-				      struct hidpp20_control_id *control)
+hidpp20_special_key_mouse_update_controls(struct hidpp20_device *device,
+					  struct hidpp20_control_id *controls,
+					  unsigned num_controls)
 {
-	uint8_t feature_index, feature_type, feature_version;
-	union hidpp20_message msg = {
-		.msg.report_id = REPORT_ID_LONG,
-		.msg.device_idx = 0xff,
-		.msg.address = CMD_SPECIAL_KEYS_BUTTONS_SET_REPORTING,
-		.msg.parameters[0] = control->control_id >> 8,
-		.msg.parameters[1] = control->control_id & 0xff,
-		.msg.parameters[2] = 0x00,
-		.msg.parameters[3] = control->reporting.remapped >> 8,
-		.msg.parameters[4] = control->reporting.remapped & 0xff,
-	};
+	uint8_t feature_index;
 	int rc;
 
+	if (num_controls == 0)
+		return 0;
 
-	rc = hidpp_root_get_feature(device,
-				    HIDPP_PAGE_SPECIAL_KEYS_BUTTONS,
-				    &feature_index,
-				    &feature_type,
-				    &feature_version);
+	rc = hidpp_root_get_feature_idx(device,
+					HIDPP_PAGE_SPECIAL_KEYS_BUTTONS,
+					&feature_index);
 	if (rc)
 		return rc;
 
-	msg.msg.sub_id = feature_index;
+	return hidpp20_special_keys_buttons_get_reporting(device,
+							  feature_index,
+							  controls,
+							  num_controls);
+}
+
+static void
+hidpp20_special_keys_buttons_set_reporting_msg(union hidpp20_message *msg,
+					       uint8_t reg,
+					       struct hidpp20_control_id *control)
+{
+	memset(msg, 0, sizeof(*msg));
+	msg->msg.report_id = REPORT_ID_LONG;
+	msg->msg.device_idx = 0xff;
+	msg->msg.sub_id = reg;
+	msg->msg.address = CMD_SPECIAL_KEYS_BUTTONS_SET_REPORTING;
+	msg->msg.parameters[0] = control->control_id >> 8;
+	msg->msg.parameters[1] = control->control_id & 0xff;
+	msg->msg.parameters[2] = 0x00;
+	msg->msg.parameters[3] = control->reporting.remapped >> 8;
+	msg->msg.parameters[4] = control->reporting.remapped & 0xff;
+
 	if (control->reporting.divert)
-		msg.msg.parameters[2] |= 0x03;
+		msg->msg.parameters[2] |= 0x03;
 	if (control->reporting.persist)
-		msg.msg.parameters[2] |= 0x0c;
+		msg->msg.parameters[2] |= 0x0c;
 	if (control->reporting.raw_XY)
-		msg.msg.parameters[2] |= 0x20;
+		msg->msg.parameters[2] |= 0x20;
+}
+
+int
+hidpp20_special_key_mouse_set_control(struct hidpp20_device *device,
+				      struct hidpp20_control_id *control)
+{
+	uint8_t feature_index;
+	union hidpp20_message msg;
+	int rc;
+
+
+	rc = hidpp_root_get_feature_idx(device,
+					HIDPP_PAGE_SPECIAL_KEYS_BUTTONS,
+					&feature_index);
+	if (rc)
+		return rc;
+
+	hidpp20_special_keys_buttons_set_reporting_msg(&msg, feature_index, control);
 
 	return hidpp20_request_command(device, &msg);
 }
 
+int
+hidpp20_special_key_mouse_set_controls(struct hidpp20_device *device,
+				       struct hidpp20_control_id *controls,
+				       unsigned num_controls)
+{
+	uint8_t feature_index;
+	union hidpp20_message *msgs;
+	unsigned i, count = 0;
+	int rc;
+
+	for (i = 0; i < num_controls; i++) {
+		if (controls[i].reporting.updated)
+			count++;
+	}
+
+	if (count == 0)
+		return 0;
+
+	rc = hidpp_root_get_feature_idx(device,
+					HIDPP_PAGE_SPECIAL_KEYS_BUTTONS,
+					&feature_index);
+	if (rc)
+		return rc;
+
+	msgs = zalloc(count * sizeof(*msgs));
+	if (!msgs)
+		return -ENOMEM;
+
+	count = 0;
+	for (i = 0; i < num_controls; i++) {
+		if (!controls[i].reporting.updated)
+			continue;
+
+		hidpp20_special_keys_buttons_set_reporting_msg(&msgs[count++],
+							       feature_index,
+							       &controls[i]);
+	}
+
+	rc = hidpp20_request_commands(device, msgs, count);
+	if (rc == 0) {
+		for (i = 0; i < num_controls; i++)
+			controls[i].reporting.updated = 0;
+	}
+
+	free(msgs);
+	return rc;
+}
+
 /* -------------------------------------------------------------------------- */
 /* 0x2200: Mouse Pointer Basic Optical Sensors                                */
 /* -------------------------------------------------------------------------- */
@@ -816,24 +1139,21 @@ hidpp20_special_key_mouse_set_control(struct ratbag_device *device,
 #define CMD_MOUSE_POINTER_BASIC_GET_INFO		0x00
 
 int
-hidpp20_mousepointer_get_mousepointer_info(struct ratbag_device *device,
+hidpp20_mousepointer_get_mousepointer_info(struct hidpp20_device *device,
 					   uint16_t *resolution,
 					   uint8_t *flags)
 {
-	uint8_t feature_index, feature_type, feature_version;
+	uint8_t feature_index;
 	union hidpp20_message msg = {
 		.msg.report_id = REPORT_ID_LONG,
 		.msg.device_idx = 0xff,
 		.msg.address = CMD_MOUSE_POINTER_BASIC_GET_INFO,
-		.msg.parameters[0] = feature_index,
 	};
 	int rc;
 
-	rc = hidpp_root_get_feature(device,
-				    HIDPP_PAGE_MOUSE_POINTER_BASIC,
-				    &feature_index,
-				    &feature_type,
-				    &feature_version);
+	rc = hidpp_root_get_feature_idx(device,
+					HIDPP_PAGE_MOUSE_POINTER_BASIC,
+					&feature_index);
 	if (rc)
 		return rc;
 
@@ -859,7 +1179,7 @@ hidpp20_mousepointer_get_mousepointer_info(struct ratbag_device *device,
 #define CMD_ADJUSTABLE_DPI_SET_SENSOR_DPI		0x30
 
 static int
-hidpp20_adjustable_dpi_get_count(struct ratbag_device *device, uint8_t reg)
+hidpp20_adjustable_dpi_get_count(struct hidpp20_device *device, uint8_t reg)
 {
 	int rc;
 	union hidpp20_message msg = {
@@ -876,31 +1196,18 @@ hidpp20_adjustable_dpi_get_count(struct ratbag_device *device, uint8_t reg)
 	return msg.msg.parameters[0];
 }
 
-static int
-hidpp20_adjustable_dpi_get_dpi_list(struct ratbag_device *device,
-				    uint8_t reg,
-				    struct hidpp20_sensor *sensor)
+static void
+hidpp20_adjustable_dpi_parse_dpi_list(union hidpp20_message *msg,
+				      struct hidpp20_sensor *sensor)
 {
-	int rc;
 	unsigned i = 1, dpi_index = 0;
-	union hidpp20_message msg = {
-		.msg.report_id = REPORT_ID_LONG,
-		.msg.device_idx = 0xff,
-		.msg.sub_id = reg,
-		.msg.address = CMD_ADJUSTABLE_DPI_GET_SENSOR_DPI_LIST,
-		.msg.parameters[0] = sensor->index,
-	};
-
-	rc = hidpp20_request_command(device, &msg);
-	if (rc)
-		return rc;
 
 	sensor->dpi_min = 0xffff;
 
-	sensor->index = msg.msg.parameters[0];
+	sensor->index = msg->msg.parameters[0];
 	while (i < LONG_MESSAGE_LENGTH - 1 &&
-	       hidpp20_get_unaligned_u16(&msg.msg.parameters[i]) != 0) {
-		uint16_t value = hidpp20_get_unaligned_u16(&msg.msg.parameters[i]);
+	       hidpp20_get_unaligned_u16(&msg->msg.parameters[i]) != 0) {
+		uint16_t value = hidpp20_get_unaligned_u16(&msg->msg.parameters[i]);
 
 		if (value > 0xe000) {
 			sensor->dpi_steps = value - 0xe000;
@@ -912,50 +1219,71 @@ hidpp20_adjustable_dpi_get_dpi_list(struct ratbag_device *device,
 		assert(sensor->dpi_list[dpi_index] == 0x0000);
 		i += 2;
 	}
-
-	return 0;
 }
 
+static void
+hidpp20_adjustable_dpi_parse_dpi(union hidpp20_message *msg,
+				 struct hidpp20_sensor *sensor)
+{
+	sensor->dpi = hidpp20_get_unaligned_u16(&msg->msg.parameters[1]);
+	sensor->default_dpi = hidpp20_get_unaligned_u16(&msg->msg.parameters[3]);
+}
 
+/**
+ * Query the dpi list and the current dpi of all sensors at once, the
+ * requests are independent of each other so they can all be in flight
+ * together.
+ */
 static int
-hidpp20_adjustable_dpi_get_dpi(struct ratbag_device *device,
-			       uint8_t reg,
-			       struct hidpp20_sensor *sensor)
+hidpp20_adjustable_dpi_get_sensor_info(struct hidpp20_device *device,
+				       uint8_t reg,
+				       struct hidpp20_sensor *sensors,
+				       unsigned num_sensors)
 {
+	union hidpp20_message *msgs;
+	unsigned i;
 	int rc;
-	union hidpp20_message msg = {
-		.msg.report_id = REPORT_ID_LONG,
-		.msg.device_idx = 0xff,
-		.msg.sub_id = reg,
-		.msg.address = CMD_ADJUSTABLE_DPI_GET_SENSOR_DPI,
-		.msg.parameters[0] = sensor->index,
-	};
 
-	rc = hidpp20_request_command(device, &msg);
+	msgs = zalloc(2 * num_sensors * sizeof(*msgs));
+	if (!msgs)
+		return -ENOMEM;
+
+	for (i = 0; i < 2 * num_sensors; i++) {
+		msgs[i].msg.report_id = REPORT_ID_LONG;
+		msgs[i].msg.device_idx = 0xff;
+		msgs[i].msg.sub_id = reg;
+		msgs[i].msg.address = (i % 2) ? CMD_ADJUSTABLE_DPI_GET_SENSOR_DPI :
+						CMD_ADJUSTABLE_DPI_GET_SENSOR_DPI_LIST;
+		msgs[i].msg.parameters[0] = sensors[i / 2].index;
+	}
+
+	rc = hidpp20_request_commands(device, msgs, 2 * num_sensors);
 	if (rc)
-		return rc;
+		goto out;
 
-	sensor->dpi = hidpp20_get_unaligned_u16(&msg.msg.parameters[1]);
-	sensor->default_dpi = hidpp20_get_unaligned_u16(&msg.msg.parameters[3]);
+	for (i = 0; i < num_sensors; i++) {
+		hidpp20_adjustable_dpi_parse_dpi_list(&msgs[2 * i], &sensors[i]);
+		hidpp20_adjustable_dpi_parse_dpi(&msgs[2 * i + 1], &sensors[i]);
+	}
 
-	return 0;
+out:
+	free(msgs);
+	return rc;
 }
 
-int hidpp20_adjustable_dpi_get_sensors(struct ratbag_device *device,
+int hidpp20_adjustable_dpi_get_sensors(struct hidpp20_device *device,
 				       struct hidpp20_sensor **sensors_list)
 {
-	uint8_t feature_index, feature_type, feature_version;
+	uint8_t feature_index;
 	struct hidpp20_sensor *s_list, *sensor;
 	uint8_t num_sensors;
 	unsigned i;
 	int rc;
 
 
-	rc = hidpp_root_get_feature(device,
-				    HIDPP_PAGE_ADJUSTABLE_DPI,
-				    &feature_index,
-				    &feature_type,
-				    &feature_version);
+	rc = hidpp_root_get_feature_idx(device,
+					HIDPP_PAGE_ADJUSTABLE_DPI,
+					&feature_index);
 	if (rc)
 		return rc;
 
@@ -973,20 +1301,19 @@ int hidpp20_adjustable_dpi_get_sensors(struct ratbag_device *device,
 	if (!s_list)
 		return -ENOMEM;
 
+	for (i = 0; i < num_sensors; i++)
+		s_list[i].index = i;
+
+	rc = hidpp20_adjustable_dpi_get_sensor_info(device,
+						    feature_index,
+						    s_list,
+						    num_sensors);
+	if (rc)
+		goto err;
+
 	for (i = 0; i < num_sensors; i++) {
 		sensor = &s_list[i];
-		sensor->index = i;
-		rc = hidpp20_adjustable_dpi_get_dpi_list(device,
-							 feature_index,
-							 sensor);
-		if (rc)
-			goto err;
-
-		rc = hidpp20_adjustable_dpi_get_dpi(device, feature_index, sensor);
-		if (rc)
-			goto err;
-
-		log_raw(device->ratbag,
+		log_raw(device->ratbag_device->ratbag,
 			"sensor %d: current dpi: %d (default: %d) min: %d max: %d steps: %d\n",
 			sensor->index,
 			sensor->dpi,
@@ -1003,10 +1330,52 @@ err:
 	return rc;
 }
 
-int hidpp20_adjustable_dpi_set_sensor_dpi(struct ratbag_device *device,
+int hidpp20_adjustable_dpi_update_sensors(struct hidpp20_device *device,
+					  struct hidpp20_sensor *sensors,
+					  unsigned num_sensors)
+{
+	uint8_t feature_index;
+	union hidpp20_message *msgs;
+	unsigned i;
+	int rc;
+
+	if (num_sensors == 0)
+		return 0;
+
+	rc = hidpp_root_get_feature_idx(device,
+					HIDPP_PAGE_ADJUSTABLE_DPI,
+					&feature_index);
+	if (rc)
+		return rc;
+
+	msgs = zalloc(num_sensors * sizeof(*msgs));
+	if (!msgs)
+		return -ENOMEM;
+
+	for (i = 0; i < num_sensors; i++) {
+		msgs[i].msg.report_id = REPORT_ID_LONG;
+		msgs[i].msg.device_idx = 0xff;
+		msgs[i].msg.sub_id = feature_index;
+		msgs[i].msg.address = CMD_ADJUSTABLE_DPI_GET_SENSOR_DPI;
+		msgs[i].msg.parameters[0] = sensors[i].index;
+	}
+
+	rc = hidpp20_request_commands(device, msgs, num_sensors);
+	if (rc)
+		goto out;
+
+	for (i = 0; i < num_sensors; i++)
+		hidpp20_adjustable_dpi_parse_dpi(&msgs[i], &sensors[i]);
+
+out:
+	free(msgs);
+	return rc;
+}
+
+int hidpp20_adjustable_dpi_set_sensor_dpi(struct hidpp20_device *device,
 					  struct hidpp20_sensor *sensor, uint16_t dpi)
 {
-	uint8_t feature_index, feature_type, feature_version;
+	uint8_t feature_index;
 	int rc;
 	union hidpp20_message msg = {
 		.msg.report_id = REPORT_ID_LONG,
@@ -1017,11 +1386,9 @@ int hidpp20_adjustable_dpi_set_sensor_dpi(struct ratbag_device *device,
 		.msg.parameters[2] = dpi & 0xff,
 	};
 
-	rc = hidpp_root_get_feature(device,
-				    HIDPP_PAGE_ADJUSTABLE_DPI,
-				    &feature_index,
-				    &feature_type,
-				    &feature_version);
+	rc = hidpp_root_get_feature_idx(device,
+					HIDPP_PAGE_ADJUSTABLE_DPI,
+					&feature_index);
 	if (rc)
 		return rc;
 
@@ -1036,3 +1403,33 @@ int hidpp20_adjustable_dpi_set_sensor_dpi(struct ratbag_device *device,
 
 	return 0;
 }
+
+/* -------------------------------------------------------------------------- */
+/* general device handling                                                    */
+/* -------------------------------------------------------------------------- */
+
+struct hidpp20_device *
+hidpp20_device_new(struct ratbag_device *device)
+{
+	struct hidpp20_device *dev;
+
+	dev = zalloc(sizeof(*dev));
+	if (!dev)
+		return NULL;
+
+	dev->ratbag_device = device;
+	dev->proto_major = 1;
+	dev->proto_minor = 0;
+
+	return dev;
+}
+
+void
+hidpp20_device_destroy(struct hidpp20_device *device)
+{
+	if (!device)
+		return;
+
+	free(device->feature_list);
+	free(device);
+}
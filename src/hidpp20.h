@@ -48,7 +48,39 @@ union hidpp20_message {
 	uint8_t data[LONG_MESSAGE_LENGTH];
 };
 
-int hidpp20_request_command(struct ratbag_device *device, union hidpp20_message *msg);
+struct hidpp20_feature;
+
+struct hidpp20_device {
+	struct ratbag_device *ratbag_device;
+	unsigned proto_major;
+	unsigned proto_minor;
+	/* the feature table, indexed by the device's feature index */
+	unsigned feature_count;
+	struct hidpp20_feature *feature_list;
+	/* the next software ID to use for a request */
+	uint8_t sw_id;
+};
+
+/* the maximum number of requests in flight at the same time */
+#define HIDPP20_MAX_INFLIGHT			4
+
+struct hidpp20_device *hidpp20_device_new(struct ratbag_device *device);
+void hidpp20_device_destroy(struct hidpp20_device *device);
+
+int hidpp20_request_command(struct hidpp20_device *device, union hidpp20_message *msg);
+
+/**
+ * Send the given requests to the device, keeping up to
+ * HIDPP20_MAX_INFLIGHT requests in flight. Each request gets its own
+ * software ID so the replies can be matched in any order. On success,
+ * each message is replaced with the device's answer.
+ *
+ * @return 0 on success, the HID++ error code of the first failing request
+ * or a negative errno
+ */
+int hidpp20_request_commands(struct hidpp20_device *device,
+			     union hidpp20_message *msgs,
+			     unsigned count);
 
 const char *hidpp20_feature_get_name(uint16_t feature);
 
@@ -58,12 +90,26 @@ const char *hidpp20_feature_get_name(uint16_t feature);
 
 #define HIDPP_PAGE_ROOT					0x0000
 
-int hidpp_root_get_feature(struct ratbag_device *device,
+int hidpp_root_get_feature(struct hidpp20_device *device,
 			   uint16_t feature,
 			   uint8_t *feature_index,
 			   uint8_t *feature_type,
 			   uint8_t *feature_version);
-int hidpp20_root_get_protocol_version(struct ratbag_device *device,
+
+/**
+ * Look up the feature index of the given feature page.
+ *
+ * If the feature table has been filled in with
+ * hidpp20_device_set_feature_list(), the index is retrieved from that table
+ * without talking to the device. Otherwise, this falls back to
+ * hidpp_root_get_feature().
+ *
+ * @return 0 on success, a positive HID++ error code or a negative errno
+ */
+int hidpp_root_get_feature_idx(struct hidpp20_device *device,
+			       uint16_t feature,
+			       uint8_t *feature_index);
+int hidpp20_root_get_protocol_version(struct hidpp20_device *device,
 				      unsigned *major,
 				      unsigned *minor);
 /* -------------------------------------------------------------------------- */
@@ -82,9 +128,43 @@ struct hidpp20_feature {
  *
  * returns the elements in the list or a negative error
  */
-int hidpp20_feature_set_get(struct ratbag_device *device,
+int hidpp20_feature_set_get(struct hidpp20_device *device,
 			    struct hidpp20_feature **feature_list);
 
+/**
+ * Store the feature list retrieved by hidpp20_feature_set_get() in the
+ * device, so that subsequent commands can look up the feature index
+ * locally. The device takes ownership of the list.
+ */
+void hidpp20_device_set_feature_list(struct hidpp20_device *device,
+				     struct hidpp20_feature *feature_list,
+				     unsigned feature_count);
+
+/* -------------------------------------------------------------------------- */
+/* 0x0003: Device Information                                                 */
+/* -------------------------------------------------------------------------- */
+
+#define HIDPP_PAGE_DEVICE_INFO				0x0003
+
+struct hidpp20_fw_info {
+	uint8_t type;
+	char name[4];
+	uint8_t major;
+	uint8_t minor;
+	uint16_t build;
+};
+
+/**
+ * Retrieves the firmware name and version of the given entity, entity 0
+ * is the main firmware. An error reply is not logged, the caller decides
+ * whether it matters.
+ *
+ * returns 0 or a negative error
+ */
+int hidpp20_device_info_get_fw_info(struct hidpp20_device *device,
+				    uint8_t entity,
+				    struct hidpp20_fw_info *info);
+
 /* -------------------------------------------------------------------------- */
 /* 0x1000: Battery level status                                               */
 /* -------------------------------------------------------------------------- */
@@ -107,7 +187,7 @@ enum hidpp20_battery_status {
  *
  * @return the battery status or a negative errno on error
  */
-int hidpp20_batterylevel_get_battery_level(struct ratbag_device *device,
+int hidpp20_batterylevel_get_battery_level(struct hidpp20_device *device,
 					   uint16_t *level,
 					   uint16_t *next_level);
 
@@ -145,7 +225,7 @@ struct hidpp20_control_id {
 	} reporting;
 };
 
-int hidpp20_kbd_reprogrammable_keys_get_controls(struct ratbag_device *device,
+int hidpp20_kbd_reprogrammable_keys_get_controls(struct hidpp20_device *device,
 						 struct hidpp20_control_id **controls_list);
 
 /* -------------------------------------------------------------------------- */
@@ -159,7 +239,7 @@ int hidpp20_kbd_reprogrammable_keys_get_controls(struct ratbag_device *device,
  *
  * returns the elements in the list or a negative error
  */
-int hidpp20_special_key_mouse_get_controls(struct ratbag_device *device,
+int hidpp20_special_key_mouse_get_controls(struct hidpp20_device *device,
 					   struct hidpp20_control_id **controls_list);
 
 /**
@@ -168,9 +248,31 @@ int hidpp20_special_key_mouse_get_controls(struct ratbag_device *device,
  *
  * returns 0 or a negative error
  */
-int hidpp20_special_key_mouse_set_control(struct ratbag_device *device,
+int hidpp20_special_key_mouse_set_control(struct hidpp20_device *device,
 					  struct hidpp20_control_id *control);
 
+/**
+ * commit all controls previously allocated by
+ * hidpp20_special_key_mouse_get_controls() that have reporting.updated
+ * set, in a single batch. reporting.updated is cleared on success.
+ *
+ * returns 0 or a negative error
+ */
+int hidpp20_special_key_mouse_set_controls(struct hidpp20_device *device,
+					   struct hidpp20_control_id *controls,
+					   unsigned num_controls);
+
+/**
+ * Refresh the reporting of controls previously allocated by
+ * hidpp20_special_key_mouse_get_controls(). The rest of a control is
+ * static and not queried again.
+ *
+ * returns 0 or a negative error
+ */
+int hidpp20_special_key_mouse_update_controls(struct hidpp20_device *device,
+					      struct hidpp20_control_id *controls,
+					      unsigned num_controls);
+
 const struct ratbag_button_action *hidpp20_1b04_get_logical_mapping(uint16_t value);
 uint16_t hidpp20_1b04_get_logical_control_id(const struct ratbag_button_action *action);
 const char *hidpp20_1b04_get_logical_mapping_name(uint16_t value);
@@ -192,7 +294,7 @@ const char *hidpp20_1b04_get_physical_mapping_name(uint16_t value);
 #define HIDDP20_MOUSE_POINTER_ACCELERATION_MEDIUM	0x02
 #define HIDDP20_MOUSE_POINTER_ACCELERATION_HIGH		0x03
 
-int hidpp20_mousepointer_get_mousepointer_info(struct ratbag_device *device,
+int hidpp20_mousepointer_get_mousepointer_info(struct hidpp20_device *device,
 					       uint16_t *resolution,
 					       uint8_t *flags);
 
@@ -221,14 +323,25 @@ struct hidpp20_sensor {
  *
  * returns the elements in the list or a negative error
  */
-int hidpp20_adjustable_dpi_get_sensors(struct ratbag_device *device,
+int hidpp20_adjustable_dpi_get_sensors(struct hidpp20_device *device,
 				       struct hidpp20_sensor **sensors_list);
 
+/**
+ * Refresh the current dpi of sensors previously allocated by
+ * hidpp20_adjustable_dpi_get_sensors(). The dpi list is static and not
+ * queried again.
+ *
+ * returns 0 or a negative error
+ */
+int hidpp20_adjustable_dpi_update_sensors(struct hidpp20_device *device,
+					  struct hidpp20_sensor *sensors,
+					  unsigned num_sensors);
+
 /**
  * set the current dpi of the provided sensor. sensor must have been
  * allocated by  hidpp20_adjustable_dpi_get_sensors()
  */
-int hidpp20_adjustable_dpi_set_sensor_dpi(struct ratbag_device *device,
+int hidpp20_adjustable_dpi_set_sensor_dpi(struct hidpp20_device *device,
 					  struct hidpp20_sensor *sensor, uint16_t dpi);
 
 #endif /* HIDPP_20_H */
@@ -0,0 +1,171 @@
+/*
+ * Copyright © 2015 Red Hat, Inc.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the next
+ * paragraph) shall be included in all copies or substantial portions of the
+ * Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+
+#include "config.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "libratbag-private.h"
+
+/*
+ * One file per device model in the cache directory, named after the bus,
+ * vendor, product and version. The file starts with a fixed header,
+ * followed by the data of the driver.
+ */
+
+#define CACHE_MAGIC		"ratbagc"
+/* bump whenever the header or the data of a driver changes layout */
+#define CACHE_FORMAT_VERSION	1
+
+struct cache_header {
+	char magic[8];
+	uint32_t format_version;
+	char driver[32];
+	char firmware[RATBAG_CACHE_FIRMWARE_LEN];
+	uint32_t size;
+};
+
+static int
+cache_get_path(struct ratbag_device *device, char *path, size_t len)
+{
+	const char *dir = device->ratbag->cache_dir;
+	int n;
+
+	if (!dir)
+		return -ENOENT;
+
+	n = snprintf(path, len, "%s/%04x-%04x-%04x-%04x",
+		     dir,
+		     device->ids.bustype,
+		     device->ids.vendor,
+		     device->ids.product,
+		     device->ids.version);
+	if (n < 0 || (size_t)n >= len)
+		return -ENAMETOOLONG;
+
+	return 0;
+}
+
+static void
+cache_init_header(struct ratbag_device *device,
+		  struct cache_header *header,
+		  const char *firmware,
+		  size_t size)
+{
+	memset(header, 0, sizeof(*header));
+	memcpy(header->magic, CACHE_MAGIC, sizeof(CACHE_MAGIC));
+	header->format_version = CACHE_FORMAT_VERSION;
+	snprintf(header->driver, sizeof(header->driver), "%s",
+		 device->driver->name);
+	snprintf(header->firmware, sizeof(header->firmware), "%s", firmware);
+	header->size = size;
+}
+
+int
+ratbag_device_cache_load(struct ratbag_device *device,
+			 char firmware[RATBAG_CACHE_FIRMWARE_LEN],
+			 void *data, size_t size)
+{
+	struct cache_header header, expected;
+	char path[PATH_MAX];
+	int fd, rc;
+
+	rc = cache_get_path(device, path, sizeof(path));
+	if (rc)
+		return rc;
+
+	fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+		return -errno;
+
+	rc = read_all(fd, &header, sizeof(header));
+	if (rc)
+		goto out;
+
+	/* the firmware is up to the driver to check */
+	header.firmware[sizeof(header.firmware) - 1] = '\0';
+	cache_init_header(device, &expected, header.firmware, header.size);
+	if (memcmp(&header, &expected, sizeof(header)) != 0) {
+		log_debug(device->ratbag,
+			  "%s: ignoring cache entry from another driver or version\n",
+			  device->name);
+		rc = -ENOENT;
+		goto out;
+	}
+
+	if (header.size > size) {
+		rc = -EFBIG;
+		goto out;
+	}
+
+	rc = read_all(fd, data, header.size);
+	if (rc)
+		goto out;
+
+	memcpy(firmware, header.firmware, sizeof(header.firmware));
+	rc = header.size;
+out:
+	close(fd);
+	return rc;
+}
+
+int
+ratbag_device_cache_store(struct ratbag_device *device,
+			  const char *firmware,
+			  const void *data, size_t size)
+{
+	struct cache_header header;
+	char path[PATH_MAX], tmp_path[PATH_MAX + 4];
+	int fd, rc;
+
+	rc = cache_get_path(device, path, sizeof(path));
+	if (rc)
+		return rc;
+
+	cache_init_header(device, &header, firmware, size);
+
+	/* write to a temporary file first, so a concurrent reader never
+	 * sees a partial entry */
+	snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", path);
+	fd = open(tmp_path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+	if (fd < 0)
+		return -errno;
+
+	rc = write_all(fd, &header, sizeof(header));
+	if (rc == 0)
+		rc = write_all(fd, data, size);
+	close(fd);
+
+	if (rc == 0 && rename(tmp_path, path) < 0)
+		rc = -errno;
+
+	if (rc)
+		unlink(tmp_path);
+
+	return rc;
+}
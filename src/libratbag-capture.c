@@ -0,0 +1,312 @@
+/*
+ * Copyright © 2015 Red Hat, Inc.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the next
+ * paragraph) shall be included in all copies or substantial portions of the
+ * Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+
+#include "config.h"
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "libratbag-private.h"
+#include "libratbag-util.h"
+
+/*
+ * The capture is a ring of fixed-size records, the oldest are overwritten
+ * once it is full. A context is only used from one thread, so recording
+ * is a copy into the next slot without any locking.
+ *
+ * The export is a pcapng file with one interface per device, named after
+ * the device. The reports use the first user link type, they are not
+ * wrapped in USB or Bluetooth headers.
+ */
+
+/* the bytes kept of every report, HID++ reports are 20 bytes at most */
+#define CAPTURE_SNAPLEN				64
+
+#define PCAPNG_SHB				0x0A0D0D0A
+#define PCAPNG_IDB				0x00000001
+#define PCAPNG_EPB				0x00000006
+#define PCAPNG_BYTE_ORDER_MAGIC			0x1A2B3C4D
+#define PCAPNG_LINKTYPE_USER0			147
+#define PCAPNG_OPT_ENDOFOPT			0
+#define PCAPNG_OPT_IF_NAME			2
+#define PCAPNG_OPT_EPB_FLAGS			2
+#define PCAPNG_EPB_FLAGS_INBOUND		0x1
+#define PCAPNG_EPB_FLAGS_OUTBOUND		0x2
+
+struct capture_record {
+	uint64_t time_us;	/* CLOCK_MONOTONIC */
+	uint16_t interface;
+	uint8_t direction;
+	uint8_t len;
+	uint16_t orig_len;
+	uint8_t data[CAPTURE_SNAPLEN];
+};
+
+struct ratbag_capture {
+	unsigned int size;
+	/* the records written since the capture was enabled, the next one
+	 * goes to count % size */
+	uint64_t count;
+
+	/* the device names, indexed by the interface of the records */
+	char **names;
+	unsigned int num_names;
+
+	struct capture_record records[];
+};
+
+static int
+capture_get_interface(struct ratbag_device *device)
+{
+	struct ratbag *ratbag = device->ratbag;
+	struct ratbag_capture *capture = ratbag->capture;
+	char **names;
+
+	if (device->capture_generation == ratbag->capture_generation)
+		return device->capture_interface;
+
+	names = realloc(capture->names,
+			(capture->num_names + 1) * sizeof(*names));
+	if (!names)
+		return -ENOMEM;
+	capture->names = names;
+
+	names[capture->num_names] = strdup(device->name);
+	if (!names[capture->num_names])
+		return -ENOMEM;
+
+	device->capture_interface = capture->num_names++;
+	device->capture_generation = ratbag->capture_generation;
+
+	return device->capture_interface;
+}
+
+void
+ratbag_capture_record(struct ratbag_device *device,
+		      enum ratbag_capture_direction direction,
+		      const uint8_t *buf, size_t len)
+{
+	struct ratbag_capture *capture = device->ratbag->capture;
+	struct capture_record *r;
+	int interface;
+
+	interface = capture_get_interface(device);
+	if (interface < 0)
+		return;
+
+	r = &capture->records[capture->count % capture->size];
+	capture->count++;
+
+	r->time_us = now_in_us();
+	r->interface = interface;
+	r->direction = direction;
+	r->orig_len = len;
+	r->len = min(len, sizeof(r->data));
+	memcpy(r->data, buf, r->len);
+}
+
+static void
+capture_free(struct ratbag_capture *capture)
+{
+	unsigned int i;
+
+	if (!capture)
+		return;
+
+	for (i = 0; i < capture->num_names; i++)
+		free(capture->names[i]);
+	free(capture->names);
+	free(capture);
+}
+
+void
+ratbag_capture_destroy(struct ratbag *ratbag)
+{
+	capture_free(ratbag->capture);
+	ratbag->capture = NULL;
+}
+
+LIBRATBAG_EXPORT int
+ratbag_capture_enable(struct ratbag *ratbag, unsigned int num_records)
+{
+	struct ratbag_capture *capture = NULL;
+
+	if (num_records > 0) {
+		capture = zalloc(sizeof(*capture) +
+				 num_records * sizeof(capture->records[0]));
+		if (!capture)
+			return -ENOMEM;
+		capture->size = num_records;
+	}
+
+	ratbag_capture_destroy(ratbag);
+	ratbag->capture = capture;
+	/* the devices get new interfaces in the new capture */
+	ratbag->capture_generation++;
+
+	return 0;
+}
+
+static inline size_t
+pcapng_pad(size_t len)
+{
+	return (len + 3) & ~3;
+}
+
+static int
+pcapng_write_shb(int fd)
+{
+	struct {
+		uint32_t type;
+		uint32_t len;
+		uint32_t magic;
+		uint16_t major;
+		uint16_t minor;
+		int64_t section_len;
+		uint32_t len2;
+	} __attribute__((packed)) shb = {
+		.type = PCAPNG_SHB,
+		.len = sizeof(shb),
+		.magic = PCAPNG_BYTE_ORDER_MAGIC,
+		.major = 1,
+		.minor = 0,
+		.section_len = -1,
+		.len2 = sizeof(shb),
+	};
+
+	return write_all(fd, &shb, sizeof(shb));
+}
+
+static int
+pcapng_write_idb(int fd, const char *name)
+{
+	uint32_t words[64] = {0};
+	uint8_t *block = (uint8_t *)words;
+	uint32_t *u32;
+	uint16_t *u16;
+	size_t name_len = min(strlen(name), 200U);
+	size_t len;
+
+	len = 16 + 4 + pcapng_pad(name_len) + 4 + 4;
+
+	u32 = (uint32_t *)block;
+	u32[0] = PCAPNG_IDB;
+	u32[1] = len;
+	u16 = (uint16_t *)&block[8];
+	u16[0] = PCAPNG_LINKTYPE_USER0;
+	u16[1] = 0;
+	u32[3] = CAPTURE_SNAPLEN;
+
+	u16 = (uint16_t *)&block[16];
+	u16[0] = PCAPNG_OPT_IF_NAME;
+	u16[1] = name_len;
+	memcpy(&block[20], name, name_len);
+	/* opt_endofopt is all zeroes */
+
+	u32 = (uint32_t *)&block[len - 4];
+	*u32 = len;
+
+	return write_all(fd, block, len);
+}
+
+static int
+pcapng_write_epb(int fd, const struct capture_record *r, uint64_t offset_us)
+{
+	uint32_t words[(28 + CAPTURE_SNAPLEN + 12 + 4) / 4] = {0};
+	uint8_t *block = (uint8_t *)words;
+	uint64_t ts = r->time_us + offset_us;
+	uint32_t *u32;
+	uint16_t *u16;
+	size_t len, n;
+
+	len = 28 + pcapng_pad(r->len) + 8 + 4 + 4;
+
+	u32 = (uint32_t *)block;
+	u32[0] = PCAPNG_EPB;
+	u32[1] = len;
+	u32[2] = r->interface;
+	u32[3] = ts >> 32;
+	u32[4] = ts & 0xffffffff;
+	u32[5] = r->len;
+	u32[6] = r->orig_len;
+	memcpy(&block[28], r->data, r->len);
+
+	n = 28 + pcapng_pad(r->len);
+	u16 = (uint16_t *)&block[n];
+	u16[0] = PCAPNG_OPT_EPB_FLAGS;
+	u16[1] = 4;
+	u32 = (uint32_t *)&block[n + 4];
+	*u32 = r->direction == RATBAG_CAPTURE_IN ?
+		PCAPNG_EPB_FLAGS_INBOUND : PCAPNG_EPB_FLAGS_OUTBOUND;
+	/* opt_endofopt is all zeroes */
+
+	u32 = (uint32_t *)&block[len - 4];
+	*u32 = len;
+
+	return write_all(fd, block, len);
+}
+
+LIBRATBAG_EXPORT int
+ratbag_capture_write(struct ratbag *ratbag, int fd)
+{
+	struct ratbag_capture *capture = ratbag->capture;
+	struct timespec mono, real;
+	uint64_t offset_us, first, i;
+	unsigned int n;
+	int rc;
+
+	if (!capture)
+		return -ENODATA;
+
+	/* the records have monotonic timestamps, the file wants the time
+	 * of day */
+	clock_gettime(CLOCK_MONOTONIC, &mono);
+	clock_gettime(CLOCK_REALTIME, &real);
+	offset_us = (real.tv_sec - mono.tv_sec) * 1000000LL +
+		    (real.tv_nsec - mono.tv_nsec) / 1000;
+
+	rc = pcapng_write_shb(fd);
+	if (rc)
+		return rc;
+
+	for (n = 0; n < capture->num_names; n++) {
+		rc = pcapng_write_idb(fd, capture->names[n]);
+		if (rc)
+			return rc;
+	}
+
+	first = capture->count > capture->size ?
+		capture->count - capture->size : 0;
+	for (i = first; i < capture->count; i++) {
+		rc = pcapng_write_epb(fd,
+				      &capture->records[i % capture->size],
+				      offset_us);
+		if (rc)
+			return rc;
+	}
+
+	return 0;
+}
@@ -0,0 +1,414 @@
+/*
+ * Copyright © 2015 Red Hat, Inc.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the next
+ * paragraph) shall be included in all copies or substantial portions of the
+ * Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+
+#include "config.h"
+
+#include <endian.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "libratbag-private.h"
+#include "libratbag-util.h"
+
+/*
+ * The export is a snapshot of the device, little-endian and packed: a
+ * header with the ids of the device model, then for every profile its
+ * resolutions and buttons. The type of a button is not stored, it cannot
+ * be set.
+ */
+
+#define EXPORT_MAGIC		"ratbagx"
+/* bump whenever the layout changes, older files are refused */
+#define EXPORT_FORMAT_VERSION	1
+
+#define EXPORT_PROFILE_ACTIVE		0x1
+#define EXPORT_RESOLUTION_ACTIVE	0x1
+#define EXPORT_RESOLUTION_DEFAULT	0x2
+
+struct export_header {
+	char magic[8];
+	uint32_t format_version;
+	uint16_t bustype;
+	uint16_t vendor;
+	uint16_t product;
+	uint16_t version;
+	uint16_t num_profiles;
+	uint16_t num_buttons;
+} __attribute__((packed));
+_Static_assert(sizeof(struct export_header) == 24, "Invalid size");
+
+struct export_profile {
+	uint8_t flags;
+	uint8_t num_resolutions;
+} __attribute__((packed));
+_Static_assert(sizeof(struct export_profile) == 2, "Invalid size");
+
+struct export_resolution {
+	uint16_t dpi;
+	uint16_t hz;
+	uint8_t flags;
+} __attribute__((packed));
+_Static_assert(sizeof(struct export_resolution) == 5, "Invalid size");
+
+struct export_button {
+	int8_t action_type;
+	uint32_t action;
+} __attribute__((packed));
+_Static_assert(sizeof(struct export_button) == 5, "Invalid size");
+
+static void
+export_snapshot_free(struct ratbag_snapshot *snapshot)
+{
+	free(snapshot->profiles);
+	free(snapshot->buttons);
+}
+
+static int
+export_get_snapshot(struct ratbag_device *device,
+		    struct ratbag_snapshot *snapshot)
+{
+	unsigned int num_profiles = ratbag_device_get_num_profiles(device);
+	unsigned int num_buttons = ratbag_device_get_num_buttons(device);
+	int rc;
+
+	memset(snapshot, 0, sizeof(*snapshot));
+	snapshot->version = RATBAG_SNAPSHOT_VERSION;
+	snapshot->num_profiles = num_profiles;
+	snapshot->num_buttons = num_buttons;
+	snapshot->profiles = zalloc(max(num_profiles, 1U) *
+				    sizeof(*snapshot->profiles));
+	snapshot->buttons = zalloc(max(num_profiles * num_buttons, 1U) *
+				   sizeof(*snapshot->buttons));
+	if (!snapshot->profiles || !snapshot->buttons) {
+		export_snapshot_free(snapshot);
+		return -ENOMEM;
+	}
+
+	rc = ratbag_device_get_snapshot(device, snapshot);
+	if (rc)
+		export_snapshot_free(snapshot);
+
+	return rc;
+}
+
+static void
+export_init_header(struct ratbag_device *device,
+		   struct export_header *header,
+		   const struct ratbag_snapshot *snapshot)
+{
+	memset(header, 0, sizeof(*header));
+	memcpy(header->magic, EXPORT_MAGIC, sizeof(EXPORT_MAGIC));
+	header->format_version = htole32(EXPORT_FORMAT_VERSION);
+	header->bustype = htole16(device->ids.bustype);
+	header->vendor = htole16(device->ids.vendor);
+	header->product = htole16(device->ids.product);
+	header->version = htole16(device->ids.version);
+	header->num_profiles = htole16(snapshot->num_profiles);
+	header->num_buttons = htole16(snapshot->num_buttons);
+}
+
+static int
+export_write_binary(struct ratbag_device *device, int fd,
+		    const struct ratbag_snapshot *snapshot)
+{
+	struct export_header *header;
+	uint8_t *buf, *p;
+	size_t size;
+	unsigned int i, j;
+	int rc;
+
+	size = sizeof(*header);
+	for (i = 0; i < snapshot->num_profiles; i++)
+		size += sizeof(struct export_profile) +
+			snapshot->profiles[i].num_resolutions *
+				sizeof(struct export_resolution) +
+			snapshot->num_buttons * sizeof(struct export_button);
+
+	/* written at once, a reader never sees half a profile */
+	buf = zalloc(size);
+	if (!buf)
+		return -ENOMEM;
+
+	header = (struct export_header *)buf;
+	export_init_header(device, header, snapshot);
+	p = buf + sizeof(*header);
+
+	for (i = 0; i < snapshot->num_profiles; i++) {
+		const struct ratbag_snapshot_profile *sp = &snapshot->profiles[i];
+		const struct ratbag_snapshot_button *sb;
+		struct export_profile *profile = (struct export_profile *)p;
+
+		profile->flags = sp->is_active ? EXPORT_PROFILE_ACTIVE : 0;
+		profile->num_resolutions = sp->num_resolutions;
+		p += sizeof(*profile);
+
+		for (j = 0; j < sp->num_resolutions; j++) {
+			const struct ratbag_snapshot_resolution *sr = &sp->resolutions[j];
+			struct export_resolution *res = (struct export_resolution *)p;
+
+			res->dpi = htole16(sr->dpi);
+			res->hz = htole16(sr->hz);
+			res->flags = (sr->is_active ? EXPORT_RESOLUTION_ACTIVE : 0) |
+				     (sr->is_default ? EXPORT_RESOLUTION_DEFAULT : 0);
+			p += sizeof(*res);
+		}
+
+		sb = &snapshot->buttons[i * snapshot->num_buttons];
+		for (j = 0; j < snapshot->num_buttons; j++) {
+			struct export_button *button = (struct export_button *)p;
+
+			button->action_type = sb[j].action_type;
+			button->action = htole32(sb[j].action);
+			p += sizeof(*button);
+		}
+	}
+
+	rc = write_all(fd, buf, size);
+	free(buf);
+
+	return rc;
+}
+
+static const char *
+export_action_type_name(enum ratbag_button_action_type type)
+{
+	switch (type) {
+	case RATBAG_BUTTON_ACTION_TYPE_NONE:
+		return "none";
+	case RATBAG_BUTTON_ACTION_TYPE_BUTTON:
+		return "button";
+	case RATBAG_BUTTON_ACTION_TYPE_SPECIAL:
+		return "special";
+	case RATBAG_BUTTON_ACTION_TYPE_KEY:
+		return "key";
+	case RATBAG_BUTTON_ACTION_TYPE_MACRO:
+		return "macro";
+	case RATBAG_BUTTON_ACTION_TYPE_UNKNOWN:
+		break;
+	}
+
+	return "unknown";
+}
+
+static int
+export_write_json(struct ratbag_device *device, int fd,
+		  const struct ratbag_snapshot *snapshot)
+{
+	const struct ratbag_snapshot_button *sb;
+	char *buf = NULL;
+	size_t size = 0;
+	unsigned int i, j;
+	FILE *f;
+	int rc;
+
+	f = open_memstream(&buf, &size);
+	if (!f)
+		return -errno;
+
+	fprintf(f,
+		"{\n"
+		"  \"format_version\": %d,\n"
+		"  \"bustype\": \"0x%04x\",\n"
+		"  \"vendor\": \"0x%04x\",\n"
+		"  \"product\": \"0x%04x\",\n"
+		"  \"version\": \"0x%04x\",\n"
+		"  \"profiles\": [",
+		EXPORT_FORMAT_VERSION,
+		device->ids.bustype,
+		device->ids.vendor,
+		device->ids.product,
+		device->ids.version);
+
+	for (i = 0; i < snapshot->num_profiles; i++) {
+		const struct ratbag_snapshot_profile *sp = &snapshot->profiles[i];
+
+		fprintf(f, "%s\n    {\n      \"active\": %s,\n      \"resolutions\": [",
+			i ? "," : "",
+			sp->is_active ? "true" : "false");
+		for (j = 0; j < sp->num_resolutions; j++) {
+			const struct ratbag_snapshot_resolution *sr = &sp->resolutions[j];
+
+			fprintf(f, "%s\n        {\"dpi\": %u, \"hz\": %u, "
+				"\"active\": %s, \"default\": %s}",
+				j ? "," : "",
+				sr->dpi, sr->hz,
+				sr->is_active ? "true" : "false",
+				sr->is_default ? "true" : "false");
+		}
+
+		fprintf(f, "\n      ],\n      \"buttons\": [");
+		sb = &snapshot->buttons[i * snapshot->num_buttons];
+		for (j = 0; j < snapshot->num_buttons; j++) {
+			fprintf(f, "%s\n        {\"action\": \"%s\", \"value\": %u}",
+				j ? "," : "",
+				export_action_type_name(sb[j].action_type),
+				sb[j].action);
+		}
+		fprintf(f, "\n      ]\n    }");
+	}
+
+	fprintf(f, "\n  ]\n}\n");
+
+	if (fclose(f) != 0) {
+		free(buf);
+		return -ENOMEM;
+	}
+
+	rc = write_all(fd, buf, size);
+	free(buf);
+
+	return rc;
+}
+
+LIBRATBAG_EXPORT int
+ratbag_device_export(struct ratbag_device *device, int fd,
+		     enum ratbag_export_format format)
+{
+	struct ratbag_snapshot snapshot;
+	int rc;
+
+	if (format != RATBAG_EXPORT_FORMAT_BINARY &&
+	    format != RATBAG_EXPORT_FORMAT_JSON)
+		return -EINVAL;
+
+	rc = export_get_snapshot(device, &snapshot);
+	if (rc)
+		return rc;
+
+	if (format == RATBAG_EXPORT_FORMAT_JSON)
+		rc = export_write_json(device, fd, &snapshot);
+	else
+		rc = export_write_binary(device, fd, &snapshot);
+
+	export_snapshot_free(&snapshot);
+
+	return rc;
+}
+
+static int
+import_check_header(struct ratbag_device *device,
+		    const struct export_header *header,
+		    const struct ratbag_snapshot *snapshot)
+{
+	if (memcmp(header->magic, EXPORT_MAGIC, sizeof(EXPORT_MAGIC)) != 0)
+		return -EINVAL;
+
+	if (le32toh(header->format_version) != EXPORT_FORMAT_VERSION)
+		return -EPROTO;
+
+	/* the version of the device may change with its firmware, the
+	 * configuration still applies */
+	if (le16toh(header->bustype) != device->ids.bustype ||
+	    le16toh(header->vendor) != device->ids.vendor ||
+	    le16toh(header->product) != device->ids.product)
+		return -ENODEV;
+
+	if (le16toh(header->num_profiles) != snapshot->num_profiles ||
+	    le16toh(header->num_buttons) != snapshot->num_buttons)
+		return -EINVAL;
+
+	return 0;
+}
+
+static int
+import_read_profile(int fd,
+		    struct ratbag_snapshot_profile *sp,
+		    struct ratbag_snapshot_button *sb,
+		    unsigned int num_buttons)
+{
+	struct export_profile profile;
+	struct export_resolution res[RATBAG_SNAPSHOT_MAX_RESOLUTIONS];
+	struct export_button button;
+	unsigned int i;
+	int rc;
+
+	rc = read_all(fd, &profile, sizeof(profile));
+	if (rc)
+		return rc == -EIO ? -EINVAL : rc;
+
+	if (profile.num_resolutions != sp->num_resolutions)
+		return -EINVAL;
+
+	rc = read_all(fd, res, profile.num_resolutions * sizeof(res[0]));
+	if (rc)
+		return rc == -EIO ? -EINVAL : rc;
+
+	/* only the dpi and the button actions are restored. The report
+	 * rate, the active and default resolution and the active profile
+	 * keep the values of the device: not every driver can write them,
+	 * and the user switches them with the buttons of the mouse. */
+	for (i = 0; i < profile.num_resolutions; i++)
+		sp->resolutions[i].dpi = le16toh(res[i].dpi);
+
+	for (i = 0; i < num_buttons; i++) {
+		rc = read_all(fd, &button, sizeof(button));
+		if (rc)
+			return rc == -EIO ? -EINVAL : rc;
+
+		sb[i].action_type = button.action_type;
+		sb[i].action = le32toh(button.action);
+	}
+
+	return 0;
+}
+
+LIBRATBAG_EXPORT int
+ratbag_device_import(struct ratbag_device *device, int fd)
+{
+	struct ratbag_snapshot snapshot;
+	struct export_header header;
+	unsigned int i;
+	int rc;
+
+	/* the current state fills in what the file leaves out, and lets
+	 * the unchanged values be skipped */
+	rc = export_get_snapshot(device, &snapshot);
+	if (rc)
+		return rc;
+
+	rc = read_all(fd, &header, sizeof(header));
+	if (rc) {
+		if (rc == -EIO)
+			rc = -EINVAL;
+		goto out;
+	}
+
+	rc = import_check_header(device, &header, &snapshot);
+	if (rc)
+		goto out;
+
+	for (i = 0; i < snapshot.num_profiles; i++) {
+		rc = import_read_profile(fd, &snapshot.profiles[i],
+					 &snapshot.buttons[i * snapshot.num_buttons],
+					 snapshot.num_buttons);
+		if (rc)
+			goto out;
+	}
+
+	rc = ratbag_device_apply_snapshot(device, &snapshot);
+out:
+	export_snapshot_free(&snapshot);
+	return rc;
+}
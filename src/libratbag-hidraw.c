@@ -27,6 +27,7 @@
 #include <libudev.h>
 #include <linux/hidraw.h>
 #include <string.h>
+#include <sys/epoll.h>
 
 #include "libratbag-hidraw.h"
 #include "libratbag-private.h"
@@ -36,10 +37,33 @@
 #define HID_MAX_BUFFER_SIZE	4096		/* 4kb */
 #endif
 
-int
-ratbag_open_hidraw(struct ratbag_device *device)
+/* the maximum number of reports read per ratbag_hidraw_dispatch() call */
+#define RATBAG_HIDRAW_DISPATCH_MAX	64
+
+/**
+ * What the devices talking through the same hidraw node share: the fd,
+ * the epoll registration and the driver's knowledge of the node. A
+ * receiver has one node for all paired devices.
+ */
+struct ratbag_hidraw_node {
+	struct list link;	/* in ratbag->hidraw_nodes */
+	int refcount;
+	const struct ratbag_transport *transport;
+	uintptr_t key;
+	/* the devices on this node, linked by device->hidraw_link */
+	struct list devices;
+	int fd;
+
+	const struct ratbag_driver *shared_data_driver;
+	void *shared_data;
+	void (*destroy_shared_data)(void *data);
+};
+
+static int
+hidraw_open(struct ratbag_device *device)
 {
 	struct hidraw_devinfo info;
+	struct epoll_event ep;
 	int fd, res;
 	const char *devnode;
 
@@ -47,7 +71,7 @@ ratbag_open_hidraw(struct ratbag_device *device)
 		return -EINVAL;
 
 	devnode = udev_device_get_devnode(device->udev_hidraw);
-	fd = ratbag_open_path(device, devnode, O_RDWR);
+	fd = ratbag_open_path(device, devnode, O_RDWR | O_NONBLOCK);
 	if (fd < 0)
 		goto err;
 
@@ -59,6 +83,15 @@ ratbag_open_hidraw(struct ratbag_device *device)
 		goto err;
 	}
 
+	ep.events = EPOLLIN;
+	ep.data.ptr = device->hidraw_node;
+	res = epoll_ctl(device->ratbag->epoll_fd, EPOLL_CTL_ADD, fd, &ep);
+	if (res < 0) {
+		log_error(device->ratbag,
+			  "error while adding device to the epoll fd");
+		goto err;
+	}
+
 	device->hidraw_fd = fd;
 
 	return 0;
@@ -69,19 +102,27 @@ err:
 	return -errno;
 }
 
-int
-ratbag_hidraw_raw_request(struct ratbag_device *device, unsigned char reportnum,
-			  uint8_t *buf, size_t len, unsigned char rtype, int reqtype)
+static void
+hidraw_close(struct ratbag_device *device)
+{
+	if (device->hidraw_fd < 0)
+		return;
+
+	epoll_ctl(device->ratbag->epoll_fd, EPOLL_CTL_DEL, device->hidraw_fd, NULL);
+	ratbag_close_fd(device, device->hidraw_fd);
+	device->hidraw_fd = -1;
+}
+
+static int
+hidraw_raw_request(struct ratbag_device *device, unsigned char reportnum,
+		   uint8_t *buf, size_t len, unsigned char rtype, int reqtype)
 {
 	char tmp_buf[HID_MAX_BUFFER_SIZE];
 	int rc;
 
-	if (len < 1 || len > HID_MAX_BUFFER_SIZE || !buf || device->hidraw_fd < 0)
+	if (device->hidraw_fd < 0)
 		return -EINVAL;
 
-	if (rtype != HID_FEATURE_REPORT)
-		return -ENOTSUP;
-
 	switch (reqtype) {
 	case HID_REQ_GET_REPORT:
 		memset(tmp_buf, 0, len);
@@ -105,12 +146,12 @@ ratbag_hidraw_raw_request(struct ratbag_device *device, unsigned char reportnum,
 	return -EINVAL;
 }
 
-int
-ratbag_hidraw_output_report(struct ratbag_device *device, uint8_t *buf, size_t len)
+static int
+hidraw_output_report(struct ratbag_device *device, uint8_t *buf, size_t len)
 {
 	int rc;
 
-	if (len < 1 || len > HID_MAX_BUFFER_SIZE || !buf || device->hidraw_fd < 0)
+	if (device->hidraw_fd < 0)
 		return -EINVAL;
 
 	rc = write(device->hidraw_fd, buf, len);
@@ -124,21 +165,333 @@ ratbag_hidraw_output_report(struct ratbag_device *device, uint8_t *buf, size_t l
 	return 0;
 }
 
-int
-ratbag_hidraw_read_input_report(struct ratbag_device *device, uint8_t *buf, size_t len)
+static int
+hidraw_read_input_report(struct ratbag_device *device,
+			 uint8_t *buf, size_t len,
+			 uint64_t deadline)
 {
 	int rc;
 	struct pollfd fds;
+	uint64_t now;
 
-	if (len < 1 || !buf || device->hidraw_fd < 0)
+	if (device->hidraw_fd < 0)
 		return -EINVAL;
 
 	fds.fd = device->hidraw_fd;
 	fds.events = POLLIN;
 
-	if (poll(&fds, 1, 1000) == -1)
-		return -errno;
+	while (1) {
+		rc = read(device->hidraw_fd, buf, len);
+		if (rc >= 0)
+			return rc;
+
+		if (errno != EAGAIN && errno != EINTR)
+			return -errno;
+
+		now = now_in_ms();
+		if (now >= deadline)
+			return -ETIMEDOUT;
+
+		if (poll(&fds, 1, deadline - now) == -1 && errno != EINTR)
+			return -errno;
+	}
+}
+
+static uintptr_t
+hidraw_get_node_key(struct ratbag_device *device)
+{
+	if (!device->udev_hidraw)
+		return (uintptr_t)device;
+
+	return udev_device_get_devnum(device->udev_hidraw);
+}
+
+const struct ratbag_transport ratbag_hidraw_transport = {
+	.name = "hidraw",
+	.open = hidraw_open,
+	.close = hidraw_close,
+	.get_node_key = hidraw_get_node_key,
+	.raw_request = hidraw_raw_request,
+	.output_report = hidraw_output_report,
+	.read_input_report = hidraw_read_input_report,
+};
+
+static struct ratbag_hidraw_node *
+ratbag_hidraw_node_find(struct ratbag_device *device, uintptr_t key)
+{
+	struct ratbag_hidraw_node *node;
+
+	list_for_each(node, &device->ratbag->hidraw_nodes, link) {
+		if (node->transport == device->transport && node->key == key)
+			return node;
+	}
+
+	return NULL;
+}
+
+static void
+ratbag_hidraw_node_detach(struct ratbag_device *device)
+{
+	struct ratbag_hidraw_node *node = device->hidraw_node;
+
+	list_remove(&device->hidraw_link);
+	device->hidraw_node = NULL;
+
+	if (--node->refcount > 0) {
+		device->hidraw_fd = -1;
+		return;
+	}
+
+	/* the last device closes the node for all of them */
+	device->transport->close(device);
+
+	if (node->destroy_shared_data)
+		node->destroy_shared_data(node->shared_data);
+	list_remove(&node->link);
+	free(node);
+}
+
+int
+ratbag_open_hidraw(struct ratbag_device *device)
+{
+	struct ratbag_hidraw_node *node;
+	uintptr_t key;
+	int rc;
+
+	/* a previous driver may have opened it during its probe */
+	ratbag_close_hidraw(device);
+
+	if (device->transport->get_node_key)
+		key = device->transport->get_node_key(device);
+	else
+		key = (uintptr_t)device;
+
+	node = ratbag_hidraw_node_find(device, key);
+	if (node) {
+		log_debug(device->ratbag, "%s: sharing the open node\n",
+			  device->name);
+		node->refcount++;
+		list_insert(&node->devices, &device->hidraw_link);
+		device->hidraw_node = node;
+		device->hidraw_fd = node->fd;
+		return 0;
+	}
+
+	node = zalloc(sizeof(*node));
+	if (!node)
+		return -ENOMEM;
+
+	node->refcount = 1;
+	node->transport = device->transport;
+	node->key = key;
+	list_init(&node->devices);
+	list_insert(&node->devices, &device->hidraw_link);
+	device->hidraw_node = node;
+
+	rc = device->transport->open(device);
+	if (rc) {
+		list_remove(&device->hidraw_link);
+		device->hidraw_node = NULL;
+		free(node);
+		return rc;
+	}
+
+	node->fd = device->hidraw_fd;
+	list_insert(&device->ratbag->hidraw_nodes, &node->link);
+
+	return 0;
+}
+
+void
+ratbag_close_hidraw(struct ratbag_device *device)
+{
+	if (!device->hidraw_node)
+		return;
+
+	ratbag_hidraw_node_detach(device);
+}
+
+void *
+ratbag_hidraw_get_shared_data(struct ratbag_device *device)
+{
+	struct ratbag_hidraw_node *node = device->hidraw_node;
 
-	rc = read(device->hidraw_fd, buf, len);
-	return rc >= 0 ? rc : -errno;
+	/* another driver may have been probed on the node before */
+	if (!node || node->shared_data_driver != device->driver)
+		return NULL;
+
+	return node->shared_data;
+}
+
+void
+ratbag_hidraw_set_shared_data(struct ratbag_device *device, void *data,
+			      void (*destroy)(void *data))
+{
+	struct ratbag_hidraw_node *node = device->hidraw_node;
+
+	if (node->destroy_shared_data)
+		node->destroy_shared_data(node->shared_data);
+
+	node->shared_data_driver = device->driver;
+	node->shared_data = data;
+	node->destroy_shared_data = destroy;
+}
+
+int
+ratbag_hidraw_raw_request(struct ratbag_device *device, unsigned char reportnum,
+			  uint8_t *buf, size_t len, unsigned char rtype, int reqtype)
+{
+	uint64_t sent_us;
+	int rc;
+
+	if (len < 1 || len > HID_MAX_BUFFER_SIZE || !buf)
+		return -EINVAL;
+
+	if (rtype != HID_FEATURE_REPORT)
+		return -ENOTSUP;
+
+	if (reqtype == HID_REQ_SET_REPORT)
+		ratbag_capture(device, RATBAG_CAPTURE_OUT, buf, len);
+
+	sent_us = now_in_us();
+	rc = device->transport->raw_request(device, reportnum, buf, len,
+					    rtype, reqtype);
+	if (rc == -ETIMEDOUT)
+		ratbag_stats_request_timeout(device,
+					     RATBAG_STATS_CLASS_FEATURE_REPORT);
+	else
+		ratbag_stats_request_done(device,
+					  RATBAG_STATS_CLASS_FEATURE_REPORT,
+					  now_in_us() - sent_us,
+					  rc < 0 ? rc : 0);
+
+	if (reqtype == HID_REQ_GET_REPORT && rc > 0)
+		ratbag_capture(device, RATBAG_CAPTURE_IN, buf, rc);
+
+	return rc;
+}
+
+int
+ratbag_hidraw_output_report(struct ratbag_device *device, uint8_t *buf, size_t len)
+{
+	if (len < 1 || len > HID_MAX_BUFFER_SIZE || !buf)
+		return -EINVAL;
+
+	ratbag_capture(device, RATBAG_CAPTURE_OUT, buf, len);
+
+	return device->transport->output_report(device, buf, len);
+}
+
+int
+ratbag_hidraw_read_input_report_deadline(struct ratbag_device *device,
+					 uint8_t *buf, size_t len,
+					 uint64_t deadline)
+{
+	int rc;
+
+	if (len < 1 || !buf)
+		return -EINVAL;
+
+	rc = device->transport->read_input_report(device, buf, len, deadline);
+	if (rc > 0)
+		ratbag_capture(device, RATBAG_CAPTURE_IN, buf, rc);
+
+	return rc;
+}
+
+int
+ratbag_hidraw_read_input_report(struct ratbag_device *device, uint8_t *buf, size_t len)
+{
+	uint64_t deadline;
+
+	deadline = now_in_ms() + ratbag_device_get_request_timeout(device);
+
+	return ratbag_hidraw_read_input_report_deadline(device, buf, len, deadline);
+}
+
+int
+ratbag_hidraw_read_input_report_filtered(struct ratbag_device *device,
+					 uint8_t *buf, size_t len,
+					 uint64_t deadline,
+					 const unsigned long *report_ids)
+{
+	int rc;
+
+	if (len < 1 || !buf)
+		return -EINVAL;
+
+	do {
+		rc = device->transport->read_input_report(device, buf, len,
+							  deadline);
+		if (rc <= 0)
+			break;
+
+		ratbag_capture(device, RATBAG_CAPTURE_IN, buf, rc);
+		if (long_bit_is_set(report_ids, buf[0]))
+			break;
+
+		device->stats.discarded_reports++;
+	} while (true);
+
+	return rc;
+}
+
+int
+ratbag_hidraw_dispatch(struct ratbag_hidraw_node *node)
+{
+	struct ratbag_device *device;
+	uint8_t buf[HID_MAX_BUFFER_SIZE];
+	unsigned int count;
+	int rc;
+
+	/* any device on the node can read for all of them */
+	device = container_of(node->devices.next, device, hidraw_link);
+
+	/* drain what is queued in one go, a mouse being moved sends a
+	 * report every ms. The limit keeps a busy device from starving
+	 * the others. */
+	for (count = 0; count < RATBAG_HIDRAW_DISPATCH_MAX; count++) {
+		/* a deadline in the past makes this a non-blocking read */
+		rc = device->transport->read_input_report(device, buf,
+							  sizeof(buf), 0);
+		if (rc == -ETIMEDOUT || rc == -EINTR)
+			return 0;
+
+		if (rc < 0) {
+			/* the device is gone, stop watching it or we would
+			 * be woken up for it forever */
+			log_error(device->ratbag,
+				  "%s: error reading from device: %s (%d)\n",
+				  device->name, strerror(-rc), -rc);
+			if (node->fd >= 0)
+				epoll_ctl(device->ratbag->epoll_fd, EPOLL_CTL_DEL,
+					  node->fd, NULL);
+			return rc;
+		}
+
+		log_buf_raw(device->ratbag, "event: ", buf, rc);
+		ratbag_capture(device, RATBAG_CAPTURE_IN, buf, rc);
+
+		ratbag_hidraw_raw_event(device, buf, rc);
+	}
+
+	return 0;
+}
+
+void
+ratbag_hidraw_raw_event(struct ratbag_device *device, uint8_t *buf, size_t len)
+{
+	struct ratbag_hidraw_node *node = device->hidraw_node;
+	struct ratbag_device *d;
+
+	if (!node) {
+		if (device->driver && device->driver->raw_event)
+			device->driver->raw_event(device, buf, len);
+		return;
+	}
+
+	list_for_each(d, &node->devices, hidraw_link) {
+		if (d->driver && d->driver->raw_event)
+			d->driver->raw_event(d, buf, len);
+	}
 }
@@ -34,8 +34,59 @@
 #define HID_OUTPUT_REPORT	1
 #define HID_FEATURE_REPORT	2
 
+struct ratbag_device;
+struct ratbag_hidraw_node;
+
+/**
+ * struct ratbag_transport - the way reports get to and from a device
+ *
+ * Drivers never use the transport directly, they go through the
+ * ratbag_hidraw_* functions below. By default, devices use
+ * ratbag_hidraw_transport. All callbacks are mandatory.
+ */
+struct ratbag_transport {
+	/** the name of the transport, for debugging */
+	const char *name;
+
+	/** open the device, see ratbag_open_hidraw(). Only called for the
+	 * first device on a node, the others share the open node. */
+	int (*open)(struct ratbag_device *device);
+
+	/** close the device, must be a noop if the device is not open.
+	 * Only called for the last device on a node. */
+	void (*close)(struct ratbag_device *device);
+
+	/** return a key for the node the device talks through. Devices
+	 * with the same key share the node, e.g. the devices paired with
+	 * a receiver. Optional, if not set every device has its own node. */
+	uintptr_t (*get_node_key)(struct ratbag_device *device);
+
+	/** get or set a feature report, see ratbag_hidraw_raw_request().
+	 * The arguments are already checked for sanity. */
+	int (*raw_request)(struct ratbag_device *device, unsigned char reportnum,
+			   uint8_t *buf, size_t len, unsigned char rtype,
+			   int reqtype);
+
+	/** send an output report, see ratbag_hidraw_output_report() */
+	int (*output_report)(struct ratbag_device *device, uint8_t *buf, size_t len);
+
+	/** read one input report, waiting until the deadline at most.
+	 * A deadline in the past must not block. */
+	int (*read_input_report)(struct ratbag_device *device,
+				 uint8_t *buf, size_t len,
+				 uint64_t deadline);
+
+	/** called when the device is destroyed, to free the transport's
+	 * data. Optional. */
+	void (*destroy)(struct ratbag_device *device);
+};
+
+extern const struct ratbag_transport ratbag_hidraw_transport;
+
 /**
- * Open the hidraw device associated with the device.
+ * Open the hidraw device associated with the device. If other devices
+ * talk through the same node, e.g. because they are paired with the same
+ * receiver, the device shares their node and fd.
  *
  * @param device the ratbag device
  *
@@ -43,6 +94,30 @@
  */
 int ratbag_open_hidraw(struct ratbag_device *device);
 
+/**
+ * Close the hidraw device associated with the device, if any.
+ *
+ * @param device the ratbag device
+ */
+void ratbag_close_hidraw(struct ratbag_device *device);
+
+/**
+ * Get the data a driver shares between all devices on the node of the
+ * device, e.g. what it knows about a receiver. The device must be open.
+ *
+ * @return the data set with ratbag_hidraw_set_shared_data() by the driver
+ * of this device, or NULL
+ */
+void *ratbag_hidraw_get_shared_data(struct ratbag_device *device);
+
+/**
+ * Set the data the driver of the device shares between all devices on
+ * its node. The data is destroyed with the given function once the last
+ * device on the node is closed. The device must be open.
+ */
+void ratbag_hidraw_set_shared_data(struct ratbag_device *device, void *data,
+				   void (*destroy)(void *data));
+
 /**
  * Send report request to device
  *
@@ -73,7 +148,8 @@ int ratbag_hidraw_raw_request(struct ratbag_device *device, unsigned char report
 int ratbag_hidraw_output_report(struct ratbag_device *device, uint8_t *buf, size_t len);
 
 /**
- * Read an input report from the device
+ * Read an input report from the device, waiting at most for the request
+ * timeout of the device.
  *
  * @param device the ratbag device
  * @param[out] buf resulting raw data
@@ -83,4 +159,64 @@ int ratbag_hidraw_output_report(struct ratbag_device *device, uint8_t *buf, size
  */
 int ratbag_hidraw_read_input_report(struct ratbag_device *device, uint8_t *buf, size_t len);
 
+/**
+ * Read an input report from the device, waiting until the given deadline
+ * at most.
+ *
+ * @param device the ratbag device
+ * @param[out] buf resulting raw data
+ * @param len length of buf
+ * @param deadline absolute time in ms, see now_in_ms()
+ *
+ * @return count of data transfered, -ETIMEDOUT if no report arrived before
+ * the deadline, or a negative errno on error
+ */
+int ratbag_hidraw_read_input_report_deadline(struct ratbag_device *device,
+					     uint8_t *buf, size_t len,
+					     uint64_t deadline);
+
+/**
+ * Read an input report with one of the given report IDs, waiting until
+ * the given deadline at most. Any other report that arrives meanwhile,
+ * e.g. the pointer motion of a mouse, is dropped as soon as it is read.
+ *
+ * @param device the ratbag device
+ * @param[out] buf resulting raw data
+ * @param len length of buf
+ * @param deadline absolute time in ms, see now_in_ms()
+ * @param report_ids a bitmask of the accepted report IDs, see
+ * long_bit_is_set()
+ *
+ * @return count of data transfered, -ETIMEDOUT if no matching report
+ * arrived before the deadline, or a negative errno on error
+ */
+int ratbag_hidraw_read_input_report_filtered(struct ratbag_device *device,
+					     uint8_t *buf, size_t len,
+					     uint64_t deadline,
+					     const unsigned long *report_ids);
+
+/**
+ * Read the pending input reports from the node and pass them on to the
+ * raw_event hook of every device on it, each driver picks what is meant
+ * for its device. The hidraw fd must be readable, this is called from
+ * ratbag_dispatch() only.
+ *
+ * @param node the node, as registered with the epoll fd
+ *
+ * @return 0 on success, or a negative errno on error
+ */
+int ratbag_hidraw_dispatch(struct ratbag_hidraw_node *node);
+
+/**
+ * Pass a report read from the node to the raw_event hook of every device
+ * on it. Used for the notifications read while waiting for the answer to
+ * a request, they would not reach ratbag_dispatch() otherwise.
+ *
+ * @param device any device on the node
+ * @param buf the report
+ * @param len length of buf
+ */
+void ratbag_hidraw_raw_event(struct ratbag_device *device, uint8_t *buf,
+			     size_t len);
+
 #endif /* LIBRATBAG_HIDRAW_H */
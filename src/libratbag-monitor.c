@@ -0,0 +1,486 @@
+/*
+ * Copyright © 2015 Red Hat, Inc.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the next
+ * paragraph) shall be included in all copies or substantial portions of the
+ * Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+
+#include "config.h"
+
+#include <assert.h>
+#include <errno.h>
+#include <libudev.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "libratbag-private.h"
+#include "libratbag-util.h"
+
+/*
+ * The monitor keeps two registries. One maps the hid devices to their
+ * hidraw node, as the hidraw nodes arrive. The other has an entry per hid
+ * device that has an event node handled by one of the drivers. The
+ * ratbag device is created once both are known, in whatever order udev
+ * announces them. Further event nodes of the same hid device are ignored.
+ */
+
+struct monitor_hidraw {
+	struct list link;
+	char *hid_syspath;
+	struct udev_device *hidraw;
+};
+
+struct monitor_device {
+	struct list link;
+	char *hid_syspath;
+	/* the event node the device was found through */
+	char *event_syspath;
+	struct udev_device *input;
+	/* NULL until the hidraw node is there, or if no driver took it */
+	struct ratbag_device *device;
+	bool probed;
+};
+
+struct monitor_event {
+	struct list link;
+	enum ratbag_monitor_event type;
+	struct ratbag_device *device;
+};
+
+struct ratbag_monitor {
+	struct ratbag *ratbag;
+	int refcount;
+	struct udev_monitor *udev_monitor;
+
+	struct list hidraws;	/* struct monitor_hidraw */
+	struct list devices;	/* struct monitor_device */
+	struct list events;	/* struct monitor_event, oldest first */
+};
+
+static inline const char *
+udev_hid_syspath(struct udev_device *udev_device)
+{
+	struct udev_device *hid;
+
+	hid = udev_device_get_parent_with_subsystem_devtype(udev_device,
+							    "hid", NULL);
+	if (!hid)
+		return NULL;
+
+	return udev_device_get_syspath(hid);
+}
+
+static void
+monitor_queue_event(struct ratbag_monitor *monitor,
+		    enum ratbag_monitor_event type,
+		    struct ratbag_device *device)
+{
+	struct monitor_event *event;
+
+	event = zalloc(sizeof(*event));
+	if (!event) {
+		ratbag_device_unref(device);
+		return;
+	}
+
+	event->type = type;
+	event->device = device;
+	list_insert(monitor->events.prev, &event->link);
+}
+
+static struct monitor_hidraw *
+monitor_find_hidraw(struct ratbag_monitor *monitor, const char *hid_syspath)
+{
+	struct monitor_hidraw *h;
+
+	list_for_each(h, &monitor->hidraws, link) {
+		if (streq(h->hid_syspath, hid_syspath))
+			return h;
+	}
+
+	return NULL;
+}
+
+static struct monitor_device *
+monitor_find_device(struct ratbag_monitor *monitor, const char *hid_syspath)
+{
+	struct monitor_device *d;
+
+	list_for_each(d, &monitor->devices, link) {
+		if (streq(d->hid_syspath, hid_syspath))
+			return d;
+	}
+
+	return NULL;
+}
+
+static void
+monitor_probe_device(struct ratbag_monitor *monitor,
+		     struct monitor_device *d,
+		     struct monitor_hidraw *h)
+{
+	if (d->probed)
+		return;
+
+	d->probed = true;
+	d->device = ratbag_device_new_from_udev_devices(monitor->ratbag,
+							d->input,
+							h->hidraw);
+	if (!d->device) {
+		log_debug(monitor->ratbag, "%s: no driver for the device\n",
+			  d->event_syspath);
+		return;
+	}
+
+	monitor_queue_event(monitor, RATBAG_MONITOR_EVENT_DEVICE_ADDED,
+			    ratbag_device_ref(d->device));
+}
+
+/* the device is gone, or at least its hidraw node is */
+static void
+monitor_unprobe_device(struct ratbag_monitor *monitor,
+		       struct monitor_device *d)
+{
+	if (d->device)
+		monitor_queue_event(monitor,
+				    RATBAG_MONITOR_EVENT_DEVICE_REMOVED,
+				    d->device);
+	d->device = NULL;
+	d->probed = false;
+}
+
+static void
+monitor_device_destroy(struct monitor_device *d)
+{
+	list_remove(&d->link);
+	ratbag_device_unref(d->device);
+	udev_device_unref(d->input);
+	free(d->hid_syspath);
+	free(d->event_syspath);
+	free(d);
+}
+
+static void
+monitor_hidraw_destroy(struct monitor_hidraw *h)
+{
+	list_remove(&h->link);
+	udev_device_unref(h->hidraw);
+	free(h->hid_syspath);
+	free(h);
+}
+
+static void
+monitor_add_hidraw(struct ratbag_monitor *monitor,
+		   struct udev_device *hidraw)
+{
+	struct monitor_hidraw *h;
+	struct monitor_device *d;
+	const char *hid_syspath;
+
+	hid_syspath = udev_hid_syspath(hidraw);
+	if (!hid_syspath || monitor_find_hidraw(monitor, hid_syspath))
+		return;
+
+	h = zalloc(sizeof(*h));
+	if (!h)
+		return;
+
+	h->hid_syspath = strdup(hid_syspath);
+	if (!h->hid_syspath) {
+		free(h);
+		return;
+	}
+	h->hidraw = udev_device_ref(hidraw);
+	list_insert(&monitor->hidraws, &h->link);
+
+	/* the event node may have come first */
+	d = monitor_find_device(monitor, hid_syspath);
+	if (d)
+		monitor_probe_device(monitor, d, h);
+}
+
+static void
+monitor_remove_hidraw(struct ratbag_monitor *monitor,
+		      struct udev_device *hidraw)
+{
+	struct monitor_hidraw *h, *tmp;
+	struct monitor_device *d;
+	const char *syspath = udev_device_get_syspath(hidraw);
+
+	/* the parents of a removed device are gone from sysfs, so it is
+	 * only known by its own syspath */
+	list_for_each_safe(h, tmp, &monitor->hidraws, link) {
+		if (!streq(udev_device_get_syspath(h->hidraw), syspath))
+			continue;
+
+		d = monitor_find_device(monitor, h->hid_syspath);
+		if (d)
+			monitor_unprobe_device(monitor, d);
+		monitor_hidraw_destroy(h);
+	}
+}
+
+static void
+monitor_add_input(struct ratbag_monitor *monitor,
+		  struct udev_device *input)
+{
+	struct monitor_hidraw *h;
+	struct monitor_device *d;
+	const char *hid_syspath;
+	const char *sysname;
+
+	sysname = udev_device_get_sysname(input);
+	if (!sysname || !strneq(sysname, "event", 5))
+		return;
+
+	hid_syspath = udev_hid_syspath(input);
+	if (!hid_syspath || monitor_find_device(monitor, hid_syspath))
+		return;
+
+	/* most input devices are not for us, don't keep them around */
+	if (!ratbag_udev_device_is_supported(monitor->ratbag, input))
+		return;
+
+	d = zalloc(sizeof(*d));
+	if (!d)
+		return;
+
+	d->hid_syspath = strdup(hid_syspath);
+	d->event_syspath = strdup(udev_device_get_syspath(input));
+	if (!d->hid_syspath || !d->event_syspath) {
+		free(d->hid_syspath);
+		free(d->event_syspath);
+		free(d);
+		return;
+	}
+	d->input = udev_device_ref(input);
+	list_insert(&monitor->devices, &d->link);
+
+	h = monitor_find_hidraw(monitor, hid_syspath);
+	if (h)
+		monitor_probe_device(monitor, d, h);
+}
+
+static void
+monitor_remove_input(struct ratbag_monitor *monitor,
+		     struct udev_device *input)
+{
+	struct monitor_device *d, *tmp;
+	const char *syspath = udev_device_get_syspath(input);
+
+	list_for_each_safe(d, tmp, &monitor->devices, link) {
+		if (!streq(d->event_syspath, syspath))
+			continue;
+
+		monitor_unprobe_device(monitor, d);
+		monitor_device_destroy(d);
+	}
+}
+
+static void
+monitor_handle_udev_device(struct ratbag_monitor *monitor,
+			   struct udev_device *udev_device,
+			   const char *action)
+{
+	const char *subsystem = udev_device_get_subsystem(udev_device);
+	bool add;
+
+	if (!subsystem)
+		return;
+
+	if (streq(action, "add"))
+		add = true;
+	else if (streq(action, "remove"))
+		add = false;
+	else
+		return;
+
+	if (streq(subsystem, "hidraw")) {
+		if (add)
+			monitor_add_hidraw(monitor, udev_device);
+		else
+			monitor_remove_hidraw(monitor, udev_device);
+	} else if (streq(subsystem, "input")) {
+		if (add)
+			monitor_add_input(monitor, udev_device);
+		else
+			monitor_remove_input(monitor, udev_device);
+	}
+}
+
+static void
+monitor_enumerate(struct ratbag_monitor *monitor, const char *subsystem)
+{
+	struct udev *udev = monitor->ratbag->udev;
+	struct udev_enumerate *e;
+	struct udev_list_entry *entry;
+	struct udev_device *udev_device;
+
+	e = udev_enumerate_new(udev);
+	if (!e)
+		return;
+
+	udev_enumerate_add_match_subsystem(e, subsystem);
+	udev_enumerate_scan_devices(e);
+	udev_list_entry_foreach(entry, udev_enumerate_get_list_entry(e)) {
+		udev_device = udev_device_new_from_syspath(udev,
+				udev_list_entry_get_name(entry));
+		if (!udev_device)
+			continue;
+
+		/* udev is still busy with a device plugged in just now. Its
+		 * add event comes when udev is done, don't wait for it. */
+		if (!udev_device_get_is_initialized(udev_device)) {
+			log_debug(monitor->ratbag,
+				  "%s: not initialized yet, waiting for udev\n",
+				  udev_device_get_syspath(udev_device));
+			udev_device_unref(udev_device);
+			continue;
+		}
+
+		monitor_handle_udev_device(monitor, udev_device, "add");
+		udev_device_unref(udev_device);
+	}
+
+	udev_enumerate_unref(e);
+}
+
+LIBRATBAG_EXPORT struct ratbag_monitor *
+ratbag_monitor_new(struct ratbag *ratbag)
+{
+	struct ratbag_monitor *monitor;
+
+	monitor = zalloc(sizeof(*monitor));
+	if (!monitor)
+		return NULL;
+
+	monitor->refcount = 1;
+	list_init(&monitor->hidraws);
+	list_init(&monitor->devices);
+	list_init(&monitor->events);
+
+	monitor->udev_monitor = udev_monitor_new_from_netlink(ratbag->udev,
+							      "udev");
+	if (!monitor->udev_monitor)
+		goto err;
+
+	if (udev_monitor_filter_add_match_subsystem_devtype(monitor->udev_monitor,
+							    "hidraw", NULL) < 0 ||
+	    udev_monitor_filter_add_match_subsystem_devtype(monitor->udev_monitor,
+							    "input", NULL) < 0 ||
+	    udev_monitor_enable_receiving(monitor->udev_monitor) < 0)
+		goto err;
+
+	monitor->ratbag = ratbag_ref(ratbag);
+
+	/* the monitor is listening already, so nothing plugged in now is
+	 * missed. What shows up twice is ignored the second time. */
+	monitor_enumerate(monitor, "hidraw");
+	monitor_enumerate(monitor, "input");
+
+	return monitor;
+
+err:
+	udev_monitor_unref(monitor->udev_monitor);
+	free(monitor);
+	return NULL;
+}
+
+LIBRATBAG_EXPORT struct ratbag_monitor *
+ratbag_monitor_ref(struct ratbag_monitor *monitor)
+{
+	monitor->refcount++;
+	return monitor;
+}
+
+LIBRATBAG_EXPORT struct ratbag_monitor *
+ratbag_monitor_unref(struct ratbag_monitor *monitor)
+{
+	struct monitor_hidraw *h, *htmp;
+	struct monitor_device *d, *dtmp;
+	struct monitor_event *e, *etmp;
+
+	if (monitor == NULL)
+		return NULL;
+
+	assert(monitor->refcount > 0);
+	monitor->refcount--;
+	if (monitor->refcount > 0)
+		return monitor;
+
+	list_for_each_safe(e, etmp, &monitor->events, link) {
+		list_remove(&e->link);
+		ratbag_device_unref(e->device);
+		free(e);
+	}
+	list_for_each_safe(d, dtmp, &monitor->devices, link)
+		monitor_device_destroy(d);
+	list_for_each_safe(h, htmp, &monitor->hidraws, link)
+		monitor_hidraw_destroy(h);
+
+	udev_monitor_unref(monitor->udev_monitor);
+	ratbag_unref(monitor->ratbag);
+	free(monitor);
+
+	return NULL;
+}
+
+LIBRATBAG_EXPORT int
+ratbag_monitor_get_fd(const struct ratbag_monitor *monitor)
+{
+	return udev_monitor_get_fd(monitor->udev_monitor);
+}
+
+LIBRATBAG_EXPORT int
+ratbag_monitor_dispatch(struct ratbag_monitor *monitor)
+{
+	struct udev_device *udev_device;
+	const char *action;
+
+	while ((udev_device = udev_monitor_receive_device(monitor->udev_monitor))) {
+		action = udev_device_get_action(udev_device);
+		if (action)
+			monitor_handle_udev_device(monitor, udev_device, action);
+		udev_device_unref(udev_device);
+	}
+
+	return 0;
+}
+
+LIBRATBAG_EXPORT enum ratbag_monitor_event
+ratbag_monitor_get_event(struct ratbag_monitor *monitor,
+			 struct ratbag_device **device)
+{
+	struct monitor_event *event;
+	enum ratbag_monitor_event type;
+
+	*device = NULL;
+
+	if (list_empty(&monitor->events))
+		return RATBAG_MONITOR_EVENT_NONE;
+
+	event = container_of(monitor->events.next, event, link);
+	list_remove(&event->link);
+
+	type = event->type;
+	*device = event->device;
+	free(event);
+
+	return type;
+}
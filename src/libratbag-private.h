@@ -36,8 +36,16 @@
 #define PRODUCT_ANY				0xffff
 #define VERSION_ANY				0xffff
 
+/* time in ms a device has to answer a request, unless the driver or the
+ * caller say otherwise */
+#define RATBAG_DEFAULT_REQUEST_TIMEOUT		1000
+
 struct ratbag_driver;
 struct ratbag_button_action;
+struct ratbag_transport;
+struct ratbag_hidraw_node;
+struct ratbag_driver_match;
+struct ratbag_capture;
 
 struct ratbag {
 	const struct ratbag_interface *interface;
@@ -46,9 +54,31 @@ struct ratbag {
 	struct udev *udev;
 	struct list drivers;
 
+	/* the ids of all drivers, sorted by bus, vendor and product. The
+	 * ids with a wildcard in them come last, after num_exact_ids. */
+	struct ratbag_driver_match *driver_index;
+	size_t num_ids;
+	size_t num_exact_ids;
+
+	/* epoll fd covering the hidraw fds of all open devices */
+	int epoll_fd;
+	/* the open nodes, see struct ratbag_hidraw_node */
+	struct list hidraw_nodes;
+
 	int refcount;
 	ratbag_log_handler log_handler;
 	enum ratbag_log_priority log_priority;
+
+	/* 0 if not set by the caller */
+	unsigned int request_timeout;
+
+	/* NULL if the probe cache is disabled */
+	char *cache_dir;
+
+	/* NULL unless enabled by ratbag_capture_enable() */
+	struct ratbag_capture *capture;
+	/* bumped with every new capture, see ratbag_device.capture_interface */
+	unsigned int capture_generation;
 };
 
 struct ratbag_device {
@@ -58,16 +88,39 @@ struct ratbag_device {
 	struct udev_device *udev_device;
 	struct udev_device *udev_hidraw;
 	int hidraw_fd;
+	const struct ratbag_transport *transport;
+	void *transport_data;
+	/* the node while open, shared with the other devices behind it */
+	struct ratbag_hidraw_node *hidraw_node;
+	struct list hidraw_link;
 	int refcount;
 	struct input_id ids;
 	struct ratbag_driver *driver;
 	struct ratbag *ratbag;
 
+	/* the profiles and, after them, the buttons of all profiles, in
+	 * one allocation made by ratbag_device_init_profiles() */
 	unsigned num_profiles;
-	struct list profiles;
+	struct ratbag_profile *profiles;
 
 	unsigned num_buttons;
 
+	/* between ratbag_device_begin() and ratbag_device_commit() */
+	bool in_transaction;
+	/* set until a commit activated it, also past a failed commit */
+	struct ratbag_profile *pending_active;
+
+	/* the time in us the device takes to be ready again after a
+	 * request, as learned by ratbag_device_wait_ready(). 0 until known */
+	unsigned int settle_time;
+
+	/* the interface of the device in the capture, only valid if the
+	 * generation matches the one of the context */
+	unsigned int capture_interface;
+	unsigned int capture_generation;
+
+	struct ratbag_stats stats;
+
 	void *drv_data;
 };
 
@@ -76,6 +129,16 @@ struct ratbag_id {
 	unsigned long data;
 };
 
+/**
+ * An entry of the driver index, one per id in the table of a driver.
+ */
+struct ratbag_driver_match {
+	struct ratbag_id id;
+	struct ratbag_driver *driver;
+	/* drivers matching the same id are probed in this order */
+	unsigned int order;
+};
+
 /**
  * struct ratbag_driver - user space driver for a ratbag device
  */
@@ -87,6 +150,13 @@ struct ratbag_driver {
 	 * must be empty to mark the end. */
 	const struct ratbag_id *table_ids;
 
+	/** the time in ms a device handled by this driver may take to
+	 * answer a request. Optional, if 0 the default is used. A timeout
+	 * set by the caller through ratbag_set_request_timeout() takes
+	 * precedence.
+	 */
+	unsigned int request_timeout;
+
 	/** callback called while trying to open a device by libratbag.
 	 * This function should decide whether or not this driver will
 	 * handle the given device.
@@ -116,6 +186,9 @@ struct ratbag_driver {
 
 	/** here, the driver should actually write the profile to the
 	 * device.
+	 *
+	 * This includes any change the driver deferred while the device
+	 * was in a transaction, see ratbag_device_in_transaction().
 	 */
 	int (*write_profile)(struct ratbag_profile *profile);
 
@@ -157,6 +230,10 @@ struct ratbag_driver {
 	 * actually write the button to the device. The caller
 	 * should later on write the profile in one call to
 	 * .write_profile().
+	 *
+	 * A driver that writes the button right away must not do so while
+	 * the device is in a transaction, .write_profile() is called on
+	 * commit instead.
 	 */
 	int (*write_button)(struct ratbag_button *button,
 			    const struct ratbag_button_action *action);
@@ -165,9 +242,29 @@ struct ratbag_driver {
 	 * of the sensor expressed in DPI, and commit it to the hardware.
 	 *
 	 * Mandatory if the driver exports RATBAG_CAP_SWITCHABLE_RESOLUTION.
+	 *
+	 * While the device is in a transaction, the driver should only
+	 * update its copy of the profile and write it in .write_profile().
 	 */
 	int (*write_resolution_dpi)(struct ratbag_resolution *resolution, int dpi);
 
+	/** send a cheap request that only succeeds once the device is
+	 * done with the previous one, e.g. after it stored a write in its
+	 * flash memory.
+	 *
+	 * Return 0 if the device is ready, a negative errno otherwise.
+	 * Optional, see ratbag_device_wait_ready().
+	 */
+	int (*is_ready)(struct ratbag_device *device);
+
+	/** called from ratbag_dispatch() for every input report that
+	 * arrives outside of a request issued by the driver, e.g. a
+	 * notification that the device state was changed by someone else.
+	 *
+	 * Optional, reports are discarded if not set.
+	 */
+	void (*raw_event)(struct ratbag_device *device, uint8_t *buf, size_t len);
+
 	/* private */
 	struct list link;
 };
@@ -187,10 +284,10 @@ struct ratbag_profile {
 	int refcount;
 	void *userdata;
 
-	struct list link;
 	unsigned index;
 	struct ratbag_device *device;
-	struct list buttons;
+	/* num_buttons of the device, in the allocation of the profiles */
+	struct ratbag_button *buttons;
 	void *drv_data;
 	void *user_data;
 	struct {
@@ -199,6 +296,8 @@ struct ratbag_profile {
 	} resolution;
 
 	bool is_active;		/**< profile is the currently active one */
+	bool is_loaded;		/**< profile has been read from the device */
+	bool is_dirty;		/**< profile has changes to commit */
 };
 
 #define BUTTON_ACTION_NONE \
@@ -232,7 +331,6 @@ struct ratbag_button_action {
 struct ratbag_button {
 	int refcount;
 	void *userdata;
-	struct list link;
 	struct ratbag_profile *profile;
 	unsigned index;
 	enum ratbag_button_type type;
@@ -255,6 +353,28 @@ ratbag_close_fd(struct ratbag_device *device, int fd)
 	return ratbag->interface->close_restricted(fd, ratbag->userdata);
 }
 
+/**
+ * True between ratbag_device_begin() and ratbag_device_commit(). The
+ * drivers should then defer writing changes until .write_profile().
+ */
+static inline bool
+ratbag_device_in_transaction(const struct ratbag_device *device)
+{
+	return device->in_transaction;
+}
+
+static inline unsigned int
+ratbag_device_get_request_timeout(const struct ratbag_device *device)
+{
+	if (device->ratbag->request_timeout)
+		return device->ratbag->request_timeout;
+
+	if (device->driver && device->driver->request_timeout)
+		return device->driver->request_timeout;
+
+	return RATBAG_DEFAULT_REQUEST_TIMEOUT;
+}
+
 static inline void
 ratbag_set_drv_data(struct ratbag_device *device, void *drv_data)
 {
@@ -272,6 +392,11 @@ ratbag_device_init_profiles(struct ratbag_device *device,
 			    unsigned int num_profiles,
 			    unsigned int num_buttons);
 
+#define ratbag_device_for_each_profile(device_, profile_) \
+	for (profile_ = (device_)->profiles; \
+	     profile_ < (device_)->profiles + (device_)->num_profiles; \
+	     profile_++)
+
 static inline void
 ratbag_profile_set_drv_data(struct ratbag_profile *profile, void *drv_data)
 {
@@ -319,6 +444,49 @@ ratbag_resolution_init(struct ratbag_profile *profile, int index, int dpi, int h
 	res->is_default = false;
 }
 
+/**
+ * Create a device that talks to the hardware through the given transport
+ * instead of hidraw, and probe the drivers for it. On success, the device
+ * takes ownership of the transport data.
+ */
+struct ratbag_device *
+ratbag_device_new_from_transport(struct ratbag *ratbag,
+				 const char *name,
+				 const struct input_id *ids,
+				 const struct ratbag_transport *transport,
+				 void *transport_data);
+
+/**
+ * Like ratbag_device_new_from_udev_device(), for a caller that knows the
+ * hidraw node of the device already. If hidraw is NULL, it is looked up.
+ */
+struct ratbag_device*
+ratbag_device_new_from_udev_devices(struct ratbag *ratbag,
+				    struct udev_device *udev_device,
+				    struct udev_device *hidraw);
+
+/**
+ * @return true if a driver may handle the udev device, judging by its ids
+ * only
+ */
+bool
+ratbag_udev_device_is_supported(struct ratbag *ratbag,
+				struct udev_device *udev_device);
+
+/**
+ * Wait until the device is ready for the next request, by polling the
+ * driver's .is_ready() with an exponential backoff. The first poll is
+ * timed after the settle time the device showed so far, so a device that
+ * answers quickly is not kept waiting for a worst-case delay.
+ *
+ * Returns immediately if the driver has no .is_ready().
+ *
+ * @return 0 on success or -ETIMEDOUT if the device was not ready within
+ * the request timeout
+ */
+int
+ratbag_device_wait_ready(struct ratbag_device *device);
+
 /**
  * Override the auto-picked hidraw device.
  */
@@ -326,6 +494,105 @@ void
 ratbag_device_set_hidraw_device(struct ratbag_device *device,
 				struct udev_device *hidraw);
 
+/* the size of a firmware revision in the probe cache, including the
+ * terminating null byte */
+#define RATBAG_CACHE_FIRMWARE_LEN		32
+
+/**
+ * Load the probe results the driver previously stored for this device
+ * with ratbag_device_cache_store(). Entries are keyed by the bus, vendor,
+ * product and version of the device and the driver that stored them.
+ *
+ * The driver must check the firmware revision the entry was stored for
+ * against the device before using the data. The data may be needed to
+ * ask the device cheaply, so the library cannot do this.
+ *
+ * @param firmware Filled in with the firmware revision of the entry
+ * @param data Filled in with the cached data
+ * @param size The size of data
+ *
+ * @return the size of the cached data, or a negative errno. -ENOENT if
+ * the cache is disabled or has no entry for this device.
+ */
+int
+ratbag_device_cache_load(struct ratbag_device *device,
+			 char firmware[RATBAG_CACHE_FIRMWARE_LEN],
+			 void *data, size_t size);
+
+/**
+ * Store the probe results of the driver for this device and its firmware
+ * revision, replacing any previous entry. Only data that cannot change
+ * without a firmware update may be stored.
+ *
+ * @return 0 on success or a negative errno. -ENOENT if the cache is
+ * disabled.
+ */
+int
+ratbag_device_cache_store(struct ratbag_device *device,
+			  const char *firmware,
+			  const void *data, size_t size);
+
+/**
+ * Count a request the device answered after latency_us, with the given
+ * HID++ error code or 0. A negative errno counts as an error without a
+ * code.
+ */
+static inline void
+ratbag_stats_request_done(struct ratbag_device *device,
+			  enum ratbag_stats_class request_class,
+			  uint64_t latency_us, int error)
+{
+	struct ratbag_stats_requests *r = &device->stats.requests[request_class];
+	unsigned int bucket = 0;
+
+	r->count++;
+
+	if (latency_us > 0)
+		bucket = 63 - __builtin_clzll(latency_us);
+	r->latency[min(bucket, RATBAG_STATS_LATENCY_BUCKETS - 1)]++;
+
+	if (error == 0)
+		return;
+
+	r->errors++;
+	if (error > 0)
+		device->stats.hidpp_errors[min(error, RATBAG_STATS_HIDPP_ERRORS - 1)]++;
+}
+
+static inline void
+ratbag_stats_request_timeout(struct ratbag_device *device,
+			     enum ratbag_stats_class request_class)
+{
+	device->stats.requests[request_class].errors++;
+	device->stats.requests[request_class].timeouts++;
+}
+
+enum ratbag_capture_direction {
+	RATBAG_CAPTURE_OUT,
+	RATBAG_CAPTURE_IN,
+};
+
+void
+ratbag_capture_record(struct ratbag_device *device,
+		      enum ratbag_capture_direction direction,
+		      const uint8_t *buf, size_t len);
+
+/**
+ * Record a report sent to or received from the device, if the capture is
+ * enabled. See ratbag_capture_enable().
+ */
+static inline void
+ratbag_capture(struct ratbag_device *device,
+	       enum ratbag_capture_direction direction,
+	       const uint8_t *buf, size_t len)
+{
+	if (device->ratbag->capture)
+		ratbag_capture_record(device, direction, buf, len);
+}
+
+void
+ratbag_capture_destroy(struct ratbag *ratbag);
+
 void
 log_msg_va(struct ratbag *ratbag,
 	   enum ratbag_log_priority priority,
@@ -340,17 +607,47 @@ log_buffer(struct ratbag *ratbag,
 	const char *header,
 	uint8_t *buf, size_t len);
 
-#define log_raw(li_, ...) log_msg((li_), RATBAG_LOG_PRIORITY_RAW, __VA_ARGS__)
-#define log_debug(li_, ...) log_msg((li_), RATBAG_LOG_PRIORITY_DEBUG, __VA_ARGS__)
-#define log_info(li_, ...) log_msg((li_), RATBAG_LOG_PRIORITY_INFO, __VA_ARGS__)
-#define log_error(li_, ...) log_msg((li_), RATBAG_LOG_PRIORITY_ERROR, __VA_ARGS__)
-#define log_bug_kernel(li_, ...) log_msg((li_), RATBAG_LOG_PRIORITY_ERROR, "kernel bug: " __VA_ARGS__)
-#define log_bug_libratbag(li_, ...) log_msg((li_), RATBAG_LOG_PRIORITY_ERROR, "libratbag bug: " __VA_ARGS__)
-#define log_bug_client(li_, ...) log_msg((li_), LIBRATBAG_LOG_PRIORITY_ERROR, "client bug: " __VA_ARGS__)
-#define log_buf_raw(li_, h_, buf_, len_) log_buffer(li_, RATBAG_LOG_PRIORITY_RAW, h_, buf_, len_)
-#define log_buf_debug(li_, h_, buf_, len_) log_buffer(li_, RATBAG_LOG_PRIORITY_DEBUG, h_, buf_, len_)
-#define log_buf_info(li_, h_, buf_, len_) log_buffer(li_, RATBAG_LOG_PRIORITY_INFO, h_, buf_, len_)
-#define log_buf_error(li_, h_, buf_, len_) log_buffer(li_, RATBAG_LOG_PRIORITY_ERROR, h_, buf_, len_)
+/* messages below this priority are compiled out, see configure's
+ * --disable-raw-logging */
+#ifndef RATBAG_LOG_MIN_PRIORITY
+#define RATBAG_LOG_MIN_PRIORITY RATBAG_LOG_PRIORITY_RAW
+#endif
+
+/**
+ * @return true if a message of this priority would be logged. The log
+ * macros check this before evaluating their arguments, a filtered message
+ * costs a comparison.
+ */
+static inline bool
+log_is_enabled(const struct ratbag *ratbag, enum ratbag_log_priority priority)
+{
+	return priority >= RATBAG_LOG_MIN_PRIORITY &&
+		ratbag->log_handler &&
+		ratbag->log_priority <= priority;
+}
+
+#define log_prio(li_, p_, ...) \
+	do { \
+		if (log_is_enabled((li_), (p_))) \
+			log_msg((li_), (p_), __VA_ARGS__); \
+	} while (0)
+#define log_buf_prio(li_, p_, h_, buf_, len_) \
+	do { \
+		if (log_is_enabled((li_), (p_))) \
+			log_buffer((li_), (p_), (h_), (buf_), (len_)); \
+	} while (0)
+
+#define log_raw(li_, ...) log_prio((li_), RATBAG_LOG_PRIORITY_RAW, __VA_ARGS__)
+#define log_debug(li_, ...) log_prio((li_), RATBAG_LOG_PRIORITY_DEBUG, __VA_ARGS__)
+#define log_info(li_, ...) log_prio((li_), RATBAG_LOG_PRIORITY_INFO, __VA_ARGS__)
+#define log_error(li_, ...) log_prio((li_), RATBAG_LOG_PRIORITY_ERROR, __VA_ARGS__)
+#define log_bug_kernel(li_, ...) log_prio((li_), RATBAG_LOG_PRIORITY_ERROR, "kernel bug: " __VA_ARGS__)
+#define log_bug_libratbag(li_, ...) log_prio((li_), RATBAG_LOG_PRIORITY_ERROR, "libratbag bug: " __VA_ARGS__)
+#define log_bug_client(li_, ...) log_prio((li_), RATBAG_LOG_PRIORITY_ERROR, "client bug: " __VA_ARGS__)
+#define log_buf_raw(li_, h_, buf_, len_) log_buf_prio(li_, RATBAG_LOG_PRIORITY_RAW, h_, buf_, len_)
+#define log_buf_debug(li_, h_, buf_, len_) log_buf_prio(li_, RATBAG_LOG_PRIORITY_DEBUG, h_, buf_, len_)
+#define log_buf_info(li_, h_, buf_, len_) log_buf_prio(li_, RATBAG_LOG_PRIORITY_INFO, h_, buf_, len_)
+#define log_buf_error(li_, h_, buf_, len_) log_buf_prio(li_, RATBAG_LOG_PRIORITY_ERROR, h_, buf_, len_)
 
 /* list of all supported drivers */
 struct ratbag_driver etekcity_driver;
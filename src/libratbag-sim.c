@@ -0,0 +1,1060 @@
+/*
+ * Copyright © 2015 Red Hat, Inc.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the next
+ * paragraph) shall be included in all copies or substantial portions of the
+ * Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+
+#include "config.h"
+
+#include <errno.h>
+#include <stdbool.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "hidpp-generic.h"
+#include "hidpp20.h"
+#include "libratbag-hidraw.h"
+#include "libratbag-private.h"
+#include "libratbag-sim.h"
+
+/* the number of answers the device can queue before dropping them */
+#define SIM_QUEUE_SIZE				32
+/* the number of input reports the kernel keeps for a hidraw reader, see
+ * HIDRAW_BUFFER_SIZE */
+#define SIM_MOTION_BACKLOG			64
+#define SIM_MOTION_REPORT_ID			0x02
+#define SIM_MOTION_REPORT_SIZE			8
+
+struct sim_report {
+	uint8_t data[LONG_MESSAGE_LENGTH];
+	size_t len;
+	uint64_t ready_at;	/* in us */
+};
+
+/* -------------------------------------------------------------------------- */
+/* HID++ 1.0 state                                                            */
+/* -------------------------------------------------------------------------- */
+
+#define SIM_HIDPP10_NUM_PAGES			8
+#define SIM_HIDPP10_PAGE_SIZE			256
+/* the profiles start at page 3, see hidpp10_get_profile() */
+#define SIM_HIDPP10_PROFILE_PAGE		3
+#define SIM_HIDPP10_NUM_PROFILES		3
+
+#define SIM_HIDPP10_REG_READ_MEMORY		0xA2
+/* the sub id of the notifications sent by ratbag_sim_notify() */
+#define SIM_HIDPP10_NOTIFICATION		0x41
+
+struct sim_hidpp10 {
+	bool short_known[256];
+	uint8_t short_regs[256][3];
+	bool long_known[256];
+	uint8_t long_regs[256][16];
+	uint8_t memory[SIM_HIDPP10_NUM_PAGES][SIM_HIDPP10_PAGE_SIZE];
+};
+
+#define SIM_RECEIVER_REG_PAIRING_INFORMATION	0xB5
+#define SIM_RECEIVER_PAIRING_INFORMATION	0x20
+
+/* the wireless PIDs of the paired mice, at the indices 1 to 3 */
+static const uint16_t sim_receiver_wpids[] = { 0x101b, 0x1028, 0xc24e };
+
+struct sim_receiver {
+	struct sim_hidpp10 devices[ARRAY_LENGTH(sim_receiver_wpids)];
+};
+
+/* -------------------------------------------------------------------------- */
+/* HID++ 2.0 state                                                            */
+/* -------------------------------------------------------------------------- */
+
+/* HID++ 2.0 error codes */
+#define SIM_HIDPP20_ERR_INVALID_ARGUMENT	0x02
+#define SIM_HIDPP20_ERR_OUT_OF_RANGE		0x03
+#define SIM_HIDPP20_ERR_INVALID_FEATURE_INDEX	0x06
+#define SIM_HIDPP20_ERR_INVALID_FUNCTION_ID	0x07
+
+#define SIM_HIDPP20_DPI_MIN			400
+#define SIM_HIDPP20_DPI_MAX			4000
+#define SIM_HIDPP20_DPI_STEPS			50
+
+struct sim_hidpp20_feature {
+	uint16_t page;
+	uint8_t type;
+	uint8_t version;
+};
+
+/* the index in this table is the feature index */
+static const struct sim_hidpp20_feature sim_hidpp20_features[] = {
+	{ HIDPP_PAGE_ROOT, 0, 0 },
+	{ HIDPP_PAGE_FEATURE_SET, 0, 0 },
+	{ HIDPP_PAGE_DEVICE_INFO, 0, 0 },
+	{ HIDPP_PAGE_BATTERY_LEVEL_STATUS, 0, 0 },
+	{ HIDPP_PAGE_SPECIAL_KEYS_BUTTONS, 0, 0 },
+	{ HIDPP_PAGE_ADJUSTABLE_DPI, 0, 0 },
+};
+
+struct sim_hidpp20_control {
+	uint16_t control_id;
+	uint16_t task_id;
+	uint8_t flags;
+	uint8_t group;
+	uint8_t group_mask;
+	/* reporting */
+	uint8_t reporting_flags;
+	uint16_t remapped;
+};
+
+/* roughly an MX Master */
+static const struct sim_hidpp20_control sim_hidpp20_controls[] = {
+	{ 0x0050, 0x0038, 0x01, 0, 0x00, 0, 0 },	/* Left */
+	{ 0x0051, 0x0039, 0x01, 0, 0x00, 0, 0 },	/* Right */
+	{ 0x0052, 0x003a, 0x31, 1, 0x03, 0, 0 },	/* Middle */
+	{ 0x0053, 0x003c, 0x31, 1, 0x03, 0, 0 },	/* Back */
+	{ 0x0056, 0x003e, 0x31, 1, 0x03, 0, 0 },	/* Forward */
+	{ 0x00c3, 0x00a9, 0x31, 2, 0x03, 0, 0 },	/* AppSwitchGesture */
+	{ 0x00c4, 0x00aa, 0x31, 2, 0x03, 0, 0 },	/* SmartShift */
+	{ 0x013b, 0x00b4, 0x31, 2, 0x03, 0, 0 },	/* LedToggle */
+};
+
+struct sim_hidpp20 {
+	struct sim_hidpp20_control controls[ARRAY_LENGTH(sim_hidpp20_controls)];
+	uint16_t dpi;
+	uint16_t default_dpi;
+};
+
+/* -------------------------------------------------------------------------- */
+/* EtekCity state                                                             */
+/* -------------------------------------------------------------------------- */
+
+/* see driver-etekcity.c */
+#define SIM_ETEKCITY_NUM_PROFILES		5
+#define SIM_ETEKCITY_NUM_BUTTONS		11
+
+#define SIM_ETEKCITY_REPORT_ID_CONFIGURE_PROFILE	4
+#define SIM_ETEKCITY_REPORT_ID_PROFILE		5
+#define SIM_ETEKCITY_REPORT_ID_SETTINGS		6
+#define SIM_ETEKCITY_REPORT_ID_KEY_MAPPING	7
+#define SIM_ETEKCITY_REPORT_ID_MACRO		9
+
+#define SIM_ETEKCITY_REPORT_SIZE_PROFILE	50
+#define SIM_ETEKCITY_REPORT_SIZE_SETTINGS	40
+#define SIM_ETEKCITY_REPORT_SIZE_MACRO		130
+
+struct sim_etekcity {
+	/* the profile whose configuration cannot be written, -1 for none */
+	int broken_profile;
+	uint8_t current_profile;
+	uint8_t config_profile;
+	uint8_t config_type;
+	uint8_t settings[SIM_ETEKCITY_NUM_PROFILES][SIM_ETEKCITY_REPORT_SIZE_SETTINGS];
+	uint8_t key_mapping[SIM_ETEKCITY_NUM_PROFILES][SIM_ETEKCITY_REPORT_SIZE_PROFILE];
+	uint8_t macros[SIM_ETEKCITY_NUM_PROFILES][SIM_ETEKCITY_NUM_BUTTONS][SIM_ETEKCITY_REPORT_SIZE_MACRO];
+};
+
+/* -------------------------------------------------------------------------- */
+
+struct sim_device {
+	/* the devices on a simulated receiver share it */
+	int refcount;
+	enum ratbag_sim_protocol protocol;
+	unsigned int latency_us;
+	unsigned int settle_us;
+	unsigned int num_requests;
+	uint64_t busy_until;	/* in us */
+	unsigned int motion_interval_us;
+	uint64_t next_motion_at;	/* in us */
+	bool is_open;
+
+	/* answers waiting to be read */
+	struct sim_report queue[SIM_QUEUE_SIZE];
+	unsigned int queue_head;
+	unsigned int queue_length;
+	uint64_t last_ready_at;
+
+	union {
+		struct sim_hidpp10 hidpp10;
+		struct sim_hidpp20 hidpp20;
+		struct sim_etekcity etekcity;
+		struct sim_receiver receiver;
+	};
+};
+
+static inline uint64_t
+sim_now_in_us(void)
+{
+	struct timespec ts = { 0, 0 };
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static inline void
+sim_sleep_until(uint64_t us)
+{
+	uint64_t now = sim_now_in_us();
+
+	if (us > now)
+		usleep(us - now);
+}
+
+static inline void
+sim_put_u16(uint8_t *buf, uint16_t value)
+{
+	buf[0] = value >> 8;
+	buf[1] = value & 0xff;
+}
+
+static inline uint16_t
+sim_get_u16(const uint8_t *buf)
+{
+	return (buf[0] << 8) | buf[1];
+}
+
+static void
+sim_queue_report(struct sim_device *sim, const uint8_t *data, size_t len)
+{
+	struct sim_report *report;
+	uint64_t ready_at;
+
+	if (sim->queue_length == SIM_QUEUE_SIZE)
+		return;
+
+	/* answers never overtake each other */
+	ready_at = sim_now_in_us() + sim->latency_us;
+	if (ready_at < sim->last_ready_at)
+		ready_at = sim->last_ready_at;
+	sim->last_ready_at = ready_at;
+
+	report = &sim->queue[(sim->queue_head + sim->queue_length) % SIM_QUEUE_SIZE];
+	memcpy(report->data, data, len);
+	report->len = len;
+	report->ready_at = ready_at;
+	sim->queue_length++;
+}
+
+/* -------------------------------------------------------------------------- */
+/* HID++ 1.0 emulation                                                        */
+/* -------------------------------------------------------------------------- */
+
+static void
+sim_hidpp10_init(struct sim_hidpp10 *d)
+{
+	unsigned int i, j;
+
+	d->short_known[0x00] = true;	/* notifications */
+	d->short_known[0x01] = true;	/* individual features */
+	d->short_known[0x0F] = true;	/* current profile */
+	d->short_known[0x51] = true;	/* LED status */
+	d->short_known[0x61] = true;	/* optical sensor settings */
+	d->short_known[0x64] = true;	/* USB refresh rate */
+	d->short_regs[0x64][0] = 1;	/* 1ms, 1000Hz */
+
+	d->long_known[0x63] = true;	/* current resolution */
+	d->long_regs[0x63][0] = 800 / 50;
+	d->long_regs[0x63][2] = 800 / 50;
+
+	/* see struct _hidpp10_profile */
+	for (i = 0; i < SIM_HIDPP10_NUM_PROFILES; i++) {
+		uint8_t *p = d->memory[SIM_HIDPP10_PROFILE_PAGE + i];
+
+		for (j = 0; j < 5; j++) {
+			uint8_t *mode = &p[4 + j * 6];
+
+			sim_put_u16(&mode[0], (400 + j * 400) / 50);
+			sim_put_u16(&mode[2], (400 + j * 400) / 50);
+		}
+		p[34] = 0;	/* angle correction */
+		p[35] = 1;	/* default dpi mode */
+		p[38] = 1;	/* USB refresh rate */
+		for (j = 0; j < 13; j++) {
+			uint8_t *button = &p[39 + j * 3];
+
+			button[0] = 0x81;
+			button[1] = (1 << j) & 0xff;
+			button[2] = (1 << j) >> 8;
+		}
+	}
+}
+
+static size_t
+sim_hidpp10_error(const uint8_t *request, uint8_t error, uint8_t *reply)
+{
+	reply[0] = REPORT_ID_SHORT;
+	reply[1] = request[1];
+	reply[2] = __ERROR_MSG;
+	reply[3] = request[2];
+	reply[4] = request[3];
+	reply[5] = error;
+	reply[6] = 0x00;
+
+	return SHORT_MESSAGE_LENGTH;
+}
+
+static size_t
+sim_hidpp10_read_memory(struct sim_hidpp10 *d, const uint8_t *request,
+			uint8_t *reply)
+{
+	uint8_t page = request[4];
+	unsigned int offset = (request[5] | (request[6] << 8)) * 2;
+
+	if (page >= SIM_HIDPP10_NUM_PAGES ||
+	    offset + 16 > SIM_HIDPP10_PAGE_SIZE)
+		return sim_hidpp10_error(request, ERR_INVALID_VALUE, reply);
+
+	reply[0] = REPORT_ID_LONG;
+	memcpy(&reply[1], &request[1], 3);
+	memcpy(&reply[4], &d->memory[page][offset], 16);
+
+	return LONG_MESSAGE_LENGTH;
+}
+
+static size_t
+sim_hidpp10_handle(struct sim_hidpp10 *d, const uint8_t *request, size_t len,
+		   uint8_t *reply)
+{
+	uint8_t sub_id = request[2];
+	uint8_t address = request[3];
+
+	if (len < SHORT_MESSAGE_LENGTH)
+		return 0;
+
+	memcpy(reply, request, 4);
+
+	switch (sub_id) {
+	case GET_REGISTER_REQ:
+		if (!d->short_known[address])
+			break;
+		reply[0] = REPORT_ID_SHORT;
+		memcpy(&reply[4], d->short_regs[address], 3);
+		return SHORT_MESSAGE_LENGTH;
+	case SET_REGISTER_REQ:
+		if (!d->short_known[address])
+			break;
+		memcpy(d->short_regs[address], &request[4], 3);
+		reply[0] = REPORT_ID_SHORT;
+		memset(&reply[4], 0, 3);
+		return SHORT_MESSAGE_LENGTH;
+	case GET_LONG_REGISTER_REQ:
+		if (address == SIM_HIDPP10_REG_READ_MEMORY)
+			return sim_hidpp10_read_memory(d, request, reply);
+		if (!d->long_known[address])
+			break;
+		reply[0] = REPORT_ID_LONG;
+		memcpy(&reply[4], d->long_regs[address], 16);
+		return LONG_MESSAGE_LENGTH;
+	case SET_LONG_REGISTER_REQ:
+		if (!d->long_known[address] || len < LONG_MESSAGE_LENGTH)
+			break;
+		memcpy(d->long_regs[address], &request[4], 16);
+		reply[0] = REPORT_ID_SHORT;
+		memset(&reply[4], 0, 3);
+		return SHORT_MESSAGE_LENGTH;
+	default:
+		return sim_hidpp10_error(request, ERR_INVALID_SUBID, reply);
+	}
+
+	return sim_hidpp10_error(request, ERR_INVALID_ADDRESS, reply);
+}
+
+/* -------------------------------------------------------------------------- */
+/* Receiver emulation                                                         */
+/* -------------------------------------------------------------------------- */
+
+static void
+sim_receiver_init(struct sim_receiver *d)
+{
+	unsigned int i;
+
+	for (i = 0; i < ARRAY_LENGTH(d->devices); i++)
+		sim_hidpp10_init(&d->devices[i]);
+}
+
+static size_t
+sim_receiver_handle(struct sim_receiver *d, const uint8_t *request,
+		    size_t len, uint8_t *reply)
+{
+	uint8_t idx = request[1];
+	unsigned int slot;
+	uint16_t wpid;
+
+	if (len < SHORT_MESSAGE_LENGTH)
+		return 0;
+
+	if (idx >= 1 && idx <= ARRAY_LENGTH(d->devices))
+		return sim_hidpp10_handle(&d->devices[idx - 1], request, len,
+					  reply);
+
+	if (idx != RECEIVER_IDX)
+		return sim_hidpp10_error(request, ERR_UNKNOWN_DEVICE, reply);
+
+	if (request[2] != GET_LONG_REGISTER_REQ ||
+	    request[3] != SIM_RECEIVER_REG_PAIRING_INFORMATION ||
+	    (request[4] & 0xf0) != SIM_RECEIVER_PAIRING_INFORMATION)
+		return sim_hidpp10_error(request, ERR_INVALID_ADDRESS, reply);
+
+	slot = request[4] & 0x0f;
+	if (slot >= ARRAY_LENGTH(sim_receiver_wpids))
+		return sim_hidpp10_error(request, ERR_INVALID_VALUE, reply);
+
+	/* see hidpp10_get_pairing_information() */
+	wpid = sim_receiver_wpids[slot];
+	memset(reply, 0, LONG_MESSAGE_LENGTH);
+	reply[0] = REPORT_ID_LONG;
+	memcpy(&reply[1], &request[1], 4);
+	reply[6] = 8;		/* report interval in ms */
+	reply[7] = wpid >> 8;
+	reply[8] = wpid & 0xff;
+	reply[11] = 0x02;	/* mouse */
+
+	return LONG_MESSAGE_LENGTH;
+}
+
+/* -------------------------------------------------------------------------- */
+/* HID++ 2.0 emulation                                                        */
+/* -------------------------------------------------------------------------- */
+
+static void
+sim_hidpp20_init(struct sim_hidpp20 *d)
+{
+	memcpy(d->controls, sim_hidpp20_controls, sizeof(d->controls));
+	d->dpi = 1000;
+	d->default_dpi = 1000;
+}
+
+static struct sim_hidpp20_control *
+sim_hidpp20_find_control(struct sim_hidpp20 *d, uint16_t control_id)
+{
+	unsigned int i;
+
+	for (i = 0; i < ARRAY_LENGTH(d->controls); i++) {
+		if (d->controls[i].control_id == control_id)
+			return &d->controls[i];
+	}
+
+	return NULL;
+}
+
+/* returns 0 or a HID++ 2.0 error code, params are in/out */
+static int
+sim_hidpp20_root(struct sim_hidpp20 *d, uint8_t function, uint8_t *params)
+{
+	uint16_t page;
+	unsigned int i;
+
+	switch (function) {
+	case 0: /* getFeature */
+		page = sim_get_u16(params);
+		memset(params, 0, 3);
+		for (i = 0; i < ARRAY_LENGTH(sim_hidpp20_features); i++) {
+			if (sim_hidpp20_features[i].page == page) {
+				params[0] = i;
+				params[1] = sim_hidpp20_features[i].type;
+				params[2] = sim_hidpp20_features[i].version;
+				break;
+			}
+		}
+		return 0;
+	case 1: /* getProtocolVersion, params[2] is the ping data */
+		params[0] = 4;
+		params[1] = 2;
+		return 0;
+	}
+
+	return SIM_HIDPP20_ERR_INVALID_FUNCTION_ID;
+}
+
+static int
+sim_hidpp20_feature_set(struct sim_hidpp20 *d, uint8_t function, uint8_t *params)
+{
+	const struct sim_hidpp20_feature *feature;
+
+	switch (function) {
+	case 0: /* getCount, without the root feature */
+		params[0] = ARRAY_LENGTH(sim_hidpp20_features) - 1;
+		return 0;
+	case 1: /* getFeatureID */
+		if (params[0] >= ARRAY_LENGTH(sim_hidpp20_features))
+			return SIM_HIDPP20_ERR_INVALID_ARGUMENT;
+		feature = &sim_hidpp20_features[params[0]];
+		sim_put_u16(&params[0], feature->page);
+		params[2] = feature->type;
+		params[3] = feature->version;
+		return 0;
+	}
+
+	return SIM_HIDPP20_ERR_INVALID_FUNCTION_ID;
+}
+
+static int
+sim_hidpp20_device_info(struct sim_hidpp20 *d, uint8_t function, uint8_t *params)
+{
+	switch (function) {
+	case 1: /* getFwInfo */
+		if (params[0] != 0)
+			return SIM_HIDPP20_ERR_INVALID_ARGUMENT;
+		params[0] = 0; /* main application */
+		memcpy(&params[1], "SIM", 3);
+		params[4] = 0x12;
+		params[5] = 0x01;
+		sim_put_u16(&params[6], 0x0015);
+		return 0;
+	}
+
+	return SIM_HIDPP20_ERR_INVALID_FUNCTION_ID;
+}
+
+static int
+sim_hidpp20_battery(struct sim_hidpp20 *d, uint8_t function, uint8_t *params)
+{
+	switch (function) {
+	case 0: /* getBatteryLevelStatus */
+		params[0] = 50;
+		params[1] = 20;
+		params[2] = 0;
+		return 0;
+	}
+
+	return SIM_HIDPP20_ERR_INVALID_FUNCTION_ID;
+}
+
+static int
+sim_hidpp20_special_keys(struct sim_hidpp20 *d, uint8_t function, uint8_t *params)
+{
+	struct sim_hidpp20_control *control;
+	uint8_t flags;
+
+	switch (function) {
+	case 0: /* getCount */
+		params[0] = ARRAY_LENGTH(d->controls);
+		return 0;
+	case 1: /* getCidInfo */
+		if (params[0] >= ARRAY_LENGTH(d->controls))
+			return SIM_HIDPP20_ERR_INVALID_ARGUMENT;
+		control = &d->controls[params[0]];
+		sim_put_u16(&params[0], control->control_id);
+		sim_put_u16(&params[2], control->task_id);
+		params[4] = control->flags;
+		params[5] = 0;
+		params[6] = control->group;
+		params[7] = control->group_mask;
+		params[8] = 0;
+		return 0;
+	case 2: /* getCidReporting */
+		control = sim_hidpp20_find_control(d, sim_get_u16(params));
+		if (!control)
+			return SIM_HIDPP20_ERR_INVALID_ARGUMENT;
+		params[2] = control->reporting_flags;
+		sim_put_u16(&params[3], control->remapped);
+		return 0;
+	case 3: /* setCidReporting */
+		control = sim_hidpp20_find_control(d, sim_get_u16(params));
+		if (!control)
+			return SIM_HIDPP20_ERR_INVALID_ARGUMENT;
+		/* each setting comes with a "valid" bit next to it */
+		flags = control->reporting_flags;
+		if (params[2] & 0x02)
+			flags = (flags & ~0x01) | (params[2] & 0x01);
+		if (params[2] & 0x08)
+			flags = (flags & ~0x04) | (params[2] & 0x04);
+		if (params[2] & 0x20)
+			flags = (flags & ~0x10) | ((params[2] & 0x10));
+		control->reporting_flags = flags;
+		if (sim_get_u16(&params[3]))
+			control->remapped = sim_get_u16(&params[3]);
+		return 0;
+	}
+
+	return SIM_HIDPP20_ERR_INVALID_FUNCTION_ID;
+}
+
+static int
+sim_hidpp20_adjustable_dpi(struct sim_hidpp20 *d, uint8_t function, uint8_t *params)
+{
+	uint16_t dpi;
+
+	/* there is only one sensor */
+	if (function != 0 && params[0] != 0)
+		return SIM_HIDPP20_ERR_INVALID_ARGUMENT;
+
+	switch (function) {
+	case 0: /* getSensorCount */
+		params[0] = 1;
+		return 0;
+	case 1: /* getSensorDpiList, a range with steps */
+		sim_put_u16(&params[1], SIM_HIDPP20_DPI_MIN);
+		sim_put_u16(&params[3], 0xe000 + SIM_HIDPP20_DPI_STEPS);
+		sim_put_u16(&params[5], SIM_HIDPP20_DPI_MAX);
+		sim_put_u16(&params[7], 0);
+		return 0;
+	case 2: /* getSensorDpi */
+		sim_put_u16(&params[1], d->dpi);
+		sim_put_u16(&params[3], d->default_dpi);
+		return 0;
+	case 3: /* setSensorDpi */
+		dpi = sim_get_u16(&params[1]);
+		if (dpi < SIM_HIDPP20_DPI_MIN || dpi > SIM_HIDPP20_DPI_MAX)
+			return SIM_HIDPP20_ERR_OUT_OF_RANGE;
+		d->dpi = dpi;
+		return 0;
+	}
+
+	return SIM_HIDPP20_ERR_INVALID_FUNCTION_ID;
+}
+
+static size_t
+sim_hidpp20_handle(struct sim_hidpp20 *d, const uint8_t *request, size_t len,
+		   uint8_t *reply)
+{
+	uint8_t feature_index = request[2];
+	uint8_t function = request[3] >> 4;
+	uint8_t *params = &reply[4];
+	int error;
+
+	if (len < SHORT_MESSAGE_LENGTH ||
+	    (request[0] != REPORT_ID_SHORT && request[0] != REPORT_ID_LONG))
+		return 0;
+
+	memset(reply, 0, LONG_MESSAGE_LENGTH);
+	memcpy(reply, request, len < LONG_MESSAGE_LENGTH ? len : LONG_MESSAGE_LENGTH);
+	reply[0] = REPORT_ID_LONG;
+
+	if (feature_index >= ARRAY_LENGTH(sim_hidpp20_features)) {
+		error = SIM_HIDPP20_ERR_INVALID_FEATURE_INDEX;
+	} else {
+		switch (sim_hidpp20_features[feature_index].page) {
+		case HIDPP_PAGE_ROOT:
+			error = sim_hidpp20_root(d, function, params);
+			break;
+		case HIDPP_PAGE_FEATURE_SET:
+			error = sim_hidpp20_feature_set(d, function, params);
+			break;
+		case HIDPP_PAGE_DEVICE_INFO:
+			error = sim_hidpp20_device_info(d, function, params);
+			break;
+		case HIDPP_PAGE_BATTERY_LEVEL_STATUS:
+			error = sim_hidpp20_battery(d, function, params);
+			break;
+		case HIDPP_PAGE_SPECIAL_KEYS_BUTTONS:
+			error = sim_hidpp20_special_keys(d, function, params);
+			break;
+		case HIDPP_PAGE_ADJUSTABLE_DPI:
+			error = sim_hidpp20_adjustable_dpi(d, function, params);
+			break;
+		default:
+			error = SIM_HIDPP20_ERR_INVALID_FEATURE_INDEX;
+			break;
+		}
+	}
+
+	if (error) {
+		reply[2] = 0xff;
+		reply[3] = feature_index;
+		reply[4] = request[3];
+		reply[5] = error;
+		memset(&reply[6], 0, LONG_MESSAGE_LENGTH - 6);
+	}
+
+	return LONG_MESSAGE_LENGTH;
+}
+
+/* -------------------------------------------------------------------------- */
+/* EtekCity emulation                                                         */
+/* -------------------------------------------------------------------------- */
+
+static void
+sim_etekcity_init(struct sim_etekcity *d)
+{
+	/* see etekcity_button_mapping in driver-etekcity.c */
+	static const uint8_t buttons[] = { 1, 2, 3, 7, 8, 9, 10, 13, 14, 15, 6 };
+	unsigned int i, j, index;
+
+	d->broken_profile = -1;
+
+	for (i = 0; i < SIM_ETEKCITY_NUM_PROFILES; i++) {
+		uint8_t *settings = d->settings[i];
+		uint8_t *mapping = d->key_mapping[i];
+
+		/* see struct etekcity_settings_report */
+		settings[0] = SIM_ETEKCITY_REPORT_ID_SETTINGS;
+		settings[1] = SIM_ETEKCITY_REPORT_SIZE_SETTINGS;
+		settings[2] = i;
+		settings[3] = 0x0a;
+		settings[4] = 0x0a;
+		settings[5] = 0x3f;
+		for (j = 0; j < 6; j++) {
+			settings[6 + j] = (j + 1) * 8;	/* 400, 800, ... dpi */
+			settings[12 + j] = (j + 1) * 8;
+		}
+		settings[18] = 1;	/* current dpi */
+		settings[26] = 0x03;	/* 1000Hz */
+
+		mapping[0] = SIM_ETEKCITY_REPORT_ID_KEY_MAPPING;
+		mapping[1] = SIM_ETEKCITY_REPORT_SIZE_PROFILE;
+		mapping[2] = i;
+		for (j = 0; j < SIM_ETEKCITY_NUM_BUTTONS; j++) {
+			/* see etekcity_button_to_index() */
+			index = j < 8 ? j : j + 5;
+			if (3 + index * 3 < SIM_ETEKCITY_REPORT_SIZE_PROFILE)
+				mapping[3 + index * 3] = buttons[j];
+		}
+	}
+}
+
+static uint8_t *
+sim_etekcity_get_report(struct sim_etekcity *d, unsigned char reportnum,
+			size_t *size)
+{
+	switch (reportnum) {
+	case SIM_ETEKCITY_REPORT_ID_SETTINGS:
+		*size = SIM_ETEKCITY_REPORT_SIZE_SETTINGS;
+		return d->settings[d->config_profile];
+	case SIM_ETEKCITY_REPORT_ID_KEY_MAPPING:
+		*size = SIM_ETEKCITY_REPORT_SIZE_PROFILE;
+		return d->key_mapping[d->config_profile];
+	case SIM_ETEKCITY_REPORT_ID_MACRO:
+		if (d->config_type >= SIM_ETEKCITY_NUM_BUTTONS)
+			return NULL;
+		*size = SIM_ETEKCITY_REPORT_SIZE_MACRO;
+		return d->macros[d->config_profile][d->config_type];
+	}
+
+	return NULL;
+}
+
+static int
+sim_etekcity_handle(struct sim_etekcity *d, unsigned char reportnum,
+		    uint8_t *buf, size_t len, int reqtype)
+{
+	uint8_t *report;
+	size_t size = 0;
+
+	switch (reportnum) {
+	case SIM_ETEKCITY_REPORT_ID_PROFILE:
+		if (len < 3)
+			return -EINVAL;
+		if (reqtype == HID_REQ_SET_REPORT) {
+			if (buf[2] >= SIM_ETEKCITY_NUM_PROFILES)
+				return -EPIPE;
+			d->current_profile = buf[2];
+		} else {
+			buf[0] = reportnum;
+			buf[1] = 0x03;
+			buf[2] = d->current_profile;
+		}
+		return 3;
+	case SIM_ETEKCITY_REPORT_ID_CONFIGURE_PROFILE:
+		if (reqtype != HID_REQ_SET_REPORT || len < 3 ||
+		    buf[1] >= SIM_ETEKCITY_NUM_PROFILES)
+			return -EPIPE;
+		d->config_profile = buf[1];
+		d->config_type = buf[2];
+		return 3;
+	}
+
+	report = sim_etekcity_get_report(d, reportnum, &size);
+	if (!report)
+		return -EPIPE;
+
+	if (reqtype == HID_REQ_SET_REPORT &&
+	    d->config_profile == d->broken_profile)
+		return -EPIPE;
+
+	if (len > size)
+		len = size;
+
+	if (reqtype == HID_REQ_SET_REPORT)
+		memcpy(report, buf, len);
+	else
+		memcpy(buf, report, len);
+
+	return len;
+}
+
+/* -------------------------------------------------------------------------- */
+/* transport                                                                  */
+/* -------------------------------------------------------------------------- */
+
+static int
+sim_open(struct ratbag_device *device)
+{
+	struct sim_device *sim = device->transport_data;
+
+	sim->is_open = true;
+	sim->next_motion_at = sim_now_in_us();
+
+	return 0;
+}
+
+static void
+sim_close(struct ratbag_device *device)
+{
+	struct sim_device *sim = device->transport_data;
+
+	sim->is_open = false;
+	sim->queue_length = 0;
+}
+
+static int
+sim_raw_request(struct ratbag_device *device, unsigned char reportnum,
+		uint8_t *buf, size_t len, unsigned char rtype, int reqtype)
+{
+	struct sim_device *sim = device->transport_data;
+	int rc;
+
+	if (!sim->is_open)
+		return -EINVAL;
+
+	if (sim->protocol != RATBAG_SIM_ETEKCITY)
+		return -EPIPE;
+
+	sim->num_requests++;
+	usleep(sim->latency_us);
+
+	if (sim_now_in_us() < sim->busy_until)
+		return -EPIPE;
+
+	rc = sim_etekcity_handle(&sim->etekcity, reportnum, buf, len, reqtype);
+	if (rc > 0 && reqtype == HID_REQ_SET_REPORT)
+		sim->busy_until = sim_now_in_us() + sim->settle_us;
+
+	return rc;
+}
+
+static int
+sim_output_report(struct ratbag_device *device, uint8_t *buf, size_t len)
+{
+	struct sim_device *sim = device->transport_data;
+	uint8_t reply[LONG_MESSAGE_LENGTH];
+	size_t reply_len = 0;
+
+	if (!sim->is_open)
+		return -EINVAL;
+
+	sim->num_requests++;
+
+	switch (sim->protocol) {
+	case RATBAG_SIM_HIDPP10:
+		reply_len = sim_hidpp10_handle(&sim->hidpp10, buf, len, reply);
+		break;
+	case RATBAG_SIM_HIDPP20:
+		reply_len = sim_hidpp20_handle(&sim->hidpp20, buf, len, reply);
+		break;
+	case RATBAG_SIM_HIDPP10_RECEIVER:
+		reply_len = sim_receiver_handle(&sim->receiver, buf, len, reply);
+		break;
+	case RATBAG_SIM_ETEKCITY:
+		return -EPIPE;
+	}
+
+	if (reply_len)
+		sim_queue_report(sim, reply, reply_len);
+
+	return 0;
+}
+
+static int
+sim_read_input_report(struct ratbag_device *device, uint8_t *buf, size_t len,
+		      uint64_t deadline)
+{
+	struct sim_device *sim = device->transport_data;
+	struct sim_report *report;
+	uint64_t deadline_us = deadline * 1000;
+
+	if (!sim->is_open)
+		return -EINVAL;
+
+	report = &sim->queue[sim->queue_head];
+
+	if (sim->motion_interval_us) {
+		uint64_t now = sim_now_in_us();
+		uint64_t oldest = now - SIM_MOTION_BACKLOG * sim->motion_interval_us;
+
+		/* motion nobody read is dropped once the backlog is full */
+		if (now > SIM_MOTION_BACKLOG * sim->motion_interval_us &&
+		    sim->next_motion_at < oldest)
+			sim->next_motion_at = oldest;
+
+		if (sim->next_motion_at <= deadline_us &&
+		    (sim->queue_length == 0 ||
+		     sim->next_motion_at <= report->ready_at)) {
+			sim_sleep_until(sim->next_motion_at);
+			sim->next_motion_at += sim->motion_interval_us;
+
+			len = min(len, SIM_MOTION_REPORT_SIZE);
+			memset(buf, 0, len);
+			buf[0] = SIM_MOTION_REPORT_ID;
+			return len;
+		}
+	}
+
+	if (sim->queue_length == 0 || report->ready_at > deadline_us) {
+		sim_sleep_until(deadline_us);
+		return -ETIMEDOUT;
+	}
+
+	sim_sleep_until(report->ready_at);
+
+	if (len > report->len)
+		len = report->len;
+	memcpy(buf, report->data, len);
+
+	sim->queue_head = (sim->queue_head + 1) % SIM_QUEUE_SIZE;
+	sim->queue_length--;
+
+	return len;
+}
+
+static uintptr_t
+sim_get_node_key(struct ratbag_device *device)
+{
+	return (uintptr_t)device->transport_data;
+}
+
+static void
+sim_unref(struct sim_device *sim)
+{
+	if (--sim->refcount == 0)
+		free(sim);
+}
+
+static void
+sim_destroy(struct ratbag_device *device)
+{
+	sim_unref(device->transport_data);
+	device->transport_data = NULL;
+}
+
+static const struct ratbag_transport sim_transport = {
+	.name = "simulator",
+	.open = sim_open,
+	.close = sim_close,
+	.get_node_key = sim_get_node_key,
+	.raw_request = sim_raw_request,
+	.output_report = sim_output_report,
+	.read_input_report = sim_read_input_report,
+	.destroy = sim_destroy,
+};
+
+struct ratbag_device *
+ratbag_device_new_simulated(struct ratbag *ratbag,
+			    const struct ratbag_sim_config *config)
+{
+	struct ratbag_device *device;
+	struct sim_device *sim;
+
+	if (config->receiver) {
+		if (config->protocol != RATBAG_SIM_HIDPP10_RECEIVER ||
+		    config->receiver->transport != &sim_transport)
+			return NULL;
+
+		sim = config->receiver->transport_data;
+		sim->refcount++;
+		goto new_device;
+	}
+
+	sim = zalloc(sizeof(*sim));
+	if (!sim)
+		return NULL;
+
+	sim->refcount = 1;
+	sim->protocol = config->protocol;
+	sim->latency_us = config->latency_us;
+	sim->settle_us = config->settle_us;
+	if (config->motion_hz)
+		sim->motion_interval_us = 1000000 / config->motion_hz;
+
+	switch (config->protocol) {
+	case RATBAG_SIM_HIDPP10:
+		sim_hidpp10_init(&sim->hidpp10);
+		break;
+	case RATBAG_SIM_HIDPP20:
+		sim_hidpp20_init(&sim->hidpp20);
+		break;
+	case RATBAG_SIM_ETEKCITY:
+		sim_etekcity_init(&sim->etekcity);
+		break;
+	case RATBAG_SIM_HIDPP10_RECEIVER:
+		sim_receiver_init(&sim->receiver);
+		break;
+	}
+
+new_device:
+	device = ratbag_device_new_from_transport(ratbag,
+						  config->name,
+						  &config->ids,
+						  &sim_transport,
+						  sim);
+	if (!device)
+		sim_unref(sim);
+
+	return device;
+}
+
+unsigned int
+ratbag_sim_get_num_requests(struct ratbag_device *device)
+{
+	struct sim_device *sim = device->transport_data;
+
+	if (device->transport != &sim_transport)
+		return 0;
+
+	return sim->num_requests;
+}
+
+void
+ratbag_sim_notify(struct ratbag_device *device)
+{
+	struct sim_device *sim = device->transport_data;
+	uint8_t notification[SHORT_MESSAGE_LENGTH] = {
+		REPORT_ID_SHORT,
+		WIRED_DEVICE_IDX,
+		SIM_HIDPP10_NOTIFICATION,
+	};
+
+	if (device->transport != &sim_transport ||
+	    sim->protocol != RATBAG_SIM_HIDPP10)
+		return;
+
+	sim_queue_report(sim, notification, sizeof(notification));
+}
+
+unsigned int
+ratbag_sim_get_num_queued(struct ratbag_device *device)
+{
+	struct sim_device *sim = device->transport_data;
+
+	if (device->transport != &sim_transport)
+		return 0;
+
+	return sim->queue_length;
+}
+
+void
+ratbag_sim_set_broken_profile(struct ratbag_device *device, int index)
+{
+	struct sim_device *sim = device->transport_data;
+
+	if (device->transport != &sim_transport ||
+	    sim->protocol != RATBAG_SIM_ETEKCITY)
+		return;
+
+	sim->etekcity.broken_profile = index;
+}
@@ -0,0 +1,110 @@
+/*
+ * Copyright © 2015 Red Hat, Inc.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the next
+ * paragraph) shall be included in all copies or substantial portions of the
+ * Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+
+#ifndef LIBRATBAG_SIM_H
+#define LIBRATBAG_SIM_H
+
+#include <linux/input.h>
+
+#include "libratbag.h"
+
+/**
+ * A transport that emulates a device in-process, so the drivers can be
+ * exercised without hardware. Not part of the public API, the tests and
+ * benchmarks link against the internal library.
+ */
+
+enum ratbag_sim_protocol {
+	/** a wired HID++ 1.0 mouse with profiles in its memory */
+	RATBAG_SIM_HIDPP10,
+	/** a HID++ 2.0 mouse with the root, feature set, 0x0003, 0x1000,
+	 * 0x1b04 and 0x2201 features */
+	RATBAG_SIM_HIDPP20,
+	/** an EtekCity mouse, configured through feature reports */
+	RATBAG_SIM_ETEKCITY,
+	/** a receiver with HID++ 1.0 mice paired at the indices 1 to 3,
+	 * with the wireless PIDs 0x101b, 0x1028 and 0xc24e. The product id
+	 * of the device picks the mouse. */
+	RATBAG_SIM_HIDPP10_RECEIVER,
+};
+
+struct ratbag_sim_config {
+	enum ratbag_sim_protocol protocol;
+	/** the device name, as udev would report it */
+	const char *name;
+	/** the ids the drivers are matched against */
+	struct input_id ids;
+	/** the time in us the device takes to answer a request */
+	unsigned int latency_us;
+	/** the time in us an EtekCity device stays busy after a feature
+	 * report was written. Requests fail with -EPIPE meanwhile. */
+	unsigned int settle_us;
+	/** the rate in Hz at which the device sends pointer motion input
+	 * reports, as if it was moved all the time. 0 for none */
+	unsigned int motion_hz;
+	/** with RATBAG_SIM_HIDPP10_RECEIVER, another simulated device on
+	 * the receiver this one is paired with, NULL for a new receiver.
+	 * The devices then share the node. */
+	struct ratbag_device *receiver;
+};
+
+/**
+ * Create a simulated device and probe the drivers for it.
+ *
+ * @return the new device, or NULL if no driver handles it
+ */
+struct ratbag_device *
+ratbag_device_new_simulated(struct ratbag *ratbag,
+			    const struct ratbag_sim_config *config);
+
+/**
+ * @return the number of requests the simulated device has answered so
+ * far. Devices sharing a receiver count together.
+ */
+unsigned int
+ratbag_sim_get_num_requests(struct ratbag_device *device);
+
+/**
+ * Queue a HID++ notification from a simulated HID++ 1.0 device, ahead of
+ * the answers to the requests sent after it.
+ */
+void
+ratbag_sim_notify(struct ratbag_device *device);
+
+/**
+ * @return the number of reports the simulated device has queued that were
+ * not read yet, pointer motion aside
+ */
+unsigned int
+ratbag_sim_get_num_queued(struct ratbag_device *device);
+
+/**
+ * Make a simulated EtekCity device refuse every write to the
+ * configuration of a profile, as a device with a failing memory would.
+ *
+ * @param index The profile to refuse the writes to, -1 for none
+ */
+void
+ratbag_sim_set_broken_profile(struct ratbag_device *device, int index);
+
+#endif /* LIBRATBAG_SIM_H */
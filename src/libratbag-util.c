@@ -30,6 +30,7 @@
 #include "config.h"
 
 #include <ctype.h>
+#include <errno.h>
 #include <locale.h>
 #include <stdarg.h>
 #include <stdbool.h>
@@ -70,6 +71,94 @@ list_empty(const struct list *list)
 	return list->next == list;
 }
 
+/* the shortest sleep between two calls, so a device that is not ready
+ * yet is not flooded with requests */
+#define POLL_BACKOFF_MIN_US		100
+
+/**
+ * Call is_ready() until it returns 0, sleeping in between with an
+ * exponential backoff. The first call happens after delay_us, which may
+ * be 0. Each sleep is then twice as long as the previous one, but at most
+ * max_delay_us.
+ *
+ * @return the time in us it took until is_ready() returned 0, or
+ * -ETIMEDOUT if it did not within timeout_us
+ */
+int64_t
+poll_backoff(int (*is_ready)(void *data), void *data,
+	     unsigned int delay_us, unsigned int max_delay_us,
+	     unsigned int timeout_us)
+{
+	uint64_t start = now_in_us();
+	uint64_t elapsed;
+
+	while (1) {
+		if (delay_us)
+			usleep(delay_us);
+
+		elapsed = now_in_us() - start;
+		if (is_ready(data) == 0)
+			return elapsed;
+
+		if (elapsed >= timeout_us)
+			return -ETIMEDOUT;
+
+		delay_us = max(delay_us * 2, POLL_BACKOFF_MIN_US);
+		delay_us = min(delay_us, max_delay_us);
+		delay_us = min(delay_us, timeout_us - elapsed);
+	}
+}
+
+/**
+ * Read exactly size bytes from fd, retrying on EINTR.
+ *
+ * @return 0 on success, a negative errno, or -EIO at the end of the file
+ */
+int
+read_all(int fd, void *data, size_t size)
+{
+	uint8_t *buf = data;
+	ssize_t rc;
+
+	while (size > 0) {
+		rc = read(fd, buf, size);
+		if (rc < 0 && errno == EINTR)
+			continue;
+		if (rc < 0)
+			return -errno;
+		if (rc == 0)
+			return -EIO;
+		buf += rc;
+		size -= rc;
+	}
+
+	return 0;
+}
+
+/**
+ * Write all size bytes to fd, retrying on EINTR.
+ *
+ * @return 0 on success or a negative errno
+ */
+int
+write_all(int fd, const void *data, size_t size)
+{
+	const uint8_t *buf = data;
+	ssize_t rc;
+
+	while (size > 0) {
+		rc = write(fd, buf, size);
+		if (rc < 0 && errno == EINTR)
+			continue;
+		if (rc < 0)
+			return -errno;
+		buf += rc;
+		size -= rc;
+	}
+
+	return 0;
+}
+
 const char *
 udev_prop_value(struct udev_device *device,
 		const char *prop_name)
@@ -24,8 +24,10 @@
 #ifndef LIBRATBAG_UTIL_H
 #define LIBRATBAG_UTIL_H
 
+#include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 #include <unistd.h>
 #include <libudev.h>
 
@@ -101,6 +103,35 @@ msleep(unsigned int ms)
 	usleep(ms * 1000);
 }
 
+static inline uint64_t
+now_in_ms(void)
+{
+	struct timespec ts = { 0, 0 };
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static inline uint64_t
+now_in_us(void)
+{
+	struct timespec ts = { 0, 0 };
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+int64_t
+poll_backoff(int (*is_ready)(void *data), void *data,
+	     unsigned int delay_us, unsigned int max_delay_us,
+	     unsigned int timeout_us);
+
+int
+read_all(int fd, void *data, size_t size);
+
+int
+write_all(int fd, const void *data, size_t size);
+
 static inline int
 long_bit_is_set(const unsigned long *array, int bit)
 {
@@ -30,12 +30,14 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/epoll.h>
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <unistd.h>
 
 #include "libratbag-private.h"
 #include "libratbag-util.h"
+#include "libratbag-hidraw.h"
 
 static void
 ratbag_default_log_func(struct ratbag *ratbag,
@@ -79,46 +81,40 @@ log_msg(struct ratbag *ratbag,
 	va_end(args);
 }
 
+/* the bytes per line of a hex dump, longer buffers take several lines */
+#define LOG_BUFFER_LINE_BYTES			32
+
 void
 log_buffer(struct ratbag *ratbag,
 	enum ratbag_log_priority priority,
 	const char *header,
 	uint8_t *buf, size_t len)
 {
-	char *output_buf;
-	char *sep = "";
-	unsigned int i, n;
-	unsigned int buf_len;
+	static const char hex[] = "0123456789abcdef";
+	char line[LOG_BUFFER_LINE_BYTES * 3 + 1];
+	size_t i, n;
 
-	if (ratbag->log_handler &&
-	    ratbag->log_priority > priority)
+	if (!log_is_enabled(ratbag, priority))
 		return;
 
-	buf_len = header ? strlen(header) : 0;
-	buf_len += len * 3;
-	buf_len += 1; /* terminating '\0' */
-
-	output_buf = zalloc(buf_len);
-	if (!output_buf) {
-		if (header)
-			log_msg(ratbag, priority, "%s ......", header);
-		else
-			log_msg(ratbag, priority, " ......");
-		return;
-	}
-
-	n = 0;
-	if (header)
-		n += sprintf(output_buf, "%s", header);
+	if (!header)
+		header = "";
 
-	for (i = 0; i < len; ++i) {
-		n += sprintf(&output_buf[n], "%s%02x", sep, buf[i] & 0xFF);
-		sep = " ";
-	}
+	do {
+		n = 0;
+		for (i = 0; i < LOG_BUFFER_LINE_BYTES && i < len; i++) {
+			if (i > 0)
+				line[n++] = ' ';
+			line[n++] = hex[buf[i] >> 4];
+			line[n++] = hex[buf[i] & 0xf];
+		}
+		line[n] = '\0';
 
-	log_msg(ratbag, priority, "%s\n", output_buf);
+		log_msg(ratbag, priority, "%s%s\n", header, line);
 
-	free(output_buf);
+		buf += i;
+		len -= i;
+	} while (len > 0);
 }
 
 LIBRATBAG_EXPORT void
@@ -134,6 +130,41 @@ ratbag_log_get_priority(const struct ratbag *ratbag)
 	return ratbag->log_priority;
 }
 
+LIBRATBAG_EXPORT void
+ratbag_set_request_timeout(struct ratbag *ratbag, unsigned int timeout)
+{
+	ratbag->request_timeout = timeout;
+}
+
+LIBRATBAG_EXPORT unsigned int
+ratbag_get_request_timeout(const struct ratbag *ratbag)
+{
+	return ratbag->request_timeout;
+}
+
+LIBRATBAG_EXPORT int
+ratbag_set_cache_dir(struct ratbag *ratbag, const char *path)
+{
+	char *dir = NULL;
+
+	if (path) {
+		dir = strdup(path);
+		if (!dir)
+			return -ENOMEM;
+	}
+
+	free(ratbag->cache_dir);
+	ratbag->cache_dir = dir;
+
+	return 0;
+}
+
+LIBRATBAG_EXPORT const char *
+ratbag_get_cache_dir(const struct ratbag *ratbag)
+{
+	return ratbag->cache_dir;
+}
+
 LIBRATBAG_EXPORT void
 ratbag_log_set_handler(struct ratbag *ratbag,
 		       ratbag_log_handler log_handler)
@@ -153,33 +184,55 @@ ratbag_device_set_hidraw_device(struct ratbag_device *device,
 		  udev_device_get_syspath(hidraw));
 }
 
-static inline struct udev_device *
-udev_device_from_devnode(struct ratbag *ratbag, int fd)
+/* the longest sleep between two checks whether a device is ready */
+#define RATBAG_READY_MAX_DELAY_US		20000
+
+static int
+ratbag_device_is_ready(void *data)
 {
-	struct udev_device *dev;
-	struct stat st;
-	size_t count = 0;
-	struct udev *udev = ratbag->udev;
+	struct ratbag_device *device = data;
+	int rc;
 
-	if (fstat(fd, &st) < 0)
-		return NULL;
+	rc = device->driver->is_ready(device);
+	if (rc)
+		device->stats.retries++;
 
-	dev = udev_device_new_from_devnum(ratbag->udev, 'c', st.st_rdev);
+	return rc;
+}
 
-	while (dev && !udev_device_get_is_initialized(dev)) {
-		udev_device_unref(dev);
-		msleep(10);
-		dev = udev_device_new_from_devnum(udev, 'c', st.st_rdev);
+int
+ratbag_device_wait_ready(struct ratbag_device *device)
+{
+	unsigned int timeout = ratbag_device_get_request_timeout(device);
+	int64_t elapsed;
 
-		count++;
-		if (count > 50) {
-			log_bug_libratbag(ratbag,
-					  "udev device never initialized\n");
-			break;
-		}
+	if (!device->driver || !device->driver->is_ready)
+		return 0;
+
+	/* start at half the known settle time, so the estimate can go
+	 * down again if the device gets faster */
+	elapsed = poll_backoff(ratbag_device_is_ready, device,
+			       device->settle_time / 2,
+			       RATBAG_READY_MAX_DELAY_US,
+			       timeout * 1000);
+	if (elapsed < 0) {
+		log_error(device->ratbag,
+			  "%s: device not ready after %dms\n",
+			  device->name, timeout);
+		return elapsed;
 	}
 
-	return dev;
+	/* a running average, a single slow answer should not make every
+	 * following wait longer */
+	if (device->settle_time)
+		device->settle_time = (device->settle_time * 3 + elapsed) / 4;
+	else
+		device->settle_time = elapsed;
+
+	log_raw(device->ratbag, "%s: ready after %dus, settle time %dus\n",
+		device->name, (int)elapsed, device->settle_time);
+
+	return 0;
 }
 
 static struct udev_device *
@@ -229,14 +282,18 @@ out:
 
 static int
 ratbag_device_init_udev(struct ratbag_device *device,
-			struct udev_device *udev_device)
+			struct udev_device *udev_device,
+			struct udev_device *hidraw)
 {
 	struct udev_device *hidraw_udev;
 	int rc = -ENODEV;
 
 	device->udev_device = udev_device_ref(udev_device);
 
-	hidraw_udev = udev_find_hidraw(device);
+	if (hidraw)
+		hidraw_udev = udev_device_ref(hidraw);
+	else
+		hidraw_udev = udev_find_hidraw(device);
 	if (!hidraw_udev)
 		goto out;
 
@@ -258,8 +315,8 @@ static void
 ratbag_device_init(struct ratbag_device *device)
 {
 	device->hidraw_fd = -1;
+	device->transport = &ratbag_hidraw_transport;
 	device->refcount = 1;
-	list_init(&device->profiles);
 }
 
 static inline bool
@@ -271,39 +328,227 @@ ratbag_match_id(const struct input_id *dev_id, const struct input_id *match_id)
 		(match_id->version == VERSION_ANY || match_id->version == dev_id->version);
 }
 
+static inline bool
+ratbag_id_has_wildcard(const struct input_id *id)
+{
+	return id->bustype == BUS_ANY ||
+		id->vendor == VENDOR_ANY ||
+		id->product == PRODUCT_ANY;
+}
+
+static int
+ratbag_driver_match_cmp(const void *a, const void *b)
+{
+	const struct ratbag_driver_match *ma = a, *mb = b;
+	const struct input_id *ia = &ma->id.id, *ib = &mb->id.id;
+	bool wa = ratbag_id_has_wildcard(ia), wb = ratbag_id_has_wildcard(ib);
+
+	if (wa != wb)
+		return wa ? 1 : -1;
+	/* the wildcards keep the order of their drivers */
+	if (!wa) {
+		if (ia->bustype != ib->bustype)
+			return ia->bustype < ib->bustype ? -1 : 1;
+		if (ia->vendor != ib->vendor)
+			return ia->vendor < ib->vendor ? -1 : 1;
+		if (ia->product != ib->product)
+			return ia->product < ib->product ? -1 : 1;
+	}
+	if (ma->order != mb->order)
+		return ma->order < mb->order ? -1 : 1;
+
+	return 0;
+}
+
+static inline bool
+ratbag_id_is_end(const struct ratbag_id *id)
+{
+	return id->id.bustype == 0 && id->id.vendor == 0 &&
+		id->id.product == 0 && id->id.version == 0;
+}
+
+/**
+ * Merge the id tables of the registered drivers into one sorted index,
+ * so a device is matched with a binary search instead of walking every
+ * table.
+ */
+static int
+ratbag_build_driver_index(struct ratbag *ratbag)
+{
+	struct ratbag_driver *driver;
+	const struct ratbag_id *id;
+	struct ratbag_driver_match *index;
+	size_t count = 0, i;
+
+	list_for_each(driver, &ratbag->drivers, link) {
+		for (id = driver->table_ids; !ratbag_id_is_end(id); id++)
+			count++;
+	}
+
+	/* one more, so an empty index is not NULL */
+	index = zalloc((count + 1) * sizeof(*index));
+	if (!index)
+		return -ENOMEM;
+
+	count = 0;
+	list_for_each(driver, &ratbag->drivers, link) {
+		for (id = driver->table_ids; !ratbag_id_is_end(id); id++) {
+			index[count].id = *id;
+			index[count].driver = driver;
+			index[count].order = count;
+			count++;
+		}
+	}
+
+	qsort(index, count, sizeof(*index), ratbag_driver_match_cmp);
+
+	for (i = 0; i < count; i++) {
+		if (ratbag_id_has_wildcard(&index[i].id.id))
+			break;
+	}
+
+	ratbag->driver_index = index;
+	ratbag->num_ids = count;
+	ratbag->num_exact_ids = i;
+
+	return 0;
+}
+
+static inline bool
+ratbag_driver_match_has_ids(const struct ratbag_driver_match *match,
+			    const struct input_id *dev_id)
+{
+	return match->id.id.bustype == dev_id->bustype &&
+		match->id.id.vendor == dev_id->vendor &&
+		match->id.id.product == dev_id->product;
+}
+
+/**
+ * @return the first entry of the index with the bus, vendor and product
+ * of the device, or NULL if none has them. The entries with the same ids
+ * follow it.
+ */
+static const struct ratbag_driver_match *
+ratbag_driver_index_lookup(struct ratbag *ratbag, const struct input_id *dev_id)
+{
+	const struct ratbag_driver_match *index = ratbag->driver_index;
+	size_t lo = 0, hi = ratbag->num_exact_ids;
+
+	while (lo < hi) {
+		size_t mid = lo + (hi - lo) / 2;
+		const struct input_id *id = &index[mid].id.id;
+
+		if (id->bustype < dev_id->bustype ||
+		    (id->bustype == dev_id->bustype &&
+		     (id->vendor < dev_id->vendor ||
+		      (id->vendor == dev_id->vendor &&
+		       id->product < dev_id->product))))
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+
+	if (lo == ratbag->num_exact_ids)
+		return NULL;
+
+	if (!ratbag_driver_match_has_ids(&index[lo], dev_id))
+		return NULL;
+
+	return &index[lo];
+}
+
+/**
+ * @return true if a driver may handle the device, without talking to it
+ */
+static bool
+ratbag_has_driver(struct ratbag *ratbag, const struct input_id *dev_id)
+{
+	const struct ratbag_driver_match *match, *end;
+	size_t i;
+
+	end = &ratbag->driver_index[ratbag->num_exact_ids];
+	match = ratbag_driver_index_lookup(ratbag, dev_id);
+	for (; match && match < end; match++) {
+		if (!ratbag_driver_match_has_ids(match, dev_id))
+			break;
+		if (ratbag_match_id(dev_id, &match->id.id))
+			return true;
+	}
+
+	for (i = ratbag->num_exact_ids; i < ratbag->num_ids; i++) {
+		if (ratbag_match_id(dev_id, &ratbag->driver_index[i].id.id))
+			return true;
+	}
+
+	return false;
+}
+
+/**
+ * Probe a driver for the device, see ratbag_find_driver().
+ *
+ * @return 0 on success, -ENODEV if the driver does not handle the
+ * device, or another negative errno to stop looking further
+ */
+static int
+ratbag_try_driver(struct ratbag_device *device,
+		  const struct input_id *dev_id,
+		  const struct ratbag_driver_match *match)
+{
+	struct ratbag *ratbag = device->ratbag;
+	struct ratbag_id matched_id;
+	int rc;
+
+	log_debug(ratbag, "trying driver '%s'\n", match->driver->name);
+
+	matched_id.id = *dev_id;
+	matched_id.data = match->id.data;
+	device->driver = match->driver;
+	rc = match->driver->probe(device, matched_id);
+	if (rc == 0) {
+		log_debug(ratbag, "driver match found\n");
+		return 0;
+	}
+
+	device->driver = NULL;
+
+	return rc;
+}
+
 static struct ratbag_driver *
 ratbag_find_driver(struct ratbag_device *device, const struct input_id *dev_id)
 {
 	struct ratbag *ratbag = device->ratbag;
-	struct ratbag_driver *driver;
-	const struct ratbag_id *matching_id;
-	struct ratbag_id matched_id;
+	const struct ratbag_driver_match *match, *end;
+	size_t i;
 	int rc;
 
-	list_for_each(driver, &ratbag->drivers, link) {
-		log_debug(ratbag, "trying driver '%s'\n", driver->name);
-		matching_id = driver->table_ids;
-		do {
-			if (ratbag_match_id(dev_id, &matching_id->id)) {
-				matched_id.id = *dev_id;
-				matched_id.data = matching_id->data;
-				device->driver = driver;
-				rc = driver->probe(device, matched_id);
-				if (rc == 0) {
-					log_debug(ratbag, "driver match found\n");
-					return driver;
-				}
-
-				device->driver = NULL;
-
-				if (rc != -ENODEV)
-					return NULL;
-			}
-			matching_id++;
-		} while (matching_id->id.bustype != 0 ||
-			 matching_id->id.vendor != 0 ||
-			 matching_id->id.product != 0 ||
-			 matching_id->id.version != 0);
+	/* the exact ids first, in the order the drivers were registered */
+	end = &ratbag->driver_index[ratbag->num_exact_ids];
+	match = ratbag_driver_index_lookup(ratbag, dev_id);
+	for (; match && match < end; match++) {
+		if (!ratbag_driver_match_has_ids(match, dev_id))
+			break;
+
+		if (!ratbag_match_id(dev_id, &match->id.id))
+			continue;
+
+		rc = ratbag_try_driver(device, dev_id, match);
+		if (rc == 0)
+			return match->driver;
+		if (rc != -ENODEV)
+			return NULL;
+	}
+
+	for (i = ratbag->num_exact_ids; i < ratbag->num_ids; i++) {
+		match = &ratbag->driver_index[i];
+		if (!ratbag_match_id(dev_id, &match->id.id))
+			continue;
+
+		rc = ratbag_try_driver(device, dev_id, match);
+		if (rc == 0)
+			return match->driver;
+		if (rc != -ENODEV)
+			return NULL;
 	}
 
 	return NULL;
@@ -342,9 +587,29 @@ get_product_id(struct udev_device *device, struct input_id *id)
 	return 0;
 }
 
+bool
+ratbag_udev_device_is_supported(struct ratbag *ratbag,
+				struct udev_device *udev_device)
+{
+	struct input_id ids;
+
+	if (get_product_id(udev_device, &ids) != 0)
+		return false;
+
+	return ratbag_has_driver(ratbag, &ids);
+}
+
 LIBRATBAG_EXPORT struct ratbag_device*
 ratbag_device_new_from_udev_device(struct ratbag *ratbag,
 				   struct udev_device *udev_device)
+{
+	return ratbag_device_new_from_udev_devices(ratbag, udev_device, NULL);
+}
+
+struct ratbag_device*
+ratbag_device_new_from_udev_devices(struct ratbag *ratbag,
+				    struct udev_device *udev_device,
+				    struct udev_device *hidraw)
 {
 	int rc;
 	struct ratbag_device *device = NULL;
@@ -362,6 +627,12 @@ ratbag_device_new_from_udev_device(struct ratbag *ratbag,
 	device->ratbag = ratbag_ref(ratbag);
 	if (get_product_id(udev_device, &device->ids) != 0)
 		goto out_err;
+
+	/* don't look any further at devices no driver knows */
+	if (!ratbag_has_driver(ratbag, &device->ids)) {
+		errno = ENOTSUP;
+		goto out_err;
+	}
 	free(device->name);
 	device->name = get_device_name(udev_device);
 	if (!device->name) {
@@ -370,7 +641,7 @@ ratbag_device_new_from_udev_device(struct ratbag *ratbag,
 	}
 
 	ratbag_device_init(device);
-	rc = ratbag_device_init_udev(device, udev_device);
+	rc = ratbag_device_init_udev(device, udev_device, hidraw);
 	if (rc)
 		goto out_err;
 
@@ -383,6 +654,8 @@ ratbag_device_new_from_udev_device(struct ratbag *ratbag,
 	return device;
 
 err_udev:
+	/* a driver may have opened the device before failing its probe */
+	ratbag_close_hidraw(device);
 	udev_device_unref(device->udev_device);
 	udev_device_unref(device->udev_hidraw);
 out_err:
@@ -394,6 +667,53 @@ out_err:
 	return NULL;
 }
 
+struct ratbag_device *
+ratbag_device_new_from_transport(struct ratbag *ratbag,
+				 const char *name,
+				 const struct input_id *ids,
+				 const struct ratbag_transport *transport,
+				 void *transport_data)
+{
+	struct ratbag_device *device;
+	struct ratbag_driver *driver;
+
+	if (!ratbag_has_driver(ratbag, ids)) {
+		errno = ENOTSUP;
+		return NULL;
+	}
+
+	device = zalloc(sizeof(*device));
+	if (!device)
+		return NULL;
+
+	device->ratbag = ratbag_ref(ratbag);
+	device->ids = *ids;
+	device->name = strdup(name);
+	if (!device->name) {
+		errno = ENOMEM;
+		goto out_err;
+	}
+
+	ratbag_device_init(device);
+	device->transport = transport;
+	device->transport_data = transport_data;
+
+	driver = ratbag_find_driver(device, &device->ids);
+	if (!driver) {
+		errno = ENOTSUP;
+		goto out_err;
+	}
+
+	return device;
+
+out_err:
+	ratbag_close_hidraw(device);
+	device->ratbag = ratbag_unref(device->ratbag);
+	free(device->name);
+	free(device);
+	return NULL;
+}
+
 LIBRATBAG_EXPORT struct ratbag_device *
 ratbag_device_ref(struct ratbag_device *device)
 {
@@ -404,7 +724,6 @@ ratbag_device_ref(struct ratbag_device *device)
 LIBRATBAG_EXPORT struct ratbag_device *
 ratbag_device_unref(struct ratbag_device *device)
 {
-	struct ratbag_profile *profile, *next;
 	if (device == NULL)
 		return NULL;
 
@@ -416,15 +735,16 @@ ratbag_device_unref(struct ratbag_device *device)
 	if (device->driver->remove)
 		device->driver->remove(device);
 
-	/* the profiles are created during probe(), we should unref them */
-	list_for_each_safe(profile, next, &device->profiles, link)
-		ratbag_profile_unref(profile);
+	/* the profiles, buttons and resolutions hold a reference to the
+	 * device, none of them is in use anymore */
+	free(device->profiles);
 
 	udev_device_unref(device->udev_device);
 	udev_device_unref(device->udev_hidraw);
 
-	if (device->hidraw_fd >= 0)
-		close(device->hidraw_fd);
+	ratbag_close_hidraw(device);
+	if (device->transport->destroy)
+		device->transport->destroy(device);
 
 	device->ratbag = ratbag_unref(device->ratbag);
 	free(device->name);
@@ -432,6 +752,45 @@ ratbag_device_unref(struct ratbag_device *device)
 	return NULL;
 }
 
+LIBRATBAG_EXPORT void
+ratbag_device_get_stats(struct ratbag_device *device,
+			struct ratbag_stats *stats)
+{
+	*stats = device->stats;
+}
+
+LIBRATBAG_EXPORT unsigned int
+ratbag_stats_get_latency_percentile(const struct ratbag_stats *stats,
+				    enum ratbag_stats_class request_class,
+				    unsigned int percentile)
+{
+	const struct ratbag_stats_requests *r;
+	uint64_t total = 0, rank, seen = 0;
+	unsigned int i;
+
+	if (request_class >= RATBAG_STATS_NUM_CLASSES || percentile > 100)
+		return 0;
+
+	r = &stats->requests[request_class];
+	for (i = 0; i < RATBAG_STATS_LATENCY_BUCKETS; i++)
+		total += r->latency[i];
+	if (total == 0)
+		return 0;
+
+	/* the rank of the request at this percentile, 1-based */
+	rank = (total * percentile + 99) / 100;
+	if (rank == 0)
+		rank = 1;
+
+	for (i = 0; i < RATBAG_STATS_LATENCY_BUCKETS - 1; i++) {
+		seen += r->latency[i];
+		if (seen >= rank)
+			break;
+	}
+
+	return (2U << i) - 1;
+}
+
 LIBRATBAG_EXPORT const char *
 ratbag_device_get_name(const struct ratbag_device* device)
 {
@@ -473,12 +832,20 @@ ratbag_create_context(const struct ratbag_interface *interface,
 	ratbag->userdata = userdata;
 
 	list_init(&ratbag->drivers);
+	list_init(&ratbag->hidraw_nodes);
 	ratbag->udev = udev_new();
 	if (!ratbag->udev) {
 		free(ratbag);
 		return NULL;
 	}
 
+	ratbag->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+	if (ratbag->epoll_fd < 0) {
+		udev_unref(ratbag->udev);
+		free(ratbag);
+		return NULL;
+	}
+
 	ratbag->log_handler = ratbag_default_log_func;
 	ratbag->log_priority = RATBAG_LOG_PRIORITY_INFO;
 
@@ -486,6 +853,13 @@ ratbag_create_context(const struct ratbag_interface *interface,
 	ratbag_register_driver(ratbag, &hidpp20_driver);
 	ratbag_register_driver(ratbag, &hidpp10_driver);
 
+	if (ratbag_build_driver_index(ratbag) != 0) {
+		close(ratbag->epoll_fd);
+		udev_unref(ratbag->udev);
+		free(ratbag);
+		return NULL;
+	}
+
 	return ratbag;
 }
 
@@ -508,90 +882,125 @@ ratbag_unref(struct ratbag *ratbag)
 		return ratbag;
 
 	ratbag->udev = udev_unref(ratbag->udev);
+	close(ratbag->epoll_fd);
+	free(ratbag->driver_index);
+	free(ratbag->cache_dir);
+	ratbag_capture_destroy(ratbag);
 	free(ratbag);
 
 	return NULL;
 }
 
-static struct ratbag_button *
-ratbag_create_button(struct ratbag_profile *profile, unsigned int index)
+LIBRATBAG_EXPORT int
+ratbag_get_fd(const struct ratbag *ratbag)
 {
-	struct ratbag_device *device = profile->device;
-	struct ratbag_button *button;
+	return ratbag->epoll_fd;
+}
 
-	button = zalloc(sizeof(*button));
-	if (!button)
-		return NULL;
+LIBRATBAG_EXPORT int
+ratbag_dispatch(struct ratbag *ratbag)
+{
+	struct epoll_event ep[32];
+	int i, count;
 
-	button->refcount = 1;
-	button->profile = profile;
-	button->index = index;
+	count = epoll_wait(ratbag->epoll_fd, ep, ARRAY_LENGTH(ep), 0);
+	if (count < 0)
+		return -errno;
 
-	if (profile)
-		list_insert(&profile->buttons, &button->link);
+	for (i = 0; i < count; i++) {
+		struct ratbag_hidraw_node *node = ep[i].data.ptr;
 
-	if (device->driver->read_button)
-		device->driver->read_button(button);
+		ratbag_hidraw_dispatch(node);
+	}
 
-	return button;
+	return 0;
 }
 
-static int
+static void
 ratbag_profile_init_buttons(struct ratbag_profile *profile, unsigned int count)
 {
+	struct ratbag_device *device = profile->device;
+	struct ratbag_button *button;
 	unsigned int i;
 
-	for (i = 0; i < count; i++)
-		ratbag_create_button(profile, i);
+	for (i = 0; i < count; i++) {
+		button = &profile->buttons[i];
+		button->profile = profile;
+		button->index = i;
 
-	profile->device->num_buttons = count;
-
-	return 0;
+		if (device->driver->read_button)
+			device->driver->read_button(button);
+	}
 }
 
-static struct ratbag_profile *
-ratbag_create_profile(struct ratbag_device *device,
-		      unsigned int index,
-		      unsigned int num_buttons)
+static void
+ratbag_profile_init(struct ratbag_profile *profile,
+		    struct ratbag_device *device,
+		    unsigned int index,
+		    struct ratbag_button *buttons)
 {
-	struct ratbag_profile *profile;
 	unsigned i;
 
-	profile = zalloc(sizeof(*profile));
-	if (!profile)
-		return NULL;
-
-	profile->refcount = 1;
 	profile->device = device;
 	profile->index = index;
-
-	list_insert(&device->profiles, &profile->link);
-	list_init(&profile->buttons);
+	profile->buttons = buttons;
 
 	for (i = 0; i < MAX_RESOLUTIONS; i++)
 		ratbag_resolution_init(profile, i, 0, 0);
 	profile->resolution.num_modes = 1;
+}
+
+/* profiles are only read from the device when first needed, opening a
+ * device does not wait for the profiles the caller never looks at */
+static void
+ratbag_profile_load(struct ratbag_profile *profile)
+{
+	struct ratbag_device *device = profile->device;
+
+	if (profile->is_loaded)
+		return;
 
 	assert(device->driver->read_profile);
-	device->driver->read_profile(profile, index);
+	device->driver->read_profile(profile, profile->index);
 
-	ratbag_profile_init_buttons(profile, num_buttons);
+	ratbag_profile_init_buttons(profile, device->num_buttons);
 
-	return profile;
+	profile->is_loaded = true;
 }
 
+/* The profiles, their buttons and their resolutions live in one
+ * allocation, the lookups are array indexing. They are owned by the
+ * device: a reference to one of them is a reference to the device, the
+ * memory goes away with the device. */
 int
 ratbag_device_init_profiles(struct ratbag_device *device,
 			    unsigned int num_profiles,
 			    unsigned int num_buttons)
 {
+	struct ratbag_profile *profiles;
+	struct ratbag_button *buttons;
 	unsigned int i;
 
-	for (i = 0; i < num_profiles; i++) {
-		ratbag_create_profile(device, i, num_buttons);
+	if (device->profiles) {
+		log_bug_libratbag(device->ratbag,
+				  "%s: profiles initialized twice\n",
+				  device->name);
+		return -EINVAL;
 	}
 
+	profiles = zalloc(num_profiles * sizeof(*profiles) +
+			  num_profiles * num_buttons * sizeof(*buttons));
+	if (!profiles)
+		return -ENOMEM;
+
+	buttons = (struct ratbag_button *)&profiles[num_profiles];
+	for (i = 0; i < num_profiles; i++)
+		ratbag_profile_init(&profiles[i], device, i,
+				    &buttons[i * num_buttons]);
+
+	device->profiles = profiles;
 	device->num_profiles = num_profiles;
+	device->num_buttons = num_buttons;
 
 	return 0;
 }
@@ -599,6 +1008,7 @@ ratbag_device_init_profiles(struct ratbag_device *device,
 LIBRATBAG_EXPORT struct ratbag_profile *
 ratbag_profile_ref(struct ratbag_profile *profile)
 {
+	ratbag_device_ref(profile->device);
 	profile->refcount++;
 	return profile;
 }
@@ -606,24 +1016,18 @@ ratbag_profile_ref(struct ratbag_profile *profile)
 LIBRATBAG_EXPORT struct ratbag_profile *
 ratbag_profile_unref(struct ratbag_profile *profile)
 {
-	struct ratbag_button *button, *next;
+	struct ratbag_profile *remaining;
 
 	if (profile == NULL)
 		return NULL;
 
 	assert(profile->refcount > 0);
 	profile->refcount--;
-	if (profile->refcount > 0)
-		return profile;
-
-	/* the buttons are created by the profile, so we clean them up */
-	list_for_each_safe(button, next, &profile->buttons, link)
-		ratbag_button_unref(button);
+	/* the device stays while any of its objects is referenced */
+	remaining = profile->refcount > 0 ? profile : NULL;
+	ratbag_device_unref(profile->device);
 
-	list_remove(&profile->link);
-	free(profile);
-
-	return NULL;
+	return remaining;
 }
 
 LIBRATBAG_EXPORT struct ratbag_profile *
@@ -634,14 +1038,33 @@ ratbag_device_get_profile_by_index(struct ratbag_device *device, unsigned int in
 	if (index >= ratbag_device_get_num_profiles(device))
 		return NULL;
 
-	list_for_each(profile, &device->profiles, link) {
-		if (profile->index == index)
-			return ratbag_profile_ref(profile);
+	profile = &device->profiles[index];
+	ratbag_profile_load(profile);
+
+	return ratbag_profile_ref(profile);
+}
+
+LIBRATBAG_EXPORT int
+ratbag_device_prefetch_profile(struct ratbag_device *device)
+{
+	struct ratbag_profile *profile, *next = NULL;
+	unsigned int remaining = 0;
+
+	ratbag_device_for_each_profile(device, profile) {
+		if (profile->is_loaded)
+			continue;
+
+		remaining++;
+		if (!next || profile->is_active)
+			next = profile;
 	}
 
-	log_bug_libratbag(device->ratbag, "Profile %d not found\n", index);
+	if (!next)
+		return 0;
 
-	return NULL;
+	ratbag_profile_load(next);
+
+	return remaining > 1;
 }
 
 LIBRATBAG_EXPORT int
@@ -684,17 +1107,12 @@ ratbag_device_has_capability(const struct ratbag_device *device,
 	return device->driver->has_capability(device, cap);
 }
 
-LIBRATBAG_EXPORT int
-ratbag_profile_set_active(struct ratbag_profile *profile)
+static int
+ratbag_profile_activate(struct ratbag_profile *profile)
 {
 	struct ratbag_device *device = profile->device;
 	struct ratbag_profile *p;
-	int rc;
-
-	assert(device->driver->write_profile);
-	rc = device->driver->write_profile(profile);
-	if (rc)
-		return rc;
+	int rc = 0;
 
 	if (ratbag_device_has_capability(device, RATBAG_CAP_SWITCHABLE_PROFILE)) {
 		assert(device->driver->set_active_profile);
@@ -704,13 +1122,89 @@ ratbag_profile_set_active(struct ratbag_profile *profile)
 	if (rc)
 		return rc;
 
-	list_for_each(p, &device->profiles, link) {
+	ratbag_device_for_each_profile(device, p)
 		p->is_active = false;
-	}
 	profile->is_active = true;
 	return rc;
 }
 
+LIBRATBAG_EXPORT int
+ratbag_profile_set_active(struct ratbag_profile *profile)
+{
+	struct ratbag_device *device = profile->device;
+	int rc;
+
+	if (device->in_transaction) {
+		profile->is_dirty = true;
+		device->pending_active = profile;
+		return 0;
+	}
+
+	assert(device->driver->write_profile);
+	rc = device->driver->write_profile(profile);
+	if (rc)
+		return rc;
+
+	rc = ratbag_profile_activate(profile);
+	if (rc == 0)
+		device->pending_active = NULL;
+
+	return rc;
+}
+
+LIBRATBAG_EXPORT int
+ratbag_device_begin(struct ratbag_device *device)
+{
+	if (device->in_transaction)
+		return -EBUSY;
+
+	device->in_transaction = true;
+
+	return 0;
+}
+
+LIBRATBAG_EXPORT int
+ratbag_device_commit(struct ratbag_device *device)
+{
+	struct ratbag_profile *profile, *active;
+	int rc = 0, rc2;
+
+	if (!device->in_transaction)
+		return -EINVAL;
+
+	device->in_transaction = false;
+
+	/* one write per modified profile, however many changes it got. A
+	 * failed profile stays dirty for the next commit, the others are
+	 * still written. */
+	ratbag_device_for_each_profile(device, profile) {
+		if (!profile->is_dirty)
+			continue;
+
+		assert(device->driver->write_profile);
+		rc2 = device->driver->write_profile(profile);
+		if (rc2) {
+			if (rc == 0)
+				rc = rc2;
+			continue;
+		}
+
+		profile->is_dirty = false;
+	}
+
+	/* the activation waits until its profile is written */
+	active = device->pending_active;
+	if (active && !active->is_dirty) {
+		rc2 = ratbag_profile_activate(active);
+		if (rc2 == 0)
+			device->pending_active = NULL;
+		else if (rc == 0)
+			rc = rc2;
+	}
+
+	return rc;
+}
+
 
 LIBRATBAG_EXPORT int
 ratbag_profile_get_num_resolutions(struct ratbag_profile *profile)
@@ -735,6 +1229,7 @@ ratbag_profile_get_resolution(struct ratbag_profile *profile, unsigned int idx)
 LIBRATBAG_EXPORT struct ratbag_resolution *
 ratbag_resolution_ref(struct ratbag_resolution *resolution)
 {
+	ratbag_device_ref(resolution->profile->device);
 	resolution->refcount++;
 	return resolution;
 }
@@ -742,17 +1237,17 @@ ratbag_resolution_ref(struct ratbag_resolution *resolution)
 LIBRATBAG_EXPORT struct ratbag_resolution *
 ratbag_resolution_unref(struct ratbag_resolution *resolution)
 {
+	struct ratbag_resolution *remaining;
+
 	if (resolution == NULL)
 		return NULL;
 
 	assert(resolution->refcount > 0);
 	resolution->refcount--;
-	if (resolution->refcount > 0)
-		return resolution;
+	remaining = resolution->refcount > 0 ? resolution : NULL;
+	ratbag_device_unref(resolution->profile->device);
 
-	/* Resolution is a fixed list of structs, no freeing required */
-
-	return NULL;
+	return remaining;
 }
 
 LIBRATBAG_EXPORT int
@@ -760,10 +1255,16 @@ ratbag_resolution_set_dpi(struct ratbag_resolution *resolution,
 			  unsigned int dpi)
 {
 	struct ratbag_profile *profile = resolution->profile;
+	int rc;
+
 	resolution->dpi = dpi;
 
 	assert(profile->device->driver->write_resolution_dpi);
-	return profile->device->driver->write_resolution_dpi(resolution, dpi);
+	rc = profile->device->driver->write_resolution_dpi(resolution, dpi);
+	if (rc == 0 && profile->device->in_transaction)
+		profile->is_dirty = true;
+
+	return rc;
 }
 
 LIBRATBAG_EXPORT int
@@ -821,20 +1322,29 @@ ratbag_profile_get_button_by_index(struct ratbag_profile *profile,
 				   unsigned int index)
 {
 	struct ratbag_device *device = profile->device;
-	struct ratbag_button *button;
 
 	if (index >= ratbag_device_get_num_buttons(device))
 		return NULL;
 
-	list_for_each(button, &profile->buttons, link) {
-		if (button->index == index)
-			return ratbag_button_ref(button);
-	}
+	return ratbag_button_ref(&profile->buttons[index]);
+}
 
-	log_bug_libratbag(device->ratbag, "Button %d, profile %d not found\n",
-			  index, profile->index);
+static int
+ratbag_button_write(struct ratbag_button *button,
+		    const struct ratbag_button_action *action)
+{
+	struct ratbag_profile *profile = button->profile;
+	int rc;
 
-	return NULL;
+	rc = profile->device->driver->write_button(button, action);
+	if (rc)
+		return rc;
+
+	button->action = *action;
+	if (profile->device->in_transaction)
+		profile->is_dirty = true;
+
+	return rc;
 }
 
 LIBRATBAG_EXPORT enum ratbag_button_type
@@ -870,7 +1380,7 @@ ratbag_button_set_button(struct ratbag_button *button, unsigned int btn)
 	action.type = RATBAG_BUTTON_ACTION_TYPE_BUTTON;
 	action.action.button = btn;
 
-	rc = button->profile->device->driver->write_button(button, &action);
+	rc = ratbag_button_write(button, &action);
 
 	return rc;
 }
@@ -899,7 +1409,7 @@ ratbag_button_set_special(struct ratbag_button *button,
 	action.type = RATBAG_BUTTON_ACTION_TYPE_SPECIAL;
 	action.action.special = act;
 
-	rc = button->profile->device->driver->write_button(button, &action);
+	rc = ratbag_button_write(button, &action);
 
 	return rc;
 }
@@ -935,7 +1445,7 @@ ratbag_button_set_key(struct ratbag_button *button,
 
 	action.type = RATBAG_BUTTON_ACTION_TYPE_KEY;
 	action.action.key.key = key;
-	rc = button->profile->device->driver->write_button(button, &action);
+	rc = ratbag_button_write(button, &action);
 
 	return rc;
 }
@@ -950,7 +1460,7 @@ ratbag_button_disable(struct ratbag_button *button)
 		return -1;
 
 	action.type = RATBAG_BUTTON_ACTION_TYPE_NONE;
-	rc = button->profile->device->driver->write_button(button, &action);
+	rc = ratbag_button_write(button, &action);
 
 	return rc;
 }
@@ -958,6 +1468,7 @@ ratbag_button_disable(struct ratbag_button *button)
 LIBRATBAG_EXPORT struct ratbag_button *
 ratbag_button_ref(struct ratbag_button *button)
 {
+	ratbag_device_ref(button->profile->device);
 	button->refcount++;
 	return button;
 }
@@ -965,18 +1476,236 @@ ratbag_button_ref(struct ratbag_button *button)
 LIBRATBAG_EXPORT struct ratbag_button *
 ratbag_button_unref(struct ratbag_button *button)
 {
+	struct ratbag_button *remaining;
+
 	if (button == NULL)
 		return NULL;
 
 	assert(button->refcount > 0);
 	button->refcount--;
-	if (button->refcount > 0)
-		return button;
+	remaining = button->refcount > 0 ? button : NULL;
+	ratbag_device_unref(button->profile->device);
 
-	list_remove(&button->link);
-	free(button);
+	return remaining;
+}
 
-	return NULL;
+static unsigned int
+ratbag_button_action_to_snapshot(const struct ratbag_button_action *action)
+{
+	switch (action->type) {
+	case RATBAG_BUTTON_ACTION_TYPE_BUTTON:
+		return action->action.button;
+	case RATBAG_BUTTON_ACTION_TYPE_SPECIAL:
+		return action->action.special;
+	case RATBAG_BUTTON_ACTION_TYPE_KEY:
+		return action->action.key.key;
+	default:
+		return 0;
+	}
+}
+
+static void
+ratbag_button_action_from_snapshot(struct ratbag_button_action *action,
+				   const struct ratbag_snapshot_button *b)
+{
+	memset(action, 0, sizeof(*action));
+	action->type = b->action_type;
+
+	switch (b->action_type) {
+	case RATBAG_BUTTON_ACTION_TYPE_BUTTON:
+		action->action.button = b->action;
+		break;
+	case RATBAG_BUTTON_ACTION_TYPE_SPECIAL:
+		action->action.special = b->action;
+		break;
+	case RATBAG_BUTTON_ACTION_TYPE_KEY:
+		action->action.key.key = b->action;
+		break;
+	default:
+		break;
+	}
+}
+
+_Static_assert(MAX_RESOLUTIONS <= RATBAG_SNAPSHOT_MAX_RESOLUTIONS,
+	       "A snapshot cannot hold all resolutions");
+
+LIBRATBAG_EXPORT int
+ratbag_device_get_snapshot(struct ratbag_device *device,
+			   struct ratbag_snapshot *snapshot)
+{
+	struct ratbag_profile *profile;
+	struct ratbag_snapshot_profile *p;
+	struct ratbag_snapshot_button *b;
+	unsigned int i, j;
+
+	if (snapshot->version != RATBAG_SNAPSHOT_VERSION)
+		return -EINVAL;
+
+	if (snapshot->num_profiles < device->num_profiles ||
+	    snapshot->num_buttons < device->num_buttons) {
+		snapshot->num_profiles = device->num_profiles;
+		snapshot->num_buttons = device->num_buttons;
+		return -ENOSPC;
+	}
+
+	snapshot->num_profiles = device->num_profiles;
+	snapshot->num_buttons = device->num_buttons;
+
+	ratbag_device_for_each_profile(device, profile) {
+		ratbag_profile_load(profile);
+
+		p = &snapshot->profiles[profile->index];
+		memset(p, 0, sizeof(*p));
+		p->is_active = profile->is_active;
+		p->num_resolutions = profile->resolution.num_modes;
+		for (i = 0; i < profile->resolution.num_modes; i++) {
+			struct ratbag_resolution *res = &profile->resolution.modes[i];
+
+			p->resolutions[i].dpi = res->dpi;
+			p->resolutions[i].hz = res->hz;
+			p->resolutions[i].is_active = res->is_active;
+			p->resolutions[i].is_default = res->is_default;
+		}
+
+		for (j = 0; j < device->num_buttons; j++) {
+			struct ratbag_button *button = &profile->buttons[j];
+
+			b = &snapshot->buttons[profile->index * device->num_buttons + j];
+			b->type = button->type;
+			b->action_type = button->action.type;
+			b->action = ratbag_button_action_to_snapshot(&button->action);
+		}
+	}
+
+	return 0;
+}
+
+static int
+ratbag_profile_check_snapshot(struct ratbag_profile *profile,
+			      const struct ratbag_snapshot_profile *p,
+			      const struct ratbag_snapshot_button *buttons)
+{
+	struct ratbag_device *device = profile->device;
+	unsigned int i;
+
+	if (p->num_resolutions != profile->resolution.num_modes)
+		return -EINVAL;
+
+	for (i = 0; i < profile->resolution.num_modes; i++) {
+		struct ratbag_resolution *res = &profile->resolution.modes[i];
+		const struct ratbag_snapshot_resolution *r = &p->resolutions[i];
+
+		if (r->dpi != res->dpi &&
+		    !device->driver->write_resolution_dpi)
+			return -ENOTSUP;
+
+		/* no driver writes these yet */
+		if (r->hz != res->hz ||
+		    r->is_active != res->is_active ||
+		    r->is_default != res->is_default)
+			return -ENOTSUP;
+	}
+
+	for (i = 0; i < device->num_buttons; i++) {
+		struct ratbag_button *button = &profile->buttons[i];
+		const struct ratbag_snapshot_button *b = &buttons[i];
+
+		if ((b->action_type != button->action.type ||
+		     b->action != ratbag_button_action_to_snapshot(&button->action)) &&
+		    !device->driver->write_button)
+			return -ENOTSUP;
+	}
+
+	return 0;
+}
+
+static int
+ratbag_profile_apply_snapshot(struct ratbag_profile *profile,
+			      const struct ratbag_snapshot_profile *p,
+			      const struct ratbag_snapshot_button *buttons)
+{
+	struct ratbag_device *device = profile->device;
+	struct ratbag_button_action action;
+	unsigned int i;
+	int rc;
+
+	for (i = 0; i < profile->resolution.num_modes; i++) {
+		struct ratbag_resolution *res = &profile->resolution.modes[i];
+		const struct ratbag_snapshot_resolution *r = &p->resolutions[i];
+
+		if (r->dpi != res->dpi) {
+			rc = ratbag_resolution_set_dpi(res, r->dpi);
+			if (rc)
+				return rc;
+		}
+	}
+
+	for (i = 0; i < device->num_buttons; i++) {
+		struct ratbag_button *button = &profile->buttons[i];
+		const struct ratbag_snapshot_button *b = &buttons[i];
+
+		if (b->action_type == button->action.type &&
+		    b->action == ratbag_button_action_to_snapshot(&button->action))
+			continue;
+
+		ratbag_button_action_from_snapshot(&action, b);
+		rc = ratbag_button_write(button, &action);
+		if (rc)
+			return rc;
+	}
+
+	if (p->is_active && !profile->is_active)
+		return ratbag_profile_set_active(profile);
+
+	return 0;
+}
+
+LIBRATBAG_EXPORT int
+ratbag_device_apply_snapshot(struct ratbag_device *device,
+			     const struct ratbag_snapshot *snapshot)
+{
+	struct ratbag_profile *profile;
+	const struct ratbag_snapshot_profile *p;
+	const struct ratbag_snapshot_button *buttons;
+	bool own_transaction;
+	int rc = 0, rc2;
+
+	if (snapshot->version != RATBAG_SNAPSHOT_VERSION ||
+	    snapshot->num_profiles != device->num_profiles ||
+	    snapshot->num_buttons != device->num_buttons)
+		return -EINVAL;
+
+	/* refuse the snapshot before anything is written */
+	ratbag_device_for_each_profile(device, profile) {
+		p = &snapshot->profiles[profile->index];
+		buttons = &snapshot->buttons[profile->index * device->num_buttons];
+
+		ratbag_profile_load(profile);
+		rc = ratbag_profile_check_snapshot(profile, p, buttons);
+		if (rc)
+			return rc;
+	}
+
+	/* every profile is written once, whatever changed in it */
+	own_transaction = !device->in_transaction;
+	if (own_transaction)
+		ratbag_device_begin(device);
+
+	ratbag_device_for_each_profile(device, profile) {
+		p = &snapshot->profiles[profile->index];
+		buttons = &snapshot->buttons[profile->index * device->num_buttons];
+		rc = ratbag_profile_apply_snapshot(profile, p, buttons);
+		if (rc)
+			break;
+	}
+
+	if (own_transaction) {
+		rc2 = ratbag_device_commit(device);
+		if (rc == 0)
+			rc = rc2;
+	}
+
+	return rc;
 }
 
 #define func_userdata(T) \
@@ -28,6 +28,7 @@
 extern "C" {
 #endif
 
+#include <stdint.h>
 #include <stdlib.h>
 #include <stdarg.h>
 #include <libudev.h>
@@ -99,6 +100,12 @@ typedef void (*ratbag_log_handler)(struct ratbag *ratbag,
  *
  * @defgroup button Button configuration
  *
+ * @defgroup monitor Device hotplug
+ *
+ * A monitor finds the supported devices present when it is created, and
+ * those plugged in later. The caller does not need to look for event
+ * nodes and create the devices itself.
+ *
  * @defgroup resolution Resolution and frequency mappings
  *
  * A device's sensor resolution and report rate can be configured per
@@ -124,6 +131,9 @@ typedef void (*ratbag_log_handler)(struct ratbag *ratbag,
  *
  * A ratbag context represents one single device. This struct is
  * refcounted, use ratbag_device_ref() and ratbag_device_unref().
+ *
+ * The profiles, buttons and resolutions of the device keep it alive: the
+ * device is only destroyed once all of them are released too.
  */
 struct ratbag_device;
 
@@ -258,6 +268,69 @@ ratbag_ref(struct ratbag *ratbag);
 struct ratbag *
 ratbag_unref(struct ratbag *ratbag);
 
+/**
+ * @ingroup base
+ *
+ * libratbag keeps a single file descriptor for all communication with the
+ * devices of this context. Use this file descriptor in the caller's main
+ * loop and call ratbag_dispatch() whenever it is readable.
+ *
+ * @param ratbag A previously initialized ratbag context
+ * @return The file descriptor used to notify the caller of pending events
+ */
+int
+ratbag_get_fd(const struct ratbag *ratbag);
+
+/**
+ * @ingroup base
+ *
+ * Process all pending events on the devices of this context. This
+ * function does not block, it is safe to call even if the fd returned by
+ * ratbag_get_fd() is not readable.
+ *
+ * @param ratbag A previously initialized ratbag context
+ * @return 0 on success, or a negative errno on failure
+ */
+int
+ratbag_dispatch(struct ratbag *ratbag);
+
+/**
+ * @ingroup base
+ *
+ * Record the reports sent to and received from the devices of this
+ * context, with their time. The capture keeps the given number of the
+ * most recent reports, older ones are overwritten. Recording a report is
+ * a copy, the capture can stay enabled to look into a problem after the
+ * fact.
+ *
+ * Enabling the capture again starts a new, empty one.
+ *
+ * @param ratbag A previously initialized ratbag context
+ * @param num_records The number of reports kept, 0 disables the capture
+ * @return 0 on success, or a negative errno on failure
+ *
+ * @see ratbag_capture_write
+ */
+int
+ratbag_capture_enable(struct ratbag *ratbag, unsigned int num_records);
+
+/**
+ * @ingroup base
+ *
+ * Write the reports captured so far to the file descriptor, in the
+ * pcapng format. Every device is an interface named after the device,
+ * the reports are stored as they are sent over hidraw.
+ *
+ * @param ratbag A previously initialized ratbag context
+ * @param fd The file descriptor to write to
+ * @return 0 on success, -ENODATA if the capture is not enabled, or a
+ * negative errno on failure
+ *
+ * @see ratbag_capture_enable
+ */
+int
+ratbag_capture_write(struct ratbag *ratbag, int fd);
+
 /**
  * @ingroup base
  *
@@ -270,6 +343,115 @@ struct ratbag_device*
 ratbag_device_new_from_udev_device(struct ratbag *ratbag,
 				   struct udev_device *device);
 
+/**
+ * @ingroup monitor
+ * @struct ratbag_monitor
+ *
+ * A monitor tracks the devices supported by libratbag as they come and
+ * go. This struct is refcounted, use ratbag_monitor_ref() and
+ * ratbag_monitor_unref().
+ */
+struct ratbag_monitor;
+
+/**
+ * @ingroup monitor
+ */
+enum ratbag_monitor_event {
+	/**
+	 * No event is pending.
+	 */
+	RATBAG_MONITOR_EVENT_NONE = 0,
+	/**
+	 * A supported device was plugged in, or was present when the
+	 * monitor was created.
+	 */
+	RATBAG_MONITOR_EVENT_DEVICE_ADDED,
+	/**
+	 * A device announced before was unplugged.
+	 */
+	RATBAG_MONITOR_EVENT_DEVICE_REMOVED,
+};
+
+/**
+ * @ingroup monitor
+ *
+ * Create a monitor for the devices of this context. The devices present
+ * already are probed immediately, each is announced by a @ref
+ * RATBAG_MONITOR_EVENT_DEVICE_ADDED event.
+ *
+ * Only the devices that arrive later are probed afterwards. A device with
+ * several event nodes is probed once.
+ *
+ * @param ratbag A previously initialized ratbag context
+ * @return A new monitor, or NULL on failure
+ */
+struct ratbag_monitor *
+ratbag_monitor_new(struct ratbag *ratbag);
+
+/**
+ * @ingroup monitor
+ *
+ * Add a reference to the monitor. A monitor is destroyed whenever the
+ * reference count reaches 0. See @ref ratbag_monitor_unref.
+ *
+ * @param monitor A previously initialized monitor
+ * @return The passed monitor
+ */
+struct ratbag_monitor *
+ratbag_monitor_ref(struct ratbag_monitor *monitor);
+
+/**
+ * @ingroup monitor
+ *
+ * Remove a reference from the monitor. The devices it created stay valid
+ * for as long as the caller holds a reference to them.
+ *
+ * @param monitor A previously initialized monitor
+ * @return NULL if the monitor was destroyed otherwise the passed monitor
+ */
+struct ratbag_monitor *
+ratbag_monitor_unref(struct ratbag_monitor *monitor);
+
+/**
+ * @ingroup monitor
+ *
+ * Use this file descriptor in the caller's main loop and call
+ * ratbag_monitor_dispatch() whenever it is readable.
+ *
+ * @param monitor A previously initialized monitor
+ * @return The file descriptor notifying the caller of hotplug events
+ */
+int
+ratbag_monitor_get_fd(const struct ratbag_monitor *monitor);
+
+/**
+ * @ingroup monitor
+ *
+ * Process the pending udev events and probe the devices that arrived.
+ * This function does not block. Fetch the resulting events with
+ * ratbag_monitor_get_event().
+ *
+ * @param monitor A previously initialized monitor
+ * @return 0 on success, or a negative errno on failure
+ */
+int
+ratbag_monitor_dispatch(struct ratbag_monitor *monitor);
+
+/**
+ * @ingroup monitor
+ *
+ * Fetch the next event, oldest first. The caller owns a reference to the
+ * device of the event and must unref it.
+ *
+ * @param monitor A previously initialized monitor
+ * @param[out] device Set to the device the event is about, or NULL
+ * @return The type of the event, or @ref RATBAG_MONITOR_EVENT_NONE if
+ * there is none
+ */
+enum ratbag_monitor_event
+ratbag_monitor_get_event(struct ratbag_monitor *monitor,
+			 struct ratbag_device **device);
+
 /**
  * @ingroup device
  *
@@ -384,6 +566,100 @@ ratbag_device_get_num_profiles(struct ratbag_device *device);
 unsigned int
 ratbag_device_get_num_buttons(struct ratbag_device *device);
 
+/**
+ * @ingroup device
+ *
+ * The number of buckets of the latency histograms in struct
+ * ratbag_stats_requests. Bucket n counts the requests that took 2^n to
+ * 2^(n+1) - 1 us, the last bucket also counts all slower ones.
+ */
+#define RATBAG_STATS_LATENCY_BUCKETS 24
+
+/**
+ * @ingroup device
+ *
+ * The number of HID++ error codes counted separately in struct
+ * ratbag_stats, the last one counts all higher codes.
+ */
+#define RATBAG_STATS_HIDPP_ERRORS 16
+
+/**
+ * @ingroup device
+ *
+ * The kinds of requests the statistics are kept for.
+ */
+enum ratbag_stats_class {
+	/** HID++ 1.0 register and memory accesses */
+	RATBAG_STATS_CLASS_HIDPP10 = 0,
+	/** HID++ 2.0 feature requests */
+	RATBAG_STATS_CLASS_HIDPP20,
+	/** reads and writes of HID feature reports */
+	RATBAG_STATS_CLASS_FEATURE_REPORT,
+	RATBAG_STATS_NUM_CLASSES,
+};
+
+/**
+ * @ingroup device
+ *
+ * The statistics of one class of requests.
+ */
+struct ratbag_stats_requests {
+	/** the requests the device answered, successfully or not */
+	uint64_t count;
+	/** the requests that failed, including the timeouts */
+	uint64_t errors;
+	/** the requests the device did not answer in time */
+	uint64_t timeouts;
+	/** the round-trip times of the answered requests */
+	uint64_t latency[RATBAG_STATS_LATENCY_BUCKETS];
+};
+
+/**
+ * @ingroup device
+ *
+ * The statistics of a device since it was created.
+ */
+struct ratbag_stats {
+	struct ratbag_stats_requests requests[RATBAG_STATS_NUM_CLASSES];
+	/** the HID++ errors answered by the device, by error code */
+	uint64_t hidpp_errors[RATBAG_STATS_HIDPP_ERRORS];
+	/** the times the device was asked again because it was busy */
+	uint64_t retries;
+	/** the input reports read while waiting for an answer that are not
+	 * of the driver's protocol, e.g. pointer motion. Notifications
+	 * are passed on to the driver and not counted. */
+	uint64_t discarded_reports;
+};
+
+/**
+ * @ingroup device
+ *
+ * Get the statistics of the requests sent to the device so far.
+ *
+ * @param device A previously initialized ratbag device
+ * @param[out] stats Filled in with the statistics
+ */
+void
+ratbag_device_get_stats(struct ratbag_device *device,
+			struct ratbag_stats *stats);
+
+/**
+ * @ingroup device
+ *
+ * Estimate a percentile of the round-trip times of a class of requests
+ * from its histogram.
+ *
+ * @param stats The statistics from ratbag_device_get_stats()
+ * @param request_class The class of requests
+ * @param percentile The percentile, from 0 to 100
+ * @return The upper bound in us of the histogram bucket the percentile
+ * falls into, or 0 if no request of this class was answered
+ */
+unsigned int
+ratbag_stats_get_latency_percentile(const struct ratbag_stats *stats,
+				    enum ratbag_stats_class request_class,
+				    unsigned int percentile);
+
 /**
  * @ingroup profile
  *
@@ -417,6 +693,10 @@ ratbag_profile_get_user_data(const struct ratbag_profile *profile);
  * index. The index must be less than the number returned by
  * ratbag_get_num_profiles().
  *
+ * Profiles are read from the device the first time they are requested,
+ * so this call may have to talk to the device. See
+ * ratbag_device_prefetch_profile() to read them ahead of time.
+ *
  * The profile is refcounted with an initial value of at least 1.
  * Use ratbag_profile_unref() to release the profile.
  *
@@ -431,6 +711,28 @@ ratbag_profile_get_user_data(const struct ratbag_profile *profile);
 struct ratbag_profile *
 ratbag_device_get_profile_by_index(struct ratbag_device *device, unsigned int index);
 
+/**
+ * @ingroup profile
+ *
+ * Read one profile from the device that has not been read yet, so that a
+ * later call to ratbag_device_get_profile_by_index() returns without
+ * talking to the device. If the active profile is known, it is read
+ * first.
+ *
+ * Each call reads at most one profile. A caller may call this from an
+ * idle handler until it returns 0 to read all profiles without blocking
+ * its main loop for long.
+ *
+ * @param device A previously initialized ratbag device
+ *
+ * @return 1 if more profiles remain to be read, 0 if all profiles have
+ * been read
+ *
+ * @see ratbag_device_get_profile_by_index
+ */
+int
+ratbag_device_prefetch_profile(struct ratbag_device *device);
+
 /**
  * @ingroup profile
  *
@@ -450,6 +752,9 @@ ratbag_profile_is_active(struct ratbag_profile *profile);
  *
  * Make the given profile the currently active profile
  *
+ * Inside a transaction, the profile only becomes active when the
+ * transaction is committed, see ratbag_device_begin().
+ *
  * @param profile The profile to make the active profile.
  *
  * @return 0 on success or nonzero otherwise.
@@ -457,6 +762,49 @@ ratbag_profile_is_active(struct ratbag_profile *profile);
 int
 ratbag_profile_set_active(struct ratbag_profile *profile);
 
+/**
+ * @ingroup device
+ *
+ * Start a transaction on the device. Until ratbag_device_commit() is
+ * called, changes to buttons, resolutions and the active profile are
+ * collected instead of being written to the device one by one. The commit
+ * then writes each modified profile once, so applying many changes costs
+ * about as much as applying a single one.
+ *
+ * The getters return the new values right away. If the device is
+ * released before the commit, the collected changes are lost.
+ *
+ * @param device A previously initialized ratbag device
+ *
+ * @return 0 on success, -EBUSY if a transaction is already in progress
+ *
+ * @see ratbag_device_commit
+ */
+int
+ratbag_device_begin(struct ratbag_device *device);
+
+/**
+ * @ingroup device
+ *
+ * Write the changes collected since ratbag_device_begin() to the device
+ * and end the transaction.
+ *
+ * If writing a profile fails, the other profiles are still written and
+ * the transaction is still ended. The changes that could not be written
+ * stay in the profiles and are written again by the next commit, and so
+ * is a profile activation that failed or whose profile could not be
+ * written.
+ *
+ * @param device A previously initialized ratbag device
+ *
+ * @return 0 on success, -EINVAL if no transaction is in progress, or the
+ * error of the failed write
+ *
+ * @see ratbag_device_begin
+ */
+int
+ratbag_device_commit(struct ratbag_device *device);
+
 /**
  * @ingroup profile
  *
@@ -1092,6 +1440,179 @@ ratbag_device_ref(struct ratbag_device *device);
 struct ratbag_device *
 ratbag_device_unref(struct ratbag_device *device);
 
+/**
+ * @ingroup device
+ *
+ * The layout of struct ratbag_snapshot this version of libratbag
+ * implements.
+ */
+#define RATBAG_SNAPSHOT_VERSION 1
+
+/**
+ * @ingroup device
+ *
+ * The number of resolutions a profile in a snapshot can hold.
+ */
+#define RATBAG_SNAPSHOT_MAX_RESOLUTIONS 16
+
+/**
+ * @ingroup device
+ *
+ * A resolution in a snapshot, see ratbag_resolution_get_dpi() and friends.
+ */
+struct ratbag_snapshot_resolution {
+	unsigned int dpi;
+	unsigned int hz;
+	int is_active;
+	int is_default;
+};
+
+/**
+ * @ingroup device
+ *
+ * A profile in a snapshot, with its resolutions.
+ */
+struct ratbag_snapshot_profile {
+	int is_active;
+	unsigned int num_resolutions;
+	struct ratbag_snapshot_resolution resolutions[RATBAG_SNAPSHOT_MAX_RESOLUTIONS];
+};
+
+/**
+ * @ingroup device
+ *
+ * A button of a profile in a snapshot.
+ */
+struct ratbag_snapshot_button {
+	/** read-only, ignored by ratbag_device_apply_snapshot() */
+	enum ratbag_button_type type;
+	enum ratbag_button_action_type action_type;
+	/** the button number, the enum ratbag_button_action_special or the
+	 * key code, depending on the action type. 0 otherwise */
+	unsigned int action;
+};
+
+/**
+ * @ingroup device
+ *
+ * The whole configuration of a device. The caller owns the struct and the
+ * arrays it points to.
+ */
+struct ratbag_snapshot {
+	/** set by the caller to RATBAG_SNAPSHOT_VERSION */
+	unsigned int version;
+	/** the number of elements of profiles */
+	unsigned int num_profiles;
+	struct ratbag_snapshot_profile *profiles;
+	/** the number of buttons per profile. buttons has num_profiles *
+	 * num_buttons elements, the buttons of profile n start at
+	 * n * num_buttons. */
+	unsigned int num_buttons;
+	struct ratbag_snapshot_button *buttons;
+};
+
+/**
+ * @ingroup device
+ *
+ * Fill in a snapshot with all profiles, resolutions and button actions of
+ * the device. The profiles not read from the device yet are read first.
+ *
+ * The caller sets the version and provides the arrays, with num_profiles
+ * and num_buttons set to their sizes. On return, num_profiles and
+ * num_buttons are set to the ones of the device, also if the arrays are
+ * too small to fill them in.
+ *
+ * @param device A previously initialized ratbag device
+ * @param snapshot The snapshot to fill in
+ *
+ * @return 0 on success, -EINVAL if the version is not supported, or
+ * -ENOSPC if the arrays are too small
+ */
+int
+ratbag_device_get_snapshot(struct ratbag_device *device,
+			   struct ratbag_snapshot *snapshot);
+
+/**
+ * @ingroup device
+ *
+ * Write a snapshot to the device. The resolutions, button actions and
+ * the active profile that differ from the current configuration are set
+ * as if by the matching function of the API, e.g.
+ * ratbag_resolution_set_dpi(), and the changes are written together, see
+ * ratbag_device_commit(). Within a transaction opened by the caller, the
+ * changes are only written by the caller's commit.
+ *
+ * The report rate and the active and default resolution cannot be
+ * written yet. A snapshot that differs in those, or in a value the
+ * device's driver cannot write, is refused with -ENOTSUP before anything
+ * is changed.
+ *
+ * The snapshot must have the layout of the device, as filled in by
+ * ratbag_device_get_snapshot().
+ *
+ * @param device A previously initialized ratbag device
+ * @param snapshot The configuration to write
+ *
+ * @return 0 on success, -EINVAL if the snapshot does not match the
+ * device, -ENOTSUP if it changes a value that cannot be written, or the
+ * error of the first change that failed. The changes before it are still
+ * written.
+ */
+int
+ratbag_device_apply_snapshot(struct ratbag_device *device,
+			     const struct ratbag_snapshot *snapshot);
+
+/**
+ * @ingroup device
+ *
+ * The formats ratbag_device_export() writes.
+ */
+enum ratbag_export_format {
+	/** compact and versioned, for ratbag_device_import() */
+	RATBAG_EXPORT_FORMAT_BINARY = 0,
+	/** for reading, cannot be imported */
+	RATBAG_EXPORT_FORMAT_JSON,
+};
+
+/**
+ * @ingroup device
+ *
+ * Write the profiles, resolutions and button actions of the device to a
+ * file, with the bus, vendor and product ids of the device. The profiles
+ * not read from the device yet are read first.
+ *
+ * @param device A previously initialized ratbag device
+ * @param fd The file descriptor to write to
+ * @param format The format to write
+ *
+ * @return 0 on success or a negative errno
+ */
+int
+ratbag_device_export(struct ratbag_device *device, int fd,
+		     enum ratbag_export_format format);
+
+/**
+ * @ingroup device
+ *
+ * Restore a configuration written by ratbag_device_export() in the binary
+ * format. Only the values that differ from the current ones are written,
+ * see ratbag_device_apply_snapshot().
+ *
+ * The dpi of the resolutions and the button actions are restored. The
+ * report rate, the active and default resolution and the active profile
+ * in the file are ignored, the device keeps its own.
+ *
+ * @param device A previously initialized ratbag device
+ * @param fd The file descriptor to read from
+ *
+ * @return 0 on success, -EINVAL if the file is not an export,
+ * -EPROTO if it is from an incompatible version of libratbag,
+ * -ENODEV if it is from another device model, or the error of
+ * ratbag_device_apply_snapshot()
+ */
+int
+ratbag_device_import(struct ratbag_device *device, int fd);
+
 /**
  * @ingroup base
  *
@@ -1147,6 +1668,70 @@ void
 ratbag_log_set_handler(struct ratbag *ratbag,
 		       ratbag_log_handler log_handler);
 
+/**
+ * @ingroup base
+ *
+ * Set the time a device has to answer a request, in ms. The whole
+ * exchange of a request and its answer must complete within this time,
+ * otherwise the request fails with -ETIMEDOUT.
+ *
+ * By default, each driver uses a timeout suitable for its devices. A
+ * timeout of 0 restores the default.
+ *
+ * @param ratbag A previously initialized ratbag context
+ * @param timeout The request timeout in ms, or 0 for the driver's default
+ *
+ * @see ratbag_get_request_timeout
+ */
+void
+ratbag_set_request_timeout(struct ratbag *ratbag, unsigned int timeout);
+
+/**
+ * @ingroup base
+ *
+ * Get the request timeout set by the caller.
+ *
+ * @param ratbag A previously initialized ratbag context
+ * @return The request timeout in ms, or 0 if the driver's default is used
+ *
+ * @see ratbag_set_request_timeout
+ */
+unsigned int
+ratbag_get_request_timeout(const struct ratbag *ratbag);
+
+/**
+ * @ingroup base
+ *
+ * Set a directory where the library may cache what it learns about a
+ * device while probing it, e.g. the list of features a device supports or
+ * the range of its sensors. On the next start, a device found in the cache
+ * only needs to confirm its firmware revision instead of being probed
+ * again. The current settings of a device, e.g. its button mappings, are
+ * never cached.
+ *
+ * The directory must exist and be writable. The cache is disabled by
+ * default, passing NULL disables it again.
+ *
+ * @param ratbag A previously initialized ratbag context
+ * @param path The cache directory, or NULL
+ * @return 0 on success or a negative errno on error
+ *
+ * @see ratbag_get_cache_dir
+ */
+int
+ratbag_set_cache_dir(struct ratbag *ratbag, const char *path);
+
+/**
+ * @ingroup base
+ *
+ * @param ratbag A previously initialized ratbag context
+ * @return The cache directory, or NULL if the cache is disabled
+ *
+ * @see ratbag_set_cache_dir
+ */
+const char *
+ratbag_get_cache_dir(const struct ratbag *ratbag);
+
 #ifdef __cplusplus
 }
 #endif
@@ -0,0 +1,459 @@
+/*
+ * Copyright © 2015 Red Hat, Inc.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the next
+ * paragraph) shall be included in all copies or substantial portions of the
+ * Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+
+/*
+ * Benchmarks of the library against simulated devices. Every benchmark
+ * repeats one operation and reports the operations per second, the round
+ * trips to the device and the heap allocations each one took, as JSON on
+ * stdout.
+ *
+ * Usage: bench-sim [--latency-us N] [--iterations N] [name ...]
+ */
+
+#include <config.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <inttypes.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "libratbag.h"
+#include "libratbag-sim.h"
+
+/* the round-trip time of the simulated devices, about what a wired mouse
+ * takes */
+#define BENCH_DEFAULT_LATENCY_US 1000
+
+/*
+ * The allocations are counted by replacing the allocator of the process,
+ * the calls are passed on to the one of the C library.
+ */
+extern void *__libc_malloc(size_t size);
+extern void *__libc_calloc(size_t nmemb, size_t size);
+extern void *__libc_realloc(void *ptr, size_t size);
+extern void __libc_free(void *ptr);
+
+static uint64_t num_allocations;
+
+void *
+malloc(size_t size)
+{
+	num_allocations++;
+	return __libc_malloc(size);
+}
+
+void *
+calloc(size_t nmemb, size_t size)
+{
+	num_allocations++;
+	return __libc_calloc(nmemb, size);
+}
+
+void *
+realloc(void *ptr, size_t size)
+{
+	num_allocations++;
+	return __libc_realloc(ptr, size);
+}
+
+void
+free(void *ptr)
+{
+	__libc_free(ptr);
+}
+
+static int
+open_restricted(const char *path, int flags, void *user_data)
+{
+	int fd = open(path, flags);
+
+	return fd < 0 ? -errno : fd;
+}
+
+static void
+close_restricted(int fd, void *user_data)
+{
+	close(fd);
+}
+
+static const struct ratbag_interface bench_iface = {
+	.open_restricted = open_restricted,
+	.close_restricted = close_restricted,
+};
+
+static inline uint64_t
+now_in_us(void)
+{
+	struct timespec ts = { 0, 0 };
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000ULL + ts.tv_nsec / 1000;
+}
+
+struct bench_state {
+	struct ratbag *ratbag;
+	struct ratbag_sim_config config;
+	struct ratbag_device *device;
+	struct ratbag_profile *profile;
+	struct ratbag_resolution *resolution;
+	struct ratbag_button *button;
+	unsigned int iteration;
+	/* the requests answered by the simulated devices */
+	uint64_t round_trips;
+};
+
+struct bench {
+	const char *name;
+	/** the device the benchmark runs against, if any */
+	enum ratbag_sim_protocol protocol;
+	const char *device_name;
+	struct input_id ids;
+	unsigned int iterations;
+
+	/** called once before and after the iterations, not measured */
+	int (*setup)(struct bench_state *state);
+	void (*teardown)(struct bench_state *state);
+	/** called before every iteration, not measured */
+	int (*prepare)(struct bench_state *state);
+	/** the measured operation */
+	int (*run)(struct bench_state *state);
+};
+
+static int
+bench_context_run(struct bench_state *state)
+{
+	struct ratbag *ratbag;
+
+	ratbag = ratbag_create_context(&bench_iface, NULL);
+	if (!ratbag)
+		return -ENOMEM;
+
+	ratbag_unref(ratbag);
+
+	return 0;
+}
+
+static int
+bench_probe_run(struct bench_state *state)
+{
+	struct ratbag_device *device;
+
+	device = ratbag_device_new_simulated(state->ratbag, &state->config);
+	if (!device)
+		return -ENODEV;
+
+	state->round_trips += ratbag_sim_get_num_requests(device);
+	ratbag_device_unref(device);
+
+	return 0;
+}
+
+static int
+bench_new_device(struct bench_state *state)
+{
+	state->device = ratbag_device_unref(state->device);
+	state->device = ratbag_device_new_simulated(state->ratbag,
+						    &state->config);
+
+	return state->device ? 0 : -ENODEV;
+}
+
+static int
+bench_read_profiles_run(struct bench_state *state)
+{
+	unsigned int before = ratbag_sim_get_num_requests(state->device);
+
+	while (ratbag_device_prefetch_profile(state->device))
+		;
+
+	state->round_trips += ratbag_sim_get_num_requests(state->device) - before;
+
+	return 0;
+}
+
+static int
+bench_profile_setup(struct bench_state *state)
+{
+	int rc;
+
+	rc = bench_new_device(state);
+	if (rc)
+		return rc;
+
+	state->profile = ratbag_device_get_profile_by_index(state->device, 0);
+	if (!state->profile)
+		return -ENODEV;
+
+	state->resolution = ratbag_profile_get_resolution(state->profile, 0);
+	state->button = ratbag_profile_get_button_by_index(state->profile, 1);
+	if (!state->resolution || !state->button)
+		return -ENODEV;
+
+	return 0;
+}
+
+static int
+bench_write_dpi_run(struct bench_state *state)
+{
+	unsigned int before = ratbag_sim_get_num_requests(state->device);
+	int rc;
+
+	/* a value that differs from the current one, or nothing is sent */
+	rc = ratbag_resolution_set_dpi(state->resolution,
+				       state->iteration % 2 ? 800 : 1600);
+
+	state->round_trips += ratbag_sim_get_num_requests(state->device) - before;
+
+	return rc;
+}
+
+static int
+bench_remap_button_run(struct bench_state *state)
+{
+	unsigned int before = ratbag_sim_get_num_requests(state->device);
+	int rc;
+
+	/* some drivers keep the buttons until the profile is written, the
+	 * commit writes them on all */
+	rc = ratbag_device_begin(state->device);
+	if (rc)
+		return rc;
+
+	/* middle and back, a value that differs from the current one */
+	rc = ratbag_button_set_button(state->button,
+				      state->iteration % 2 ? 3 : 4);
+	if (rc == 0)
+		rc = ratbag_device_commit(state->device);
+
+	state->round_trips += ratbag_sim_get_num_requests(state->device) - before;
+
+	return rc;
+}
+
+static void
+bench_teardown(struct bench_state *state)
+{
+	state->button = ratbag_button_unref(state->button);
+	state->resolution = ratbag_resolution_unref(state->resolution);
+	state->profile = ratbag_profile_unref(state->profile);
+	state->device = ratbag_device_unref(state->device);
+}
+
+#define HIDPP20 RATBAG_SIM_HIDPP20, "Simulated HID++ 2.0 mouse", \
+	{ BUS_USB, 0x046d, 0x4041, 0 }
+#define HIDPP10 RATBAG_SIM_HIDPP10, "Simulated HID++ 1.0 mouse", \
+	{ BUS_USB, 0x046d, 0xc24e, 0 }
+#define RECEIVER RATBAG_SIM_HIDPP10_RECEIVER, "Simulated M705", \
+	{ BUS_USB, 0x046d, 0x101b, 0 }
+#define ETEKCITY RATBAG_SIM_ETEKCITY, "Simulated EtekCity mouse", \
+	{ BUS_USB, 0x1ea7, 0x4011, 0 }
+
+static const struct bench benchmarks[] = {
+	{ "context", HIDPP20, 1000,
+	  NULL, NULL, NULL, bench_context_run },
+
+	{ "probe-hidpp20", HIDPP20, 20,
+	  NULL, NULL, NULL, bench_probe_run },
+	{ "probe-hidpp10", HIDPP10, 20,
+	  NULL, NULL, NULL, bench_probe_run },
+	{ "probe-hidpp10-receiver", RECEIVER, 20,
+	  NULL, NULL, NULL, bench_probe_run },
+	{ "probe-etekcity", ETEKCITY, 20,
+	  NULL, NULL, NULL, bench_probe_run },
+
+	{ "read-profiles-hidpp20", HIDPP20, 20,
+	  NULL, bench_teardown, bench_new_device, bench_read_profiles_run },
+	{ "read-profiles-hidpp10", HIDPP10, 20,
+	  NULL, bench_teardown, bench_new_device, bench_read_profiles_run },
+	{ "read-profiles-etekcity", ETEKCITY, 20,
+	  NULL, bench_teardown, bench_new_device, bench_read_profiles_run },
+
+	{ "write-dpi-hidpp20", HIDPP20, 50,
+	  bench_profile_setup, bench_teardown, NULL, bench_write_dpi_run },
+	{ "write-dpi-etekcity", ETEKCITY, 50,
+	  bench_profile_setup, bench_teardown, NULL, bench_write_dpi_run },
+
+	{ "remap-button-hidpp20", HIDPP20, 50,
+	  bench_profile_setup, bench_teardown, NULL, bench_remap_button_run },
+	{ "remap-button-etekcity", ETEKCITY, 50,
+	  bench_profile_setup, bench_teardown, NULL, bench_remap_button_run },
+};
+
+static int
+bench_run(const struct bench *bench, unsigned int latency_us,
+	  unsigned int iterations, bool first)
+{
+	struct bench_state state = {
+		.config = {
+			.protocol = bench->protocol,
+			.name = bench->device_name,
+			.ids = bench->ids,
+			.latency_us = latency_us,
+		},
+	};
+	uint64_t elapsed_us = 0, allocations = 0, start, allocs;
+	int rc = 0;
+
+	if (iterations == 0)
+		iterations = bench->iterations;
+
+	state.ratbag = ratbag_create_context(&bench_iface, NULL);
+	if (!state.ratbag)
+		return -ENOMEM;
+	ratbag_log_set_priority(state.ratbag, RATBAG_LOG_PRIORITY_ERROR);
+
+	if (bench->setup)
+		rc = bench->setup(&state);
+
+	for (state.iteration = 0;
+	     rc == 0 && state.iteration < iterations;
+	     state.iteration++) {
+		if (bench->prepare) {
+			rc = bench->prepare(&state);
+			if (rc)
+				break;
+		}
+
+		allocs = num_allocations;
+		start = now_in_us();
+		rc = bench->run(&state);
+		elapsed_us += now_in_us() - start;
+		allocations += num_allocations - allocs;
+	}
+
+	if (bench->teardown)
+		bench->teardown(&state);
+	ratbag_unref(state.ratbag);
+
+	if (rc) {
+		fprintf(stderr, "%s failed: %s (%d)\n",
+			bench->name, strerror(-rc), rc);
+		return rc;
+	}
+
+	printf("%s\n    {\"name\": \"%s\", \"iterations\": %u, "
+	       "\"ops_per_sec\": %.1f, \"round_trips_per_op\": %.2f, "
+	       "\"allocations_per_op\": %.2f}",
+	       first ? "" : ",",
+	       bench->name,
+	       iterations,
+	       elapsed_us ? iterations * 1e6 / elapsed_us : 0.0,
+	       (double)state.round_trips / iterations,
+	       (double)allocations / iterations);
+
+	return 0;
+}
+
+static bool
+bench_is_selected(const struct bench *bench, int argc, char **argv)
+{
+	int i;
+
+	if (argc == 0)
+		return true;
+
+	for (i = 0; i < argc; i++) {
+		if (strcmp(bench->name, argv[i]) == 0)
+			return true;
+	}
+
+	return false;
+}
+
+static void
+usage(void)
+{
+	unsigned int i;
+
+	printf("Usage: %s [--latency-us N] [--iterations N] [name ...]\n"
+	       "\n"
+	       "Benchmarks:\n",
+	       program_invocation_short_name);
+	for (i = 0; i < sizeof(benchmarks) / sizeof(benchmarks[0]); i++)
+		printf("    %s\n", benchmarks[i].name);
+}
+
+int
+main(int argc, char **argv)
+{
+	enum {
+		OPT_LATENCY,
+		OPT_ITERATIONS,
+		OPT_HELP,
+	};
+	static const struct option opts[] = {
+		{ "latency-us", 1, 0, OPT_LATENCY },
+		{ "iterations", 1, 0, OPT_ITERATIONS },
+		{ "help", 0, 0, OPT_HELP },
+		{ 0, 0, 0, 0 },
+	};
+	unsigned int latency_us = BENCH_DEFAULT_LATENCY_US;
+	unsigned int iterations = 0;
+	unsigned int i;
+	bool first = true;
+	int rc = 0;
+	int c;
+
+	while ((c = getopt_long(argc, argv, "", opts, NULL)) != -1) {
+		switch (c) {
+		case OPT_LATENCY:
+			latency_us = atoi(optarg);
+			break;
+		case OPT_ITERATIONS:
+			iterations = atoi(optarg);
+			break;
+		case OPT_HELP:
+			usage();
+			return 0;
+		default:
+			usage();
+			return 1;
+		}
+	}
+
+	argc -= optind;
+	argv += optind;
+
+	printf("{\n  \"latency_us\": %u,\n  \"benchmarks\": [", latency_us);
+
+	for (i = 0; i < sizeof(benchmarks) / sizeof(benchmarks[0]); i++) {
+		if (!bench_is_selected(&benchmarks[i], argc, argv))
+			continue;
+
+		rc = bench_run(&benchmarks[i], latency_us, iterations, first);
+		if (rc)
+			break;
+		first = false;
+	}
+
+	printf("\n  ]\n}\n");
+
+	return rc ? 1 : 0;
+}
@@ -114,6 +114,41 @@ START_TEST(context_ref)
 }
 END_TEST
 
+START_TEST(context_fd)
+{
+	struct ratbag *lr;
+	int fd;
+
+	lr = ratbag_create_context(&simple_iface, NULL);
+	ck_assert(lr != NULL);
+
+	fd = ratbag_get_fd(lr);
+	ck_assert_int_ge(fd, 0);
+
+	/* no devices, nothing to do, but must not block */
+	ck_assert_int_eq(ratbag_dispatch(lr), 0);
+
+	ratbag_unref(lr);
+}
+END_TEST
+
+START_TEST(context_request_timeout)
+{
+	struct ratbag *lr;
+
+	lr = ratbag_create_context(&simple_iface, NULL);
+	ck_assert(lr != NULL);
+
+	ck_assert_int_eq(ratbag_get_request_timeout(lr), 0);
+	ratbag_set_request_timeout(lr, 250);
+	ck_assert_int_eq(ratbag_get_request_timeout(lr), 250);
+	ratbag_set_request_timeout(lr, 0);
+	ck_assert_int_eq(ratbag_get_request_timeout(lr), 0);
+
+	ratbag_unref(lr);
+}
+END_TEST
+
 static Suite *
 test_context_suite(void)
 {
@@ -126,6 +161,11 @@ test_context_suite(void)
 	tcase_add_test(tc, context_init_bad_iface);
 	tcase_add_test(tc, context_init);
 	tcase_add_test(tc, context_ref);
+	tcase_add_test(tc, context_request_timeout);
+	suite_add_tcase(s, tc);
+
+	tc = tcase_create("fd");
+	tcase_add_test(tc, context_fd);
 	suite_add_tcase(s, tc);
 
 	return s;
@@ -0,0 +1,1293 @@
+/*
+ * Copyright © 2015 Red Hat, Inc.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the next
+ * paragraph) shall be included in all copies or substantial portions of the
+ * Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+
+#include <config.h>
+
+#include <check.h>
+#include <endian.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "libratbag.h"
+#include "libratbag-sim.h"
+
+static int
+open_restricted(const char *path, int flags, void *user_data)
+{
+	int fd = open(path, flags);
+
+	if (fd < 0)
+		fprintf(stderr, "Failed to open %s (%s)\n",
+			path, strerror(errno));
+
+	return fd < 0 ? -errno : fd;
+}
+
+static void
+close_restricted(int fd, void *user_data)
+{
+	close(fd);
+}
+
+struct ratbag_interface simple_iface = {
+	.open_restricted = open_restricted,
+	.close_restricted = close_restricted,
+};
+
+START_TEST(sim_hidpp20)
+{
+	struct ratbag *lr;
+	struct ratbag_device *d;
+	struct ratbag_profile *p;
+	struct ratbag_resolution *res;
+	struct ratbag_sim_config config = {
+		.protocol = RATBAG_SIM_HIDPP20,
+		.name = "Simulated HID++ 2.0 mouse",
+		.ids = { BUS_USB, 0x046d, 0x4041, 0 },
+	};
+
+	lr = ratbag_create_context(&simple_iface, NULL);
+	ck_assert(lr != NULL);
+
+	d = ratbag_device_new_simulated(lr, &config);
+	ck_assert(d != NULL);
+	ck_assert_int_gt(ratbag_sim_get_num_requests(d), 0);
+	ck_assert_int_eq(ratbag_device_get_num_profiles(d), 1);
+	ck_assert_int_eq(ratbag_device_get_num_buttons(d), 8);
+	ck_assert(ratbag_device_has_capability(d, RATBAG_CAP_SWITCHABLE_RESOLUTION));
+
+	p = ratbag_device_get_profile_by_index(d, 0);
+	ck_assert(p != NULL);
+	res = ratbag_profile_get_resolution(p, 0);
+	ck_assert(res != NULL);
+	ck_assert_int_eq(ratbag_resolution_get_dpi(res), 1000);
+
+	ratbag_resolution_unref(res);
+	ratbag_profile_unref(p);
+	ratbag_device_unref(d);
+	ratbag_unref(lr);
+}
+END_TEST
+
+START_TEST(sim_hidpp20_cache)
+{
+	struct ratbag *lr;
+	struct ratbag_device *d;
+	struct ratbag_profile *p;
+	struct ratbag_resolution *res;
+	struct ratbag_sim_config config = {
+		.protocol = RATBAG_SIM_HIDPP20,
+		.name = "Simulated HID++ 2.0 mouse",
+		.ids = { BUS_USB, 0x046d, 0x4041, 0 },
+	};
+	char dir[] = "/tmp/ratbag-test-cache-XXXXXX";
+	char path[64];
+	unsigned int cold, warm;
+	uint32_t *junk;
+	off_t size, len, i;
+	int fd, rc;
+
+	ck_assert(mkdtemp(dir) != NULL);
+
+	lr = ratbag_create_context(&simple_iface, NULL);
+	ck_assert(lr != NULL);
+	ck_assert(ratbag_get_cache_dir(lr) == NULL);
+	rc = ratbag_set_cache_dir(lr, dir);
+	ck_assert_int_eq(rc, 0);
+	ck_assert_str_eq(ratbag_get_cache_dir(lr), dir);
+
+	/* the sensors are only cached once the profile has been read */
+	d = ratbag_device_new_simulated(lr, &config);
+	ck_assert(d != NULL);
+	p = ratbag_device_get_profile_by_index(d, 0);
+	ratbag_profile_unref(p);
+	cold = ratbag_sim_get_num_requests(d);
+	ratbag_device_unref(d);
+
+	snprintf(path, sizeof(path), "%s/0003-046d-4041-0000", dir);
+	ck_assert_int_eq(access(path, R_OK), 0);
+
+	d = ratbag_device_new_simulated(lr, &config);
+	ck_assert(d != NULL);
+	/* only the firmware revision is checked */
+	ck_assert_int_eq(ratbag_sim_get_num_requests(d), 1);
+	ck_assert_int_eq(ratbag_device_get_num_buttons(d), 8);
+
+	p = ratbag_device_get_profile_by_index(d, 0);
+	warm = ratbag_sim_get_num_requests(d);
+	ck_assert_int_lt(warm, cold);
+	res = ratbag_profile_get_resolution(p, 0);
+	ck_assert_int_eq(ratbag_resolution_get_dpi(res), 1000);
+
+	ratbag_resolution_unref(res);
+	ratbag_profile_unref(p);
+	ratbag_device_unref(d);
+
+	/* an entry of the right size with counts past the arrays is
+	 * ignored, the device is probed again */
+	fd = open(path, O_RDWR);
+	ck_assert_int_ge(fd, 0);
+	size = lseek(fd, 0, SEEK_END);
+	ck_assert_int_gt(size, 0);
+	len = (size / 2) & ~3;
+	junk = calloc(len / 4, sizeof(*junk));
+	for (i = 0; i < len / 4; i++)
+		junk[i] = htole32(16);
+	ck_assert_int_eq(pwrite(fd, junk, len, size - len), len);
+	free(junk);
+	close(fd);
+
+	d = ratbag_device_new_simulated(lr, &config);
+	ck_assert(d != NULL);
+	ck_assert_int_gt(ratbag_sim_get_num_requests(d), 1);
+	ck_assert_int_eq(ratbag_device_get_num_buttons(d), 8);
+	ratbag_device_unref(d);
+
+	rc = ratbag_set_cache_dir(lr, NULL);
+	ck_assert_int_eq(rc, 0);
+	ck_assert(ratbag_get_cache_dir(lr) == NULL);
+	ratbag_unref(lr);
+
+	unlink(path);
+	rmdir(dir);
+}
+END_TEST
+
+START_TEST(sim_hidpp10_cache)
+{
+	struct ratbag *lr;
+	struct ratbag_device *d;
+	struct ratbag_profile *p;
+	struct ratbag_stats stats;
+	struct ratbag_sim_config config = {
+		.protocol = RATBAG_SIM_HIDPP10,
+		.name = "Simulated HID++ 1.0 mouse",
+		.ids = { BUS_USB, 0x046d, 0xc24e, 0 },
+		.latency_us = 20000,
+	};
+	unsigned int before;
+
+	lr = ratbag_create_context(&simple_iface, NULL);
+	ck_assert(lr != NULL);
+
+	d = ratbag_device_new_simulated(lr, &config);
+	ck_assert(d != NULL);
+
+	/* the probe read the first profile. A notification read while
+	 * waiting for an answer drops the cached memory, the first profile
+	 * is read again. */
+	ratbag_sim_notify(d);
+	p = ratbag_device_get_profile_by_index(d, 1);
+	ck_assert(p != NULL);
+	ratbag_profile_unref(p);
+
+	before = ratbag_sim_get_num_requests(d);
+	p = ratbag_device_get_profile_by_index(d, 0);
+	ck_assert(p != NULL);
+	ck_assert_int_gt(ratbag_sim_get_num_requests(d), before + 2);
+	ratbag_profile_unref(p);
+
+	ratbag_device_get_stats(d, &stats);
+	ck_assert_int_eq(stats.discarded_reports, 0);
+
+	/* the answers that come too late are not left for the next
+	 * requests */
+	ratbag_set_request_timeout(lr, 15);
+	p = ratbag_device_get_profile_by_index(d, 2);
+	ratbag_profile_unref(p);
+	ratbag_device_get_stats(d, &stats);
+	ck_assert_int_gt(stats.requests[RATBAG_STATS_CLASS_HIDPP10].timeouts, 0);
+	ck_assert_int_eq(ratbag_sim_get_num_queued(d), 0);
+	ratbag_set_request_timeout(lr, 0);
+
+	ratbag_device_unref(d);
+	ratbag_unref(lr);
+}
+END_TEST
+
+START_TEST(sim_hidpp10)
+{
+	struct ratbag *lr;
+	struct ratbag_device *d;
+	struct ratbag_profile *p;
+	struct ratbag_sim_config config = {
+		.protocol = RATBAG_SIM_HIDPP10,
+		.name = "Simulated HID++ 1.0 mouse",
+		.ids = { BUS_USB, 0x046d, 0xc24e, 0 },
+	};
+	unsigned int probed;
+
+	lr = ratbag_create_context(&simple_iface, NULL);
+	ck_assert(lr != NULL);
+
+	d = ratbag_device_new_simulated(lr, &config);
+	ck_assert(d != NULL);
+	probed = ratbag_sim_get_num_requests(d);
+	ck_assert_int_gt(probed, 0);
+
+	/* the first profile was read during the probe already, only the
+	 * current profile and resolution are asked for */
+	p = ratbag_device_get_profile_by_index(d, 0);
+	ck_assert(p != NULL);
+	ck_assert_int_eq(ratbag_sim_get_num_requests(d), probed + 2);
+	ratbag_profile_unref(p);
+
+	ratbag_device_unref(d);
+	ratbag_unref(lr);
+}
+END_TEST
+
+START_TEST(sim_pointer_motion)
+{
+	struct ratbag *lr;
+	struct ratbag_device *d;
+	struct ratbag_profile *p;
+	struct ratbag_resolution *res;
+	struct ratbag_sim_config config = {
+		.protocol = RATBAG_SIM_HIDPP20,
+		.name = "Simulated HID++ 2.0 mouse",
+		.ids = { BUS_USB, 0x046d, 0x4041, 0 },
+		.latency_us = 2000,
+		.motion_hz = 1000,
+	};
+
+	lr = ratbag_create_context(&simple_iface, NULL);
+	ck_assert(lr != NULL);
+
+	/* the answers arrive between the motion reports of a mouse being
+	 * moved during the whole configuration */
+	d = ratbag_device_new_simulated(lr, &config);
+	ck_assert(d != NULL);
+	ck_assert_int_eq(ratbag_device_get_num_buttons(d), 8);
+
+	p = ratbag_device_get_profile_by_index(d, 0);
+	ck_assert(p != NULL);
+	res = ratbag_profile_get_resolution(p, 0);
+	ck_assert_int_eq(ratbag_resolution_get_dpi(res), 1000);
+	ck_assert_int_eq(ratbag_resolution_set_dpi(res, 1200), 0);
+	ck_assert_int_eq(ratbag_resolution_get_dpi(res), 1200);
+
+	ratbag_resolution_unref(res);
+	ratbag_profile_unref(p);
+	ratbag_device_unref(d);
+
+	config.protocol = RATBAG_SIM_HIDPP10;
+	config.name = "Simulated HID++ 1.0 mouse";
+	config.ids.product = 0xc24e;
+	d = ratbag_device_new_simulated(lr, &config);
+	ck_assert(d != NULL);
+	p = ratbag_device_get_profile_by_index(d, 0);
+	ck_assert(p != NULL);
+	ratbag_profile_unref(p);
+	ratbag_device_unref(d);
+
+	ratbag_unref(lr);
+}
+END_TEST
+
+START_TEST(sim_receiver)
+{
+	struct ratbag *lr;
+	struct ratbag_device *d1, *d2, *d3;
+	struct ratbag_sim_config config = {
+		.protocol = RATBAG_SIM_HIDPP10_RECEIVER,
+		.name = "Simulated M705",
+		.ids = { BUS_USB, 0x046d, 0x101b, 0 },
+	};
+	unsigned int first, second, third;
+
+	lr = ratbag_create_context(&simple_iface, NULL);
+	ck_assert(lr != NULL);
+
+	d1 = ratbag_device_new_simulated(lr, &config);
+	ck_assert(d1 != NULL);
+	first = ratbag_sim_get_num_requests(d1);
+
+	config.name = "Simulated M570";
+	config.ids.product = 0x1028;
+	config.receiver = d1;
+	d2 = ratbag_device_new_simulated(lr, &config);
+	ck_assert(d2 != NULL);
+	second = ratbag_sim_get_num_requests(d2) - first;
+
+	config.name = "Simulated G500s";
+	config.ids.product = 0xc24e;
+	d3 = ratbag_device_new_simulated(lr, &config);
+	ck_assert(d3 != NULL);
+	third = ratbag_sim_get_num_requests(d3) - first - second;
+
+	/* the pairing information is read once, and the mice paired
+	 * before are not asked again */
+	ck_assert_int_lt(second, first);
+	ck_assert_int_eq(third, second);
+	/* finding the mouse among them takes the six pairing slots, the
+	 * rest is its first profile */
+	ck_assert_int_eq(first - second, 6);
+
+	ratbag_device_unref(d3);
+	ratbag_device_unref(d2);
+	ratbag_device_unref(d1);
+	ratbag_unref(lr);
+}
+END_TEST
+
+START_TEST(sim_etekcity)
+{
+	struct ratbag *lr;
+	struct ratbag_device *d;
+	struct ratbag_sim_config config = {
+		.protocol = RATBAG_SIM_ETEKCITY,
+		.name = "Simulated EtekCity mouse",
+		.ids = { BUS_USB, 0x1ea7, 0x4011, 0 },
+	};
+
+	lr = ratbag_create_context(&simple_iface, NULL);
+	ck_assert(lr != NULL);
+
+	d = ratbag_device_new_simulated(lr, &config);
+	ck_assert(d != NULL);
+	ck_assert_int_eq(ratbag_device_get_num_profiles(d), 5);
+
+	ratbag_device_unref(d);
+	ratbag_unref(lr);
+}
+END_TEST
+
+START_TEST(sim_lazy_profiles)
+{
+	struct ratbag *lr;
+	struct ratbag_device *d;
+	struct ratbag_profile *p;
+	struct ratbag_sim_config config = {
+		.protocol = RATBAG_SIM_ETEKCITY,
+		.name = "Simulated EtekCity mouse",
+		.ids = { BUS_USB, 0x1ea7, 0x4011, 0 },
+	};
+	unsigned int probed, loaded;
+	int prefetched = 0;
+
+	lr = ratbag_create_context(&simple_iface, NULL);
+	ck_assert(lr != NULL);
+
+	d = ratbag_device_new_simulated(lr, &config);
+	ck_assert(d != NULL);
+	probed = ratbag_sim_get_num_requests(d);
+
+	/* the first access reads the profile, later ones do not */
+	p = ratbag_device_get_profile_by_index(d, 2);
+	ck_assert(p != NULL);
+	loaded = ratbag_sim_get_num_requests(d);
+	ck_assert_int_gt(loaded, probed);
+	ratbag_profile_unref(p);
+
+	p = ratbag_device_get_profile_by_index(d, 2);
+	ck_assert(p != NULL);
+	ck_assert_int_eq(ratbag_sim_get_num_requests(d), loaded);
+	ratbag_profile_unref(p);
+
+	/* one profile per call, the last call reads the last profile */
+	while (ratbag_device_prefetch_profile(d))
+		prefetched++;
+	ck_assert_int_eq(prefetched, 3);
+	ck_assert_int_gt(ratbag_sim_get_num_requests(d), loaded);
+
+	loaded = ratbag_sim_get_num_requests(d);
+	ck_assert_int_eq(ratbag_device_prefetch_profile(d), 0);
+	p = ratbag_device_get_profile_by_index(d, 4);
+	ck_assert(p != NULL);
+	ck_assert_int_eq(ratbag_sim_get_num_requests(d), loaded);
+	ratbag_profile_unref(p);
+
+	ratbag_device_unref(d);
+	ratbag_unref(lr);
+}
+END_TEST
+
+START_TEST(sim_object_lifetime)
+{
+	struct ratbag *lr;
+	struct ratbag_device *d;
+	struct ratbag_profile *p, *p2;
+	struct ratbag_button *b, *b2;
+	struct ratbag_resolution *res;
+	struct ratbag_sim_config config = {
+		.protocol = RATBAG_SIM_ETEKCITY,
+		.name = "Simulated EtekCity mouse",
+		.ids = { BUS_USB, 0x1ea7, 0x4011, 0 },
+	};
+
+	lr = ratbag_create_context(&simple_iface, NULL);
+	ck_assert(lr != NULL);
+
+	d = ratbag_device_new_simulated(lr, &config);
+	ck_assert(d != NULL);
+	ck_assert_int_gt(ratbag_device_get_num_buttons(d), 1);
+
+	/* the same objects are handed out every time */
+	p = ratbag_device_get_profile_by_index(d, 1);
+	p2 = ratbag_device_get_profile_by_index(d, 1);
+	ck_assert(p == p2);
+	ck_assert(ratbag_profile_unref(p2) == p);
+	b = ratbag_profile_get_button_by_index(p, 1);
+	b2 = ratbag_profile_get_button_by_index(p, 1);
+	ck_assert(b == b2);
+	ratbag_button_unref(b2);
+	ck_assert(ratbag_profile_get_button_by_index(p,
+			ratbag_device_get_num_buttons(d)) == NULL);
+	res = ratbag_profile_get_resolution(p, 0);
+	ck_assert(res != NULL);
+
+	/* the objects keep the device alive */
+	ck_assert(ratbag_device_unref(d) == d);
+	ck_assert(ratbag_profile_unref(p) == NULL);
+	ck_assert_int_ne(ratbag_button_get_type(b), RATBAG_BUTTON_TYPE_UNKNOWN);
+	ck_assert_int_gt(ratbag_resolution_get_dpi(res), 0);
+	ck_assert(ratbag_button_unref(b) == NULL);
+	ck_assert(ratbag_resolution_unref(res) == NULL);
+
+	ratbag_unref(lr);
+}
+END_TEST
+
+START_TEST(sim_snapshot)
+{
+	struct ratbag *lr;
+	struct ratbag_device *d;
+	struct ratbag_profile *p;
+	struct ratbag_resolution *res;
+	struct ratbag_button *b;
+	struct ratbag_sim_config config = {
+		.protocol = RATBAG_SIM_ETEKCITY,
+		.name = "Simulated EtekCity mouse",
+		.ids = { BUS_USB, 0x1ea7, 0x4011, 0 },
+	};
+	struct ratbag_snapshot snapshot = {
+		.version = RATBAG_SNAPSHOT_VERSION,
+	};
+	unsigned int num_profiles, num_buttons, before, inactive;
+	int rc;
+
+	lr = ratbag_create_context(&simple_iface, NULL);
+	ck_assert(lr != NULL);
+
+	d = ratbag_device_new_simulated(lr, &config);
+	ck_assert(d != NULL);
+	num_profiles = ratbag_device_get_num_profiles(d);
+	num_buttons = ratbag_device_get_num_buttons(d);
+	ck_assert_int_gt(num_profiles, 1);
+
+	/* the caller is told how much room it needs */
+	rc = ratbag_device_get_snapshot(d, &snapshot);
+	ck_assert_int_eq(rc, -ENOSPC);
+	ck_assert_int_eq(snapshot.num_profiles, num_profiles);
+	ck_assert_int_eq(snapshot.num_buttons, num_buttons);
+
+	snapshot.profiles = calloc(num_profiles, sizeof(*snapshot.profiles));
+	snapshot.buttons = calloc(num_profiles * num_buttons,
+				  sizeof(*snapshot.buttons));
+	rc = ratbag_device_get_snapshot(d, &snapshot);
+	ck_assert_int_eq(rc, 0);
+
+	p = ratbag_device_get_profile_by_index(d, 0);
+	res = ratbag_profile_get_resolution(p, 1);
+	b = ratbag_profile_get_button_by_index(p, 1);
+	ck_assert_int_eq(snapshot.profiles[0].num_resolutions,
+			 ratbag_profile_get_num_resolutions(p));
+	ck_assert_int_eq(snapshot.profiles[0].resolutions[1].dpi,
+			 ratbag_resolution_get_dpi(res));
+	ck_assert_int_eq(snapshot.buttons[1].type, ratbag_button_get_type(b));
+	ck_assert_int_eq(snapshot.buttons[1].action_type,
+			 ratbag_button_get_action_type(b));
+
+	/* nothing changed, nothing is written */
+	before = ratbag_sim_get_num_requests(d);
+	rc = ratbag_device_apply_snapshot(d, &snapshot);
+	ck_assert_int_eq(rc, 0);
+	ck_assert_int_eq(ratbag_sim_get_num_requests(d), before);
+
+	/* all changes to a profile are written at once */
+	inactive = snapshot.profiles[0].is_active ? 1 : 0;
+	snapshot.profiles[0].resolutions[0].dpi = 1200;
+	snapshot.profiles[0].resolutions[1].dpi = 2400;
+	snapshot.buttons[1].action_type = RATBAG_BUTTON_ACTION_TYPE_BUTTON;
+	snapshot.buttons[1].action = 3;
+	snapshot.profiles[inactive].is_active = 1;
+	before = ratbag_sim_get_num_requests(d);
+	rc = ratbag_device_apply_snapshot(d, &snapshot);
+	ck_assert_int_eq(rc, 0);
+	ck_assert_int_gt(ratbag_sim_get_num_requests(d), before);
+
+	ck_assert_int_eq(ratbag_resolution_get_dpi(res), 2400);
+	ck_assert_int_eq(ratbag_button_get_action_type(b),
+			 RATBAG_BUTTON_ACTION_TYPE_BUTTON);
+	ck_assert_int_eq(ratbag_button_get_button(b), 3);
+	ratbag_resolution_unref(res);
+	ratbag_button_unref(b);
+	ratbag_profile_unref(p);
+
+	p = ratbag_device_get_profile_by_index(d, inactive);
+	ck_assert(ratbag_profile_is_active(p));
+	ratbag_profile_unref(p);
+
+	/* a snapshot of another device is refused */
+	snapshot.num_buttons--;
+	rc = ratbag_device_apply_snapshot(d, &snapshot);
+	ck_assert_int_eq(rc, -EINVAL);
+
+	free(snapshot.profiles);
+	free(snapshot.buttons);
+	ratbag_device_unref(d);
+	ratbag_unref(lr);
+}
+END_TEST
+
+START_TEST(sim_snapshot_unsupported)
+{
+	struct ratbag *lr;
+	struct ratbag_device *d;
+	struct ratbag_profile *p;
+	struct ratbag_resolution *res;
+	struct ratbag_sim_config config = {
+		.protocol = RATBAG_SIM_HIDPP10,
+		.name = "Simulated HID++ 1.0 mouse",
+		.ids = { BUS_USB, 0x046d, 0xc24e, 0 },
+	};
+	struct ratbag_snapshot snapshot = {
+		.version = RATBAG_SNAPSHOT_VERSION,
+	};
+	struct ratbag_snapshot_resolution *r;
+	char path[] = "/tmp/ratbag-test-import-XXXXXX";
+	unsigned int dpi, before;
+	uint16_t le_dpi;
+	int fd, rc;
+
+	lr = ratbag_create_context(&simple_iface, NULL);
+	ck_assert(lr != NULL);
+
+	/* the HID++ 1.0 driver cannot write the resolutions */
+	d = ratbag_device_new_simulated(lr, &config);
+	ck_assert(d != NULL);
+
+	rc = ratbag_device_get_snapshot(d, &snapshot);
+	ck_assert_int_eq(rc, -ENOSPC);
+	snapshot.profiles = calloc(snapshot.num_profiles,
+				   sizeof(*snapshot.profiles));
+	snapshot.buttons = calloc(snapshot.num_profiles * snapshot.num_buttons,
+				  sizeof(*snapshot.buttons));
+	rc = ratbag_device_get_snapshot(d, &snapshot);
+	ck_assert_int_eq(rc, 0);
+
+	p = ratbag_device_get_profile_by_index(d, 0);
+	res = ratbag_profile_get_resolution(p, 0);
+	dpi = ratbag_resolution_get_dpi(res);
+
+	r = &snapshot.profiles[0].resolutions[0];
+	r->dpi += 100;
+	before = ratbag_sim_get_num_requests(d);
+	rc = ratbag_device_apply_snapshot(d, &snapshot);
+	ck_assert_int_eq(rc, -ENOTSUP);
+	ck_assert_int_eq(ratbag_sim_get_num_requests(d), before);
+	ck_assert_int_eq(ratbag_resolution_get_dpi(res), dpi);
+	r->dpi = dpi;
+
+	/* no driver writes the report rate or the active resolution */
+	r->hz += 125;
+	rc = ratbag_device_apply_snapshot(d, &snapshot);
+	ck_assert_int_eq(rc, -ENOTSUP);
+	r->hz -= 125;
+
+	r->is_default = !r->is_default;
+	rc = ratbag_device_apply_snapshot(d, &snapshot);
+	ck_assert_int_eq(rc, -ENOTSUP);
+	r->is_default = !r->is_default;
+
+	rc = ratbag_device_apply_snapshot(d, &snapshot);
+	ck_assert_int_eq(rc, 0);
+
+	/* an export with another dpi is refused on import */
+	fd = mkstemp(path);
+	ck_assert_int_ge(fd, 0);
+	rc = ratbag_device_export(d, fd, RATBAG_EXPORT_FORMAT_BINARY);
+	ck_assert_int_eq(rc, 0);
+
+	/* the header, the first profile, then its first dpi */
+	le_dpi = htole16(dpi + 100);
+	ck_assert_int_eq(pwrite(fd, &le_dpi, sizeof(le_dpi), 24 + 2),
+			 sizeof(le_dpi));
+	lseek(fd, 0, SEEK_SET);
+	rc = ratbag_device_import(d, fd);
+	ck_assert_int_eq(rc, -ENOTSUP);
+	ck_assert_int_eq(ratbag_sim_get_num_requests(d), before);
+	ck_assert_int_eq(ratbag_resolution_get_dpi(res), dpi);
+
+	close(fd);
+	unlink(path);
+
+	free(snapshot.profiles);
+	free(snapshot.buttons);
+	ratbag_resolution_unref(res);
+	ratbag_profile_unref(p);
+	ratbag_device_unref(d);
+	ratbag_unref(lr);
+}
+END_TEST
+
+START_TEST(sim_export)
+{
+	struct ratbag *lr;
+	struct ratbag_device *d, *other;
+	struct ratbag_profile *p;
+	struct ratbag_resolution *res, *other_res;
+	struct ratbag_sim_config config = {
+		.protocol = RATBAG_SIM_ETEKCITY,
+		.name = "Simulated EtekCity mouse",
+		.ids = { BUS_USB, 0x1ea7, 0x4011, 0 },
+	};
+	char path[] = "/tmp/ratbag-test-export-XXXXXX";
+	char json[8192];
+	unsigned int dpi, before;
+	ssize_t len;
+	int i, fd, rc;
+
+	lr = ratbag_create_context(&simple_iface, NULL);
+	ck_assert(lr != NULL);
+
+	d = ratbag_device_new_simulated(lr, &config);
+	ck_assert(d != NULL);
+
+	fd = mkstemp(path);
+	ck_assert_int_ge(fd, 0);
+
+	rc = ratbag_device_export(d, fd, RATBAG_EXPORT_FORMAT_BINARY);
+	ck_assert_int_eq(rc, 0);
+
+	p = ratbag_device_get_profile_by_index(d, 0);
+	res = ratbag_profile_get_resolution(p, 0);
+	dpi = ratbag_resolution_get_dpi(res);
+	rc = ratbag_resolution_set_dpi(res, dpi + 400);
+	ck_assert_int_eq(rc, 0);
+
+	/* only the changed profile is written back */
+	before = ratbag_sim_get_num_requests(d);
+	lseek(fd, 0, SEEK_SET);
+	rc = ratbag_device_import(d, fd);
+	ck_assert_int_eq(rc, 0);
+	ck_assert_int_eq(ratbag_resolution_get_dpi(res), dpi);
+	ck_assert_int_gt(ratbag_sim_get_num_requests(d), before);
+
+	before = ratbag_sim_get_num_requests(d);
+	lseek(fd, 0, SEEK_SET);
+	rc = ratbag_device_import(d, fd);
+	ck_assert_int_eq(rc, 0);
+	ck_assert_int_eq(ratbag_sim_get_num_requests(d), before);
+
+	/* a device whose active resolution was switched since the export
+	 * gets the dpi back and keeps its active resolution */
+	rc = ratbag_resolution_set_dpi(res, dpi + 400);
+	ck_assert_int_eq(rc, 0);
+	for (i = 0; i < ratbag_profile_get_num_resolutions(p); i++) {
+		other_res = ratbag_profile_get_resolution(p, i);
+		if (!ratbag_resolution_is_active(other_res))
+			break;
+		other_res = ratbag_resolution_unref(other_res);
+	}
+	ck_assert(other_res != NULL);
+	rc = ratbag_resolution_set_active(other_res);
+	ck_assert_int_eq(rc, 0);
+	lseek(fd, 0, SEEK_SET);
+	rc = ratbag_device_import(d, fd);
+	ck_assert_int_eq(rc, 0);
+	ck_assert_int_eq(ratbag_resolution_get_dpi(res), dpi);
+	ck_assert(ratbag_resolution_is_active(other_res));
+	ratbag_resolution_unref(other_res);
+
+	/* a truncated file changes nothing */
+	rc = ftruncate(fd, 30);
+	ck_assert_int_eq(rc, 0);
+	lseek(fd, 0, SEEK_SET);
+	rc = ratbag_device_import(d, fd);
+	ck_assert_int_eq(rc, -EINVAL);
+
+	/* the file of another model is refused */
+	config.name = "Simulated HID++ 2.0 mouse";
+	config.protocol = RATBAG_SIM_HIDPP20;
+	config.ids.vendor = 0x046d;
+	config.ids.product = 0x4041;
+	other = ratbag_device_new_simulated(lr, &config);
+	ck_assert(other != NULL);
+	ck_assert_int_eq(ftruncate(fd, 0), 0);
+	lseek(fd, 0, SEEK_SET);
+	rc = ratbag_device_export(other, fd, RATBAG_EXPORT_FORMAT_BINARY);
+	ck_assert_int_eq(rc, 0);
+	lseek(fd, 0, SEEK_SET);
+	rc = ratbag_device_import(d, fd);
+	ck_assert_int_eq(rc, -ENODEV);
+
+	ck_assert_int_eq(ftruncate(fd, 0), 0);
+	lseek(fd, 0, SEEK_SET);
+	rc = ratbag_device_export(other, fd, RATBAG_EXPORT_FORMAT_JSON);
+	ck_assert_int_eq(rc, 0);
+	len = pread(fd, json, sizeof(json) - 1, 0);
+	ck_assert_int_gt(len, 0);
+	json[len] = '\0';
+	ck_assert(strstr(json, "\"product\": \"0x4041\"") != NULL);
+	ck_assert(strstr(json, "\"dpi\": ") != NULL);
+
+	close(fd);
+	unlink(path);
+
+	ratbag_resolution_unref(res);
+	ratbag_profile_unref(p);
+	ratbag_device_unref(other);
+	ratbag_device_unref(d);
+	ratbag_unref(lr);
+}
+END_TEST
+
+START_TEST(sim_transaction)
+{
+	struct ratbag *lr;
+	struct ratbag_device *d;
+	struct ratbag_profile *p;
+	struct ratbag_resolution *res;
+	struct ratbag_sim_config config = {
+		.protocol = RATBAG_SIM_ETEKCITY,
+		.name = "Simulated EtekCity mouse",
+		.ids = { BUS_USB, 0x1ea7, 0x4011, 0 },
+	};
+	unsigned int before, immediate, batched;
+	int i, nres, rc;
+
+	lr = ratbag_create_context(&simple_iface, NULL);
+	ck_assert(lr != NULL);
+
+	d = ratbag_device_new_simulated(lr, &config);
+	ck_assert(d != NULL);
+	p = ratbag_device_get_profile_by_index(d, 0);
+	ck_assert(p != NULL);
+	nres = ratbag_profile_get_num_resolutions(p);
+	ck_assert_int_gt(nres, 1);
+
+	rc = ratbag_device_commit(d);
+	ck_assert_int_eq(rc, -EINVAL);
+
+	before = ratbag_sim_get_num_requests(d);
+	for (i = 0; i < nres; i++) {
+		res = ratbag_profile_get_resolution(p, i);
+		rc = ratbag_resolution_set_dpi(res, 800 + i * 100);
+		ck_assert_int_eq(rc, 0);
+		ratbag_resolution_unref(res);
+	}
+	immediate = ratbag_sim_get_num_requests(d) - before;
+
+	rc = ratbag_device_begin(d);
+	ck_assert_int_eq(rc, 0);
+	rc = ratbag_device_begin(d);
+	ck_assert_int_eq(rc, -EBUSY);
+
+	before = ratbag_sim_get_num_requests(d);
+	for (i = 0; i < nres; i++) {
+		res = ratbag_profile_get_resolution(p, i);
+		rc = ratbag_resolution_set_dpi(res, 1600 + i * 100);
+		ck_assert_int_eq(rc, 0);
+		ck_assert_int_eq(ratbag_resolution_get_dpi(res), 1600 + i * 100);
+		ratbag_resolution_unref(res);
+	}
+	rc = ratbag_profile_set_active(p);
+	ck_assert_int_eq(rc, 0);
+
+	/* nothing is written until the commit */
+	ck_assert_int_eq(ratbag_sim_get_num_requests(d), before);
+
+	rc = ratbag_device_commit(d);
+	ck_assert_int_eq(rc, 0);
+	batched = ratbag_sim_get_num_requests(d) - before;
+	ck_assert_int_gt(batched, 0);
+	ck_assert_int_lt(batched, immediate);
+	ck_assert(ratbag_profile_is_active(p));
+
+	ratbag_profile_unref(p);
+	ratbag_device_unref(d);
+	ratbag_unref(lr);
+}
+END_TEST
+
+START_TEST(sim_transaction_failure)
+{
+	struct ratbag *lr;
+	struct ratbag_device *d;
+	struct ratbag_profile *p[3];
+	struct ratbag_resolution *res;
+	struct ratbag_sim_config config = {
+		.protocol = RATBAG_SIM_ETEKCITY,
+		.name = "Simulated EtekCity mouse",
+		.ids = { BUS_USB, 0x1ea7, 0x4011, 0 },
+	};
+	int idx[3] = { -1, -1, -1 };
+	unsigned int i, n, before;
+	int rc;
+
+	lr = ratbag_create_context(&simple_iface, NULL);
+	ck_assert(lr != NULL);
+
+	d = ratbag_device_new_simulated(lr, &config);
+	ck_assert(d != NULL);
+
+	/* two inactive profiles and the active one */
+	n = 0;
+	for (i = 0; i < ratbag_device_get_num_profiles(d); i++) {
+		struct ratbag_profile *profile;
+
+		profile = ratbag_device_get_profile_by_index(d, i);
+		if (ratbag_profile_is_active(profile))
+			idx[2] = i;
+		else if (n < 2)
+			idx[n++] = i;
+		ratbag_profile_unref(profile);
+	}
+	for (i = 0; i < 3; i++) {
+		ck_assert_int_ge(idx[i], 0);
+		p[i] = ratbag_device_get_profile_by_index(d, idx[i]);
+	}
+
+	/* the failed profile does not keep the other one from being
+	 * written and activated */
+	ratbag_sim_set_broken_profile(d, idx[0]);
+	rc = ratbag_device_begin(d);
+	ck_assert_int_eq(rc, 0);
+	for (i = 0; i < 2; i++) {
+		res = ratbag_profile_get_resolution(p[i], 0);
+		rc = ratbag_resolution_set_dpi(res, 1200);
+		ck_assert_int_eq(rc, 0);
+		ratbag_resolution_unref(res);
+	}
+	rc = ratbag_profile_set_active(p[1]);
+	ck_assert_int_eq(rc, 0);
+	rc = ratbag_device_commit(d);
+	ck_assert_int_eq(rc, -EPIPE);
+	ck_assert(ratbag_profile_is_active(p[1]));
+
+	/* the failed profile is written by the next commit */
+	ratbag_sim_set_broken_profile(d, -1);
+	rc = ratbag_device_begin(d);
+	ck_assert_int_eq(rc, 0);
+	before = ratbag_sim_get_num_requests(d);
+	rc = ratbag_device_commit(d);
+	ck_assert_int_eq(rc, 0);
+	ck_assert_int_gt(ratbag_sim_get_num_requests(d), before);
+
+	/* nothing left to write */
+	rc = ratbag_device_begin(d);
+	ck_assert_int_eq(rc, 0);
+	before = ratbag_sim_get_num_requests(d);
+	rc = ratbag_device_commit(d);
+	ck_assert_int_eq(rc, 0);
+	ck_assert_int_eq(ratbag_sim_get_num_requests(d), before);
+
+	/* a profile that cannot be written is not activated, the
+	 * activation waits for the next commit */
+	ratbag_sim_set_broken_profile(d, idx[0]);
+	rc = ratbag_device_begin(d);
+	ck_assert_int_eq(rc, 0);
+	res = ratbag_profile_get_resolution(p[0], 0);
+	rc = ratbag_resolution_set_dpi(res, 1600);
+	ck_assert_int_eq(rc, 0);
+	ratbag_resolution_unref(res);
+	rc = ratbag_profile_set_active(p[0]);
+	ck_assert_int_eq(rc, 0);
+	rc = ratbag_device_commit(d);
+	ck_assert_int_eq(rc, -EPIPE);
+	ck_assert(!ratbag_profile_is_active(p[0]));
+	ck_assert(ratbag_profile_is_active(p[1]));
+
+	ratbag_sim_set_broken_profile(d, -1);
+	rc = ratbag_device_begin(d);
+	ck_assert_int_eq(rc, 0);
+	rc = ratbag_device_commit(d);
+	ck_assert_int_eq(rc, 0);
+	ck_assert(ratbag_profile_is_active(p[0]));
+
+	for (i = 0; i < 3; i++)
+		ratbag_profile_unref(p[i]);
+	ratbag_device_unref(d);
+	ratbag_unref(lr);
+}
+END_TEST
+
+START_TEST(sim_write_unchanged)
+{
+	struct ratbag *lr;
+	struct ratbag_device *d;
+	struct ratbag_profile *p = NULL;
+	struct ratbag_resolution *res;
+	struct ratbag_sim_config config = {
+		.protocol = RATBAG_SIM_ETEKCITY,
+		.name = "Simulated EtekCity mouse",
+		.ids = { BUS_USB, 0x1ea7, 0x4011, 0 },
+	};
+	unsigned int i, before;
+	int rc;
+
+	lr = ratbag_create_context(&simple_iface, NULL);
+	ck_assert(lr != NULL);
+
+	d = ratbag_device_new_simulated(lr, &config);
+	ck_assert(d != NULL);
+
+	for (i = 0; i < ratbag_device_get_num_profiles(d); i++) {
+		p = ratbag_device_get_profile_by_index(d, i);
+		if (ratbag_profile_is_active(p))
+			break;
+		p = ratbag_profile_unref(p);
+	}
+	ck_assert(p != NULL);
+
+	/* applying the profile in place only asks for the active profile */
+	before = ratbag_sim_get_num_requests(d);
+	rc = ratbag_profile_set_active(p);
+	ck_assert_int_eq(rc, 0);
+	ck_assert_int_eq(ratbag_sim_get_num_requests(d), before + 1);
+
+	before = ratbag_sim_get_num_requests(d);
+	res = ratbag_profile_get_resolution(p, 0);
+	rc = ratbag_resolution_set_dpi(res, ratbag_resolution_get_dpi(res));
+	ck_assert_int_eq(rc, 0);
+	ck_assert_int_eq(ratbag_sim_get_num_requests(d), before);
+	ratbag_resolution_unref(res);
+
+	ratbag_profile_unref(p);
+	ratbag_device_unref(d);
+	ratbag_unref(lr);
+}
+END_TEST
+
+static inline unsigned int
+now_in_ms(void)
+{
+	struct timespec ts = { 0, 0 };
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+START_TEST(sim_settle_time)
+{
+	struct ratbag *lr;
+	struct ratbag_device *d;
+	struct ratbag_profile *p = NULL;
+	struct ratbag_resolution *res;
+	struct ratbag_sim_config config = {
+		.protocol = RATBAG_SIM_ETEKCITY,
+		.name = "Simulated EtekCity mouse",
+		.ids = { BUS_USB, 0x1ea7, 0x4011, 0 },
+		.settle_us = 20000,
+	};
+	unsigned int i, start;
+	int rc;
+
+	lr = ratbag_create_context(&simple_iface, NULL);
+	ck_assert(lr != NULL);
+
+	d = ratbag_device_new_simulated(lr, &config);
+	ck_assert(d != NULL);
+
+	for (i = 0; i < ratbag_device_get_num_profiles(d); i++) {
+		p = ratbag_device_get_profile_by_index(d, i);
+		if (!ratbag_profile_is_active(p))
+			break;
+		p = ratbag_profile_unref(p);
+	}
+	ck_assert(p != NULL);
+
+	/* the writes only go through if the driver waits for the device
+	 * between them, but it must not wait much longer than needed */
+	start = now_in_ms();
+	res = ratbag_profile_get_resolution(p, 0);
+	rc = ratbag_resolution_set_dpi(res, 1200);
+	ck_assert_int_eq(rc, 0);
+	ratbag_resolution_unref(res);
+
+	rc = ratbag_profile_set_active(p);
+	ck_assert_int_eq(rc, 0);
+	ck_assert(ratbag_profile_is_active(p));
+	ck_assert_int_lt(now_in_ms() - start, 200);
+
+	ratbag_profile_unref(p);
+	ratbag_device_unref(d);
+	ratbag_unref(lr);
+}
+END_TEST
+
+START_TEST(sim_unknown_device)
+{
+	struct ratbag *lr;
+	struct ratbag_device *d;
+	struct ratbag_sim_config config = {
+		.protocol = RATBAG_SIM_HIDPP20,
+		.name = "Simulated unknown mouse",
+		.ids = { BUS_USB, 0x1234, 0x5678, 0 },
+	};
+
+	lr = ratbag_create_context(&simple_iface, NULL);
+	ck_assert(lr != NULL);
+
+	d = ratbag_device_new_simulated(lr, &config);
+	ck_assert(d == NULL);
+	ck_assert_int_eq(errno, ENOTSUP);
+
+	/* the ids of a supported mouse on another bus */
+	config.ids.bustype = BUS_BLUETOOTH;
+	config.ids.vendor = 0x046d;
+	config.ids.product = 0x4041;
+	d = ratbag_device_new_simulated(lr, &config);
+	ck_assert(d == NULL);
+	ck_assert_int_eq(errno, ENOTSUP);
+
+	config.ids.bustype = BUS_USB;
+	d = ratbag_device_new_simulated(lr, &config);
+	ck_assert(d != NULL);
+	ratbag_device_unref(d);
+
+	ratbag_unref(lr);
+}
+END_TEST
+
+START_TEST(sim_capture)
+{
+	struct ratbag *lr;
+	struct ratbag_device *d;
+	struct ratbag_sim_config config = {
+		.protocol = RATBAG_SIM_HIDPP20,
+		.name = "Simulated HID++ 2.0 mouse",
+		.ids = { BUS_USB, 0x046d, 0x4041, 0 },
+	};
+	char path[] = "/tmp/ratbag-test-capture-XXXXXX";
+	uint32_t data[4096];
+	unsigned int num_idb = 0, num_epb = 0;
+	size_t offset = 0;
+	ssize_t len;
+	int fd, rc;
+
+	lr = ratbag_create_context(&simple_iface, NULL);
+	ck_assert(lr != NULL);
+
+	fd = mkstemp(path);
+	ck_assert_int_ge(fd, 0);
+
+	rc = ratbag_capture_write(lr, fd);
+	ck_assert_int_eq(rc, -ENODATA);
+
+	/* far fewer records than the probe takes reports */
+	rc = ratbag_capture_enable(lr, 8);
+	ck_assert_int_eq(rc, 0);
+	d = ratbag_device_new_simulated(lr, &config);
+	ck_assert(d != NULL);
+	ck_assert_int_gt(ratbag_sim_get_num_requests(d), 8);
+
+	rc = ratbag_capture_write(lr, fd);
+	ck_assert_int_eq(rc, 0);
+
+	len = pread(fd, data, sizeof(data), 0);
+	ck_assert_int_gt(len, 0);
+	ck_assert_int_lt(len, sizeof(data));
+
+	/* the section header, then an interface for the device and the
+	 * most recent reports */
+	ck_assert_int_eq(data[0], 0x0A0D0D0A);
+	ck_assert_int_eq(data[2], 0x1A2B3C4D);
+	while (offset < (size_t)len) {
+		uint32_t *block = &data[offset / 4];
+
+		ck_assert_int_eq(block[1] % 4, 0);
+		ck_assert_int_eq(block[block[1] / 4 - 1], block[1]);
+		if (block[0] == 1)
+			num_idb++;
+		else if (block[0] == 6)
+			num_epb++;
+		offset += block[1];
+	}
+	ck_assert_int_eq(offset, len);
+	ck_assert_int_eq(num_idb, 1);
+	ck_assert_int_eq(num_epb, 8);
+
+	close(fd);
+	unlink(path);
+
+	ratbag_device_unref(d);
+	ratbag_unref(lr);
+}
+END_TEST
+
+static unsigned int log_counts[RATBAG_LOG_PRIORITY_ERROR + 1];
+
+static void
+count_log_handler(struct ratbag *ratbag,
+		  enum ratbag_log_priority priority,
+		  const char *format, va_list args)
+{
+	log_counts[priority]++;
+}
+
+START_TEST(sim_stats)
+{
+	struct ratbag *lr;
+	struct ratbag_device *d;
+	struct ratbag_stats stats;
+	struct ratbag_sim_config config = {
+		.protocol = RATBAG_SIM_HIDPP20,
+		.name = "Simulated HID++ 2.0 mouse",
+		.ids = { BUS_USB, 0x046d, 0x4041, 0 },
+		.latency_us = 2000,
+		.motion_hz = 1000,
+	};
+	const struct ratbag_stats_requests *r;
+	unsigned int i;
+	uint64_t total = 0;
+
+	lr = ratbag_create_context(&simple_iface, NULL);
+	ck_assert(lr != NULL);
+
+	d = ratbag_device_new_simulated(lr, &config);
+	ck_assert(d != NULL);
+
+	ratbag_device_get_stats(d, &stats);
+	r = &stats.requests[RATBAG_STATS_CLASS_HIDPP20];
+
+	/* every request the device answered, nothing else */
+	ck_assert_int_eq(r->count, ratbag_sim_get_num_requests(d));
+	ck_assert_int_eq(r->timeouts, 0);
+	ck_assert_int_eq(stats.requests[RATBAG_STATS_CLASS_HIDPP10].count, 0);
+	for (i = 0; i < RATBAG_STATS_LATENCY_BUCKETS; i++)
+		total += r->latency[i];
+	ck_assert_int_eq(total, r->count);
+
+	/* no answer is faster than the device */
+	ck_assert_int_ge(ratbag_stats_get_latency_percentile(&stats,
+							     RATBAG_STATS_CLASS_HIDPP20,
+							     0),
+			 2000);
+	ck_assert_int_eq(ratbag_stats_get_latency_percentile(&stats,
+							     RATBAG_STATS_CLASS_FEATURE_REPORT,
+							     50),
+			 0);
+
+	/* the mouse was moved while it was probed */
+	ck_assert_int_gt(stats.discarded_reports, 0);
+
+	ratbag_device_unref(d);
+	ratbag_unref(lr);
+}
+END_TEST
+
+START_TEST(sim_log_priority)
+{
+	struct ratbag *lr;
+	struct ratbag_device *d;
+	struct ratbag_sim_config config = {
+		.protocol = RATBAG_SIM_HIDPP20,
+		.name = "Simulated HID++ 2.0 mouse",
+		.ids = { BUS_USB, 0x046d, 0x4041, 0 },
+	};
+
+	lr = ratbag_create_context(&simple_iface, NULL);
+	ck_assert(lr != NULL);
+	ratbag_log_set_handler(lr, count_log_handler);
+
+	/* the protocol dumps only reach the handler if asked for */
+	memset(log_counts, 0, sizeof(log_counts));
+	d = ratbag_device_new_simulated(lr, &config);
+	ck_assert(d != NULL);
+	ck_assert_int_eq(log_counts[RATBAG_LOG_PRIORITY_RAW], 0);
+	ratbag_device_unref(d);
+
+	ratbag_log_set_priority(lr, RATBAG_LOG_PRIORITY_RAW);
+	d = ratbag_device_new_simulated(lr, &config);
+	ck_assert(d != NULL);
+	ck_assert_int_gt(log_counts[RATBAG_LOG_PRIORITY_RAW], 0);
+	ratbag_device_unref(d);
+
+	ratbag_unref(lr);
+}
+END_TEST
+
+static Suite *
+test_sim_suite(void)
+{
+	TCase *tc;
+	Suite *s;
+
+	s = suite_create("sim");
+
+	tc = tcase_create("probe");
+	tcase_add_test(tc, sim_hidpp20);
+	tcase_add_test(tc, sim_hidpp10);
+	tcase_add_test(tc, sim_receiver);
+	tcase_add_test(tc, sim_etekcity);
+	tcase_add_test(tc, sim_unknown_device);
+	tcase_add_test(tc, sim_pointer_motion);
+	tcase_add_test(tc, sim_log_priority);
+	tcase_add_test(tc, sim_capture);
+	tcase_add_test(tc, sim_stats);
+	suite_add_tcase(s, tc);
+
+	tc = tcase_create("profiles");
+	tcase_add_test(tc, sim_lazy_profiles);
+	tcase_add_test(tc, sim_object_lifetime);
+	tcase_add_test(tc, sim_snapshot);
+	tcase_add_test(tc, sim_snapshot_unsupported);
+	tcase_add_test(tc, sim_export);
+	tcase_add_test(tc, sim_transaction);
+	tcase_add_test(tc, sim_transaction_failure);
+	tcase_add_test(tc, sim_write_unchanged);
+	tcase_add_test(tc, sim_settle_time);
+	suite_add_tcase(s, tc);
+
+	tc = tcase_create("cache");
+	tcase_add_test(tc, sim_hidpp20_cache);
+	tcase_add_test(tc, sim_hidpp10_cache);
+	suite_add_tcase(s, tc);
+
+	return s;
+}
+
+int main(void)
+{
+	int nfailed;
+	Suite *s;
+	SRunner *sr;
+
+	s = test_sim_suite();
+	sr = srunner_create(s);
+
+	srunner_run_all(sr, CK_ENV);
+	nfailed = srunner_ntests_failed(sr);
+	srunner_free(sr);
+
+	return (nfailed == 0) ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -25,6 +25,7 @@
 #include <errno.h>
 #include <dirent.h>
 #include <fcntl.h>
+#include <inttypes.h>
 #include <stdio.h>
 #include <stdint.h>
 #include <string.h>
@@ -735,6 +736,250 @@ static const struct ratbag_cmd cmd_list = {
 	.help = "List the available devices",
 };
 
+/* the reports a probe and a full read of the profiles take, with room */
+#define CAPTURE_NUM_RECORDS 4096
+
+static int
+ratbag_cmd_capture(struct ratbag *ratbag, uint32_t flags, int argc, char **argv)
+{
+	const char *filename, *path;
+	struct ratbag_device *device;
+	int fd;
+	int rc;
+
+	if (argc != 2) {
+		usage();
+		return 1;
+	}
+
+	filename = argv[0];
+	path = argv[1];
+
+	rc = ratbag_capture_enable(ratbag, CAPTURE_NUM_RECORDS);
+	if (rc) {
+		error("Can't enable the capture: %s (%d)\n", strerror(-rc), rc);
+		return 1;
+	}
+
+	device = ratbag_cmd_open_device(ratbag, path);
+	if (!device) {
+		error("Looks like '%s' is not supported\n", path);
+		return 1;
+	}
+
+	while (ratbag_device_prefetch_profile(device))
+		;
+
+	device = ratbag_device_unref(device);
+
+	fd = open(filename, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (fd < 0) {
+		error("Can't open '%s': %s\n", filename, strerror(errno));
+		return 1;
+	}
+
+	rc = ratbag_capture_write(ratbag, fd);
+	close(fd);
+	if (rc) {
+		error("Can't write the capture: %s (%d)\n", strerror(-rc), rc);
+		return 1;
+	}
+
+	printf("Wrote the traffic with '%s' to %s\n", path, filename);
+
+	return 0;
+}
+
+static const struct ratbag_cmd cmd_capture = {
+	.name = "capture",
+	.cmd = ratbag_cmd_capture,
+	.args = "FILE",
+	.help = "Record the probe of the device into a pcapng file",
+};
+
+static int
+ratbag_cmd_export_format(struct ratbag *ratbag, int argc, char **argv,
+			 enum ratbag_export_format format)
+{
+	const char *filename, *path;
+	struct ratbag_device *device;
+	int fd;
+	int rc;
+
+	if (argc != 2) {
+		usage();
+		return 1;
+	}
+
+	filename = argv[0];
+	path = argv[1];
+
+	device = ratbag_cmd_open_device(ratbag, path);
+	if (!device) {
+		error("Looks like '%s' is not supported\n", path);
+		return 1;
+	}
+
+	fd = open(filename, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (fd < 0) {
+		error("Can't open '%s': %s\n", filename, strerror(errno));
+		device = ratbag_device_unref(device);
+		return 1;
+	}
+
+	rc = ratbag_device_export(device, fd, format);
+	close(fd);
+	device = ratbag_device_unref(device);
+	if (rc) {
+		error("Can't export the configuration: %s (%d)\n", strerror(-rc), rc);
+		return 1;
+	}
+
+	return 0;
+}
+
+static int
+ratbag_cmd_export(struct ratbag *ratbag, uint32_t flags, int argc, char **argv)
+{
+	return ratbag_cmd_export_format(ratbag, argc, argv,
+					RATBAG_EXPORT_FORMAT_BINARY);
+}
+
+static const struct ratbag_cmd cmd_export = {
+	.name = "export",
+	.cmd = ratbag_cmd_export,
+	.args = "FILE",
+	.help = "Save the configuration of the device to a file",
+};
+
+static int
+ratbag_cmd_export_json(struct ratbag *ratbag, uint32_t flags, int argc, char **argv)
+{
+	return ratbag_cmd_export_format(ratbag, argc, argv,
+					RATBAG_EXPORT_FORMAT_JSON);
+}
+
+static const struct ratbag_cmd cmd_export_json = {
+	.name = "export-json",
+	.cmd = ratbag_cmd_export_json,
+	.args = "FILE",
+	.help = "Save the configuration of the device as JSON",
+};
+
+static int
+ratbag_cmd_import(struct ratbag *ratbag, uint32_t flags, int argc, char **argv)
+{
+	const char *filename, *path;
+	struct ratbag_device *device;
+	int fd;
+	int rc;
+
+	if (argc != 2) {
+		usage();
+		return 1;
+	}
+
+	filename = argv[0];
+	path = argv[1];
+
+	fd = open(filename, O_RDONLY);
+	if (fd < 0) {
+		error("Can't open '%s': %s\n", filename, strerror(errno));
+		return 1;
+	}
+
+	device = ratbag_cmd_open_device(ratbag, path);
+	if (!device) {
+		error("Looks like '%s' is not supported\n", path);
+		close(fd);
+		return 1;
+	}
+
+	rc = ratbag_device_import(device, fd);
+	close(fd);
+	device = ratbag_device_unref(device);
+	if (rc) {
+		error("Can't import '%s': %s (%d)\n", filename, strerror(-rc), rc);
+		return 1;
+	}
+
+	return 0;
+}
+
+static const struct ratbag_cmd cmd_import = {
+	.name = "import",
+	.cmd = ratbag_cmd_import,
+	.args = "FILE",
+	.help = "Restore the configuration of the device from a file",
+};
+
+static int
+ratbag_cmd_stats(struct ratbag *ratbag, uint32_t flags, int argc, char **argv)
+{
+	static const char *class_names[RATBAG_STATS_NUM_CLASSES] = {
+		[RATBAG_STATS_CLASS_HIDPP10] = "HID++ 1.0",
+		[RATBAG_STATS_CLASS_HIDPP20] = "HID++ 2.0",
+		[RATBAG_STATS_CLASS_FEATURE_REPORT] = "feature reports",
+	};
+	const char *path;
+	struct ratbag_device *device;
+	struct ratbag_stats stats;
+	unsigned int i;
+
+	if (argc != 1) {
+		usage();
+		return 1;
+	}
+
+	path = argv[0];
+
+	device = ratbag_cmd_open_device(ratbag, path);
+	if (!device) {
+		error("Looks like '%s' is not supported\n", path);
+		return 1;
+	}
+
+	while (ratbag_device_prefetch_profile(device))
+		;
+
+	ratbag_device_get_stats(device, &stats);
+
+	printf("Requests to '%s':\n", ratbag_device_get_name(device));
+	for (i = 0; i < RATBAG_STATS_NUM_CLASSES; i++) {
+		const struct ratbag_stats_requests *r = &stats.requests[i];
+
+		if (r->count == 0 && r->timeouts == 0)
+			continue;
+
+		printf("  %s: %" PRIu64 " answered, %" PRIu64 " failed, %" PRIu64 " timed out, "
+		       "p50 < %uus, p99 < %uus\n",
+		       class_names[i], r->count, r->errors, r->timeouts,
+		       ratbag_stats_get_latency_percentile(&stats, i, 50) + 1,
+		       ratbag_stats_get_latency_percentile(&stats, i, 99) + 1);
+	}
+
+	for (i = 0; i < RATBAG_STATS_HIDPP_ERRORS; i++) {
+		if (stats.hidpp_errors[i])
+			printf("  HID++ error %02x%s: %" PRIu64 "\n",
+			       i, i == RATBAG_STATS_HIDPP_ERRORS - 1 ? " and above" : "",
+			       stats.hidpp_errors[i]);
+	}
+
+	printf("  retries: %" PRIu64 "\n", stats.retries);
+	printf("  discarded input reports: %" PRIu64 "\n", stats.discarded_reports);
+
+	device = ratbag_device_unref(device);
+
+	return 0;
+}
+
+static const struct ratbag_cmd cmd_stats = {
+	.name = "stats",
+	.cmd = ratbag_cmd_stats,
+	.args = NULL,
+	.help = "Read the profiles and print the request statistics",
+};
+
 static int
 ratbag_cmd_switch_dpi(struct ratbag *ratbag, uint32_t flags, int argc, char **argv)
 {
@@ -814,6 +1059,11 @@ static const struct ratbag_cmd cmd_switch_dpi = {
 static const struct ratbag_cmd *ratbag_commands[] = {
 	&cmd_info,
 	&cmd_list,
+	&cmd_capture,
+	&cmd_export,
+	&cmd_export_json,
+	&cmd_import,
+	&cmd_stats,
 	&cmd_change_button,
 	&cmd_switch_etekcity,
 	&cmd_switch_dpi,